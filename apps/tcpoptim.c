@@ -50,6 +50,8 @@
 #ifdef EXPOSE_EFLOW_DUMP
 #define TELEMETRY_FLAG_DUMP_EFLOWS	0x0002
 #endif
+#define TELEMETRY_FLAG_HASH_STATS	0x0004
+#define TELEMETRY_FLAG_MBUF_STATS	0x0008
 
 
 /* locals */
@@ -62,12 +64,16 @@ static struct ev_signal ev_sigint;
 static pthread_t initial_pthread_id;
 static volatile bool force_quit;
 static uint16_t burst_size = APP_DEFAULT_BURST_SIZE;
+static uint16_t small_mbuf_size;
+static unsigned sndbuf_chunks;
 
 static uint16_t vlan_idx;
 // Redefine this to be struct { uint16_t pub_vlan, uint16_t priv_vlan };
 static uint16_t vlan_id[APP_MAX_IF * 2];
 
 static struct rte_mempool *ack_pool[RTE_MAX_NUMA_NODES];
+static struct rte_mempool *small_pool[RTE_MAX_NUMA_NODES];
+static struct rte_mempool *sndbuf_pool[RTE_MAX_NUMA_NODES];
 
 static thread_local uint16_t priv_vlan;
 static thread_local uint16_t gport_id;
@@ -173,6 +179,22 @@ dump_eflows_cmd(__rte_unused const char *cmd, __rte_unused const char *params, _
 }
 #endif
 
+static int
+hash_stats_cmd(__rte_unused const char *cmd, __rte_unused const char *params, __rte_unused struct rte_tel_data *info)
+{
+	telemetry_set_flag(TELEMETRY_FLAG_HASH_STATS);
+
+	return 0;
+}
+
+static int
+mbuf_stats_cmd(__rte_unused const char *cmd, __rte_unused const char *params, __rte_unused struct rte_tel_data *info)
+{
+	telemetry_set_flag(TELEMETRY_FLAG_MBUF_STATS);
+
+	return 0;
+}
+
 static int
 write_buffer_cmd(__rte_unused const char *cmd, __rte_unused const char *params, __rte_unused struct rte_tel_data *info)
 {
@@ -222,9 +244,11 @@ sigterm_hdl(struct ev_loop *loop_p, __rte_unused struct ev_signal *w, __rte_unus
  * coming from the mbuf_pool passed as a parameter.
  */
 static inline int
-port_init(uint16_t port, struct rte_mempool *mbuf_pool, int ring_count)
+port_init(uint16_t port, struct rte_mempool *mbuf_pool, int ring_count, unsigned *option_flags)
 {
 	struct rte_eth_conf port_conf;
+	struct rte_eth_rss_conf *rss_conf;
+	uint8_t rss_key_len;
 	const uint16_t rx_rings = ring_count, tx_rings = ring_count;
 	uint16_t nb_rxd = APP_RX_RING_SIZE;
 	uint16_t nb_txd = APP_TX_RING_SIZE;
@@ -249,6 +273,51 @@ port_init(uint16_t port, struct rte_mempool *mbuf_pool, int ring_count)
 		port_conf.txmode.offloads |=
 			RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
 
+	/* Coalesced segments are sent as chained mbufs */
+	if (*option_flags & TFO_CONFIG_FL_COALESCE) {
+		if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MULTI_SEGS)
+			port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+		else {
+			printf("Port %u cannot send multi-segment packets, not coalescing segments\n", port);
+			*option_flags &= ~TFO_CONFIG_FL_COALESCE;
+		}
+	}
+
+	/* The IPv4 and TCP checksums of sent packets are calculated by the NIC
+	 * if it can, otherwise in software. The NIC also checks the checksums
+	 * of received packets if it can, so that bad segments are dropped. */
+	if (*option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD) {
+		if ((dev_info.tx_offload_capa & (RTE_ETH_TX_OFFLOAD_IPV4_CKSUM | RTE_ETH_TX_OFFLOAD_TCP_CKSUM)) ==
+		    (RTE_ETH_TX_OFFLOAD_IPV4_CKSUM | RTE_ETH_TX_OFFLOAD_TCP_CKSUM))
+			port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_IPV4_CKSUM | RTE_ETH_TX_OFFLOAD_TCP_CKSUM;
+		else {
+			printf("Port %u cannot offload TX checksums, calculating them in software\n", port);
+			*option_flags &= ~TFO_CONFIG_FL_CKSUM_OFFLOAD;
+		}
+
+		port_conf.rxmode.offloads |= dev_info.rx_offload_capa & (RTE_ETH_RX_OFFLOAD_IPV4_CKSUM | RTE_ETH_RX_OFFLOAD_TCP_CKSUM);
+	}
+
+	/* Use a symmetric RSS key so that both directions of a flow get the
+	 * same hash, which the library then uses as the flow hash. If the NIC
+	 * cannot do this the library calculates the hash itself. */
+	if (*option_flags & TFO_CONFIG_FL_NIC_RSS_HASH) {
+		rss_conf = &port_conf.rx_adv_conf.rss_conf;
+		rss_conf->rss_key = (uint8_t *)(uintptr_t)tfo_get_rss_key(&rss_key_len);
+		rss_conf->rss_key_len = dev_info.hash_key_size ? dev_info.hash_key_size : 40;
+		rss_conf->rss_hf = (RTE_ETH_RSS_IP | RTE_ETH_RSS_NONFRAG_IPV4_TCP | RTE_ETH_RSS_NONFRAG_IPV6_TCP) &
+					dev_info.flow_type_rss_offloads;
+
+		if (rss_conf->rss_key_len > rss_key_len || !rss_conf->rss_hf)
+			printf("Port %u cannot provide a symmetric RSS hash, key size %u, rss offloads 0x%" PRIx64 "\n",
+				port, dev_info.hash_key_size, dev_info.flow_type_rss_offloads);
+		else {
+			port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+			if (dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_RSS_HASH)
+				port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_RSS_HASH;
+		}
+	}
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0)
@@ -560,11 +629,6 @@ fwd_packet(uint16_t port, uint16_t queue_idx)
 	if (unlikely(nb_rx == 0))
 		return;
 
-#ifdef APP_SENDS_PKTS
-	/* Allow for forwarding packet and ACK, but also set a minimum */
-	tx_bufs.nb_inc = max(nb_rx * 2, 10);
-#endif
-
 	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
 #ifdef APP_DEBUG_PKT_DETAILS
 	char timestamp[24];
@@ -617,18 +681,20 @@ fwd_packet(uint16_t port, uint16_t queue_idx)
 #ifdef DEBUG_CHECK_PKTS
 		check_packets("fwd_packets before rte_eth_tx_burst");
 #endif
+		tfo_tx_prepare(&tx_bufs);
 		nb_tx = rte_eth_tx_burst(port, queue_idx, tx_bufs.m, tx_bufs.nb_tx);
 #ifdef DEBUG_CHECK_PKTS
 		check_packets("fwd_packets after rte_eth_tx_burst");
 #endif
 
 		if (tfo_post_send(&tx_bufs, nb_tx)) {
-			/* Some packets were not sent; try again */
+			/* Send the packets on the TX queue */
 			tfo_setup_failed_resend(&tx_bufs);
 
 #ifdef DEBUG_CHECK_PKTS
 			check_packets("fwd_packets before failed rte_eth_tx_burst");
 #endif
+			tfo_tx_prepare(&tx_bufs);
 			nb_tx = rte_eth_tx_burst(port, queue_idx, tx_bufs.m, tx_bufs.nb_tx);
 #ifdef DEBUG_CHECK_PKTS
 			check_packets("fwd_packets after failed rte_eth_tx_burst");
@@ -636,9 +702,6 @@ fwd_packet(uint16_t port, uint16_t queue_idx)
 			tfo_post_send(&tx_bufs, nb_tx);
 		}
 	}
-
-	if (tx_bufs.m)
-		rte_free(tx_bufs.m);
 #endif
 
 #ifdef APP_LOG_ACTIONS
@@ -652,7 +715,7 @@ process_timers(void)
 {
 	struct timespec ts;
 #ifdef APP_SENDS_PKTS
-	struct tfo_tx_bufs tx_bufs = { .m = NULL, .nb_inc = 1024 };
+	struct tfo_tx_bufs tx_bufs = { .m = NULL };
 	uint16_t nb_tx;
 #endif
 
@@ -683,6 +746,7 @@ process_timers(void)
 #ifdef DEBUG_CHECK_PKTS
 		check_packets("process_timers before rte_eth_tx_burst");
 #endif
+		tfo_tx_prepare(&tx_bufs);
 		nb_tx = rte_eth_tx_burst(gport_id, gqueue_idx, tx_bufs.m, tx_bufs.nb_tx);
 #ifdef DEBUG_CHECK_PKTS
 		check_packets("process_timers before rte_eth_tx_burst");
@@ -690,9 +754,6 @@ process_timers(void)
 
 		tfo_post_send(&tx_bufs, nb_tx);
 	}
-
-	if (tx_bufs.m)
-		rte_free(tx_bufs.m);
 #else
 	tfo_process_timers_send(&ts);
 #endif
@@ -728,10 +789,14 @@ lcore_main(__rte_unused void *arg)
 	params.public_vlan_tci = vlan_id[port * 2];
 	params.private_vlan_tci = vlan_id[port * 2 + 1];
 	params.ack_pool = ack_pool[rte_socket_id()];
+	params.small_pool = small_pool[rte_socket_id()];
+	params.sndbuf_pool = sndbuf_pool[rte_socket_id()];
 	params.port_id = gport_id;
 	params.queue_idx = gqueue_idx;
 
 	priv_mask = tcp_worker_init(&params);
+	if (!priv_mask)
+		rte_exit(EXIT_FAILURE, "Cannot initialise worker for port %u\n", port);
 	priv_vlan = vlan_id[port * 2 + 1];
 
 	telemetry_flag_address[port] = &telemetry_flag;
@@ -767,6 +832,28 @@ lcore_main(__rte_unused void *arg)
 				fclose(fp);
 			}
 #endif
+
+			if (telemetry_flag & TELEMETRY_FLAG_HASH_STATS) {
+				telemetry_flag &= ~TELEMETRY_FLAG_HASH_STATS;
+				char filename[128];
+				sprintf(filename, "/tmp/eflow_hash.%u.stats", port);
+				FILE *fp = fopen(filename, "a");
+				if (fp) {
+					tfo_eflow_hash_stats_fp(fp);
+					fclose(fp);
+				}
+			}
+
+			if (telemetry_flag & TELEMETRY_FLAG_MBUF_STATS) {
+				telemetry_flag &= ~TELEMETRY_FLAG_MBUF_STATS;
+				char filename[128];
+				sprintf(filename, "/tmp/mbuf.%u.stats", port);
+				FILE *fp = fopen(filename, "a");
+				if (fp) {
+					tfo_mbuf_stats_fp(fp);
+					fclose(fp);
+				}
+			}
 		}
 	}
 
@@ -781,11 +868,20 @@ print_help(const char *progname)
 	printf("\t-q vl[,vl]\tVlan id(s)\n");
 	printf("\t-e flows\tMax flows\n");
 	printf("\t-f flows\tMax optimised flows\n");
-	printf("\t-p bufp\t\tMax buffered packets\n");
-	printf("\t-X hash\t\tFlow hash size\n");
+	printf("\t-p bufp\t\tMax packets kept without their mbufs\n");
+	printf("\t-F kb[,mbufs]\tBuffer quota for each direction of a flow\n");
+	printf("\t-W kb[,mbufs]\tBuffer quota shared by the workers\n");
+	printf("\t-Q depth[,us]\tTX queue depth and drain timeout (default 512,100)\n");
+	printf("\t-X hash\t\tMaximum flow hash size\n");
 	printf("\t-t timeouts\tport:syn,est,fin TCP timeouts (port 0 = defaults)\n");
 	printf("\t-r tcp_win_rtt_wlen\ttcp_win_rtt_wlen in seconds\n");
 	printf("\t-b rx burst size\tmaximum no of packets to receive at once\n");
+	printf("\t-R\t\tUse the NIC symmetric RSS hash as the flow hash\n");
+	printf("\t-G\t\tCoalesce in order segments received in a burst\n");
+	printf("\t-M\t\tResegment unsent data to the MSS of the side it is sent to\n");
+	printf("\t-C\t\tOffload checksums to the NIC if it supports it\n");
+	printf("\t-S size\t\tCopy sent packets up to size bytes to small mbufs\n");
+	printf("\t-B chunks\tHold sent data in per flow send buffers, chunks per port\n");
 #ifdef DEBUG_STRUCTURES
 	printf("\t-a\t\tDump all eflows after processing packet\n");
 #endif
@@ -811,6 +907,50 @@ get_val(const char *optarg)
 	return val;
 }
 
+static int
+set_buf_quota(const char *optarg, uint64_t *bytes, uint32_t *mbufs)
+{
+	char *endptr;
+	long val;
+
+	val = strtol(optarg, &endptr, 10);
+	if ((*endptr && *endptr != ',') || val < 0 || val > INT_MAX)
+		return -1;
+	*bytes = (uint64_t)val * 1024;
+
+	if (!*endptr)
+		return 0;
+
+	val = strtol(endptr + 1, &endptr, 10);
+	if (*endptr || val < 0 || val > INT_MAX)
+		return -1;
+	*mbufs = val;
+
+	return 0;
+}
+
+static int
+set_tx_queue(const char *optarg, struct tcp_config *c)
+{
+	char *endptr;
+	long val;
+
+	val = strtol(optarg, &endptr, 10);
+	if ((*endptr && *endptr != ',') || val < 0 || val > UINT16_MAX)
+		return -1;
+	c->tx_queue_depth = val;
+
+	if (!*endptr)
+		return 0;
+
+	val = strtol(endptr + 1, &endptr, 10);
+	if (*endptr || val < 0 || val > INT_MAX)
+		return -1;
+	c->tx_queue_drain_us = val;
+
+	return 0;
+}
+
 static int
 set_timeout(const char *optarg, struct tcp_config *c)
 {
@@ -897,6 +1037,7 @@ main(int argc, char *argv[])
 	char opt;
 	long vlan0, vlan1;
 	int val;
+	uint64_t quota_bytes;
 	char *endptr;
 	struct tcp_config c = { .ef_n = 10000, .f_n = 10000 };
 	char packet_pool_name[] = "packet_pool_XXX";
@@ -936,7 +1077,7 @@ main(int argc, char *argv[])
 	c.option_flags |= TFO_CONFIG_FL_NO_MAC_CHG;
 #endif
 
-	while ((opt = getopt(argc, argv, ":Hq:e:f:p:X:t:r:b:"
+	while ((opt = getopt(argc, argv, ":Hq:e:f:p:F:W:Q:X:t:r:b:RGMCS:B:"
 #ifdef PER_THREAD_LOGS
 				         "l:"
 #endif
@@ -998,6 +1139,20 @@ main(int argc, char *argv[])
 			else
 				c.p_n = val;
 			break;
+		case 'F':
+			if (set_buf_quota(optarg, &quota_bytes, &c.flow_buf_mbufs) || quota_bytes > UINT32_MAX)
+				fprintf(stderr, "Invalid flow buffer quota %s\n", optarg);
+			else
+				c.flow_buf_bytes = quota_bytes;
+			break;
+		case 'W':
+			if (set_buf_quota(optarg, &c.worker_buf_bytes, &c.worker_buf_mbufs))
+				fprintf(stderr, "Invalid worker buffer quota %s\n", optarg);
+			break;
+		case 'Q':
+			if (set_tx_queue(optarg, &c))
+				fprintf(stderr, "Invalid TX queue %s\n", optarg);
+			break;
 		case 'X':
 			val = get_val(optarg);
 			if (val == -1)
@@ -1023,6 +1178,32 @@ main(int argc, char *argv[])
 			else
 				burst_size = val;
 			break;
+		case 'R':
+			c.option_flags |= TFO_CONFIG_FL_NIC_RSS_HASH;
+			break;
+		case 'G':
+			c.option_flags |= TFO_CONFIG_FL_COALESCE;
+			break;
+		case 'M':
+			c.option_flags |= TFO_CONFIG_FL_RESEGMENT;
+			break;
+		case 'C':
+			c.option_flags |= TFO_CONFIG_FL_CKSUM_OFFLOAD;
+			break;
+		case 'S':
+			val = get_val(optarg);
+			if (val <= 0 || val >= RTE_MBUF_DEFAULT_DATAROOM)
+				fprintf(stderr, "Invalid small mbuf size %s\n", optarg);
+			else
+				small_mbuf_size = val;
+			break;
+		case 'B':
+			val = get_val(optarg);
+			if (val <= 0)
+				fprintf(stderr, "Invalid send buffer chunks %s\n", optarg);
+			else
+				sndbuf_chunks = val;
+			break;
 #ifdef PER_THREAD_LOGS
 		case 'l':
 			if (!freopen(optarg, "a", stdout))
@@ -1068,8 +1249,14 @@ main(int argc, char *argv[])
 	}
 
 	/* Set defaults */
-	if (!c.p_n)
+	if (!c.p_n) {
 		c.p_n = c.f_n * 10;
+
+		/* Each packet whose data is in a send buffer needs a struct tfo_pkt.
+		 * Allow for segments of 1K on average. */
+		if (sndbuf_chunks)
+			c.p_n += sndbuf_chunks * nb_ports * (tfo_get_sndbuf_chunk_size() / 1024);
+	}
 	if (!c.hef_n)
 		c.hef_n = c.ef_n;
 	if (c.f_n > c.ef_n) {
@@ -1083,6 +1270,8 @@ main(int argc, char *argv[])
 	c.ef_n = (c.ef_n + nb_ports - 1) / nb_ports;
 	c.f_n = (c.f_n + nb_ports - 1) / nb_ports;
 	c.p_n = (c.p_n + nb_ports - 1) / nb_ports;
+	c.worker_buf_bytes = (c.worker_buf_bytes + nb_ports - 1) / nb_ports;
+	c.worker_buf_mbufs = (c.worker_buf_mbufs + nb_ports - 1) / nb_ports;
 
 #ifdef APP_DEBUG_PKT_DETAILS
 	printf("vlans");
@@ -1124,6 +1313,25 @@ main(int argc, char *argv[])
 			if (ack_pool[i] == NULL)
 				rte_exit(EXIT_FAILURE, "Cannot create ack mbuf pool\n");
 
+			/* Sent packets waiting to be acked are held in these,
+			 * so they need the same private area as packet_pool */
+			if (small_mbuf_size) {
+				snprintf(packet_pool_name, sizeof(packet_pool_name), "small_pool_%u", i);
+				small_pool[i] = rte_pktmbuf_pool_create(packet_pool_name, (APP_NUM_MBUFS + 1) * node_ports[i] - 1, APP_MBUF_CACHE_SIZE,
+						RTE_ALIGN(tfo_get_mbuf_priv_size(), RTE_MBUF_PRIV_ALIGN),
+						RTE_PKTMBUF_HEADROOM + small_mbuf_size, i);
+				if (small_pool[i] == NULL)
+					rte_exit(EXIT_FAILURE, "Cannot create small mbuf pool\n");
+			}
+
+			if (sndbuf_chunks) {
+				snprintf(packet_pool_name, sizeof(packet_pool_name), "sndbuf_pool_%u", i);
+				sndbuf_pool[i] = rte_mempool_create(packet_pool_name, sndbuf_chunks * node_ports[i], tfo_get_sndbuf_chunk_size(),
+						APP_MBUF_CACHE_SIZE, 0, NULL, NULL, NULL, NULL, i, 0);
+				if (sndbuf_pool[i] == NULL)
+					rte_exit(EXIT_FAILURE, "Cannot create send buffer pool\n");
+			}
+
 #ifdef APP_DEBUG_ACK_MEMPOOL_INIT
 			printf("Creating mempool %s\n", packet_pool_name);
 			show_mempool(packet_pool_name);
@@ -1147,7 +1355,7 @@ main(int argc, char *argv[])
 	/* initialize our ports. */
 	for (i = 0; i < nb_ports; i++) {
 		socket = rte_eth_dev_socket_id(port_id[i]);
-		if (port_init(port_id[i], mbuf_pool[socket], 1) != 0)
+		if (port_init(port_id[i], mbuf_pool[socket], 1, &c.option_flags) != 0)
 			rte_exit(EXIT_FAILURE, "Cannot init port[%u] %u\n", i, port_id[i]);
 
 #ifdef APP_DEBUG_MEMPOOL_INIT
@@ -1170,7 +1378,8 @@ main(int argc, char *argv[])
 	ev_signal_start(loop, &ev_sigterm);
 
 	/* The library will take over "ownership" of c->tcp_to */
-	tcp_init(&c);
+	if (tcp_init(&c))
+		rte_exit(EXIT_FAILURE, "Cannot initialise tcp optimizer\n");
 
 	/* Used for telemetry shutdown command to signal this thread */
 	initial_pthread_id = pthread_self();
@@ -1181,6 +1390,8 @@ main(int argc, char *argv[])
 	/* Register the telemetry commands */
 	telemetry_cmd_register("shutdown", shutdown_cmd, "Shuts down " PROG_NAME);
 	telemetry_cmd_register("write_buffer", write_buffer_cmd, "Write log buffers");
+	telemetry_cmd_register("hash_stats", hash_stats_cmd, "Write eflow hash statistics");
+	telemetry_cmd_register("mbuf_stats", mbuf_stats_cmd, "Write small mbuf and send buffer statistics");
 #ifdef EXPOSE_EFLOW_DUMP
 	telemetry_cmd_register("dump_eflows", dump_eflows_cmd, "Dump eflows");
 #endif
@@ -157,7 +157,7 @@ static void
 tfo_wrapper_process_burst(struct tfo_worker *w, uint32_t nb_rx)
 {
 	struct rte_mbuf *m;
-	struct tfo_tx_bufs tx_bufs = { .nb_tx = 0, .nb_inc = 16 };
+	struct tfo_tx_bufs tx_bufs = { .m = NULL, .nb_tx = 0 };
 	int r, from_priv;
 	uint32_t k;
 	uint16_t u;
@@ -180,8 +180,7 @@ tfo_wrapper_process_burst(struct tfo_worker *w, uint32_t nb_rx)
 			rte_pktmbuf_free(m);
 		}
 
-		if (tx_bufs.m)
-			rte_free(tx_bufs.m);
+		tx_bufs.nb_tx = 0;
 	}
 }
 
@@ -421,7 +420,8 @@ tfo_init(struct fn_app *a, struct fmcfg *cfg)
 
 	tfo_reload(&c, cfg);
 
-	tcp_init(&c);
+	if (tcp_init(&c))
+		return -1;
 
 	in_priv_mask = c.dynflag_in_priv_mask;
 
@@ -456,7 +456,10 @@ tfo_worker_init(void)
 	params.public_vlan_tci = 0;
 	params.private_vlan_tci = 1;
 
-	tcp_worker_init(&params);
+	if (!tcp_worker_init(&params))
+		return -1;
+
+	return 0;
 }
 
 static void
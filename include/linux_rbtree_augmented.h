@@ -23,8 +23,10 @@
 
 #include "linux_rbtree.h"
 
+#ifndef WRITE_ONCE
 #define WRITE_ONCE(l,r)	(l) = (r)
 #endif
+#endif
 
 /*
  * Please note - only struct rb_augment_callbacks and the prototypes for
@@ -70,6 +70,10 @@ union tfo_ip_p {
 #ifdef DEBUG_STRUCTURES
 #define	TFO_CONFIG_FL_DUMP_ALL_EFLOWS	0x08
 #endif
+#define TFO_CONFIG_FL_NIC_RSS_HASH	0x10	/* NIC is configured with tfo_get_rss_key() */
+#define TFO_CONFIG_FL_COALESCE		0x20	/* Coalesce segments, NIC must send chained mbufs */
+#define TFO_CONFIG_FL_RESEGMENT		0x40	/* Resegment unsent data to the MSS of the side it is sent to */
+#define TFO_CONFIG_FL_CKSUM_OFFLOAD	0x80	/* NIC calculates the IPv4 and TCP checksums of sent packets */
 
 struct tcp_config {
 	void 			(*capture_output_packet)(void *, int, const struct rte_mbuf *, const struct timespec *, int, union tfo_ip_p);
@@ -91,10 +95,22 @@ struct tcp_config {
 	uint32_t		hu_n;
 	uint32_t		hu_mask;
 	uint32_t		ef_n;
-	uint32_t		hef_n;
+	uint32_t		hef_n;		/* maximum eflow hash table size */
 	uint32_t		hef_mask;
 	uint32_t		f_n;
-	uint32_t		p_n;
+	uint32_t		p_n;		/* packets that can be kept without their mbuf */
+
+	/* Buffer quotas, 0 for no limit. The flow quotas apply to the data
+	 * buffered for each direction of a flow. */
+	uint32_t		flow_buf_bytes;
+	uint32_t		flow_buf_mbufs;
+	uint64_t		worker_buf_bytes;
+	uint32_t		worker_buf_mbufs;
+
+	/* Software TX queue of packets tx_burst did not accept, 0 for
+	 * the defaults */
+	uint16_t		tx_queue_depth;
+	uint32_t		tx_queue_drain_us;
 
 	/* tcp timeouts config, per port */
 	uint16_t		max_port_to;
@@ -116,14 +132,15 @@ struct tfo_worker_params {
 	uint16_t		public_vlan_tci;
 	uint16_t		private_vlan_tci;
 	struct			rte_mempool *ack_pool;
+	struct			rte_mempool *small_pool;	/* optional, for holding small sent packets */
+	struct			rte_mempool *sndbuf_pool;	/* optional, chunks for the per flow send buffers */
 };
 
 struct tfo_tx_bufs {
 	struct rte_mbuf **m;
-	uint8_t		*acks;
+	uint8_t		*discard;	/* m[i] is freed once sent */
 	uint16_t	nb_tx;
 	uint16_t	max_tx;
-	uint16_t	nb_inc;
 };
 
 #ifdef DEBUG_CHECK_PKTS
@@ -141,13 +158,18 @@ extern void tfo_process_timers_send(const struct timespec *);
 extern void tfo_packet_no_room_for_vlan(struct rte_mbuf *);
 extern bool tfo_post_send(struct tfo_tx_bufs *, uint16_t);
 extern void tfo_setup_failed_resend(struct tfo_tx_bufs *);
+extern void tfo_tx_prepare(struct tfo_tx_bufs *);
 extern uint64_t tcp_worker_init(struct tfo_worker_params *);
-extern void tcp_init(const struct tcp_config *);
+extern int tcp_init(const struct tcp_config *);
 extern uint16_t tfo_max_ack_pkt_size(void) __attribute__((const));
 extern uint16_t tfo_get_mbuf_priv_size(void) __attribute__((const));
+extern uint32_t tfo_get_sndbuf_chunk_size(void) __attribute__((const));
+extern const uint8_t *tfo_get_rss_key(uint8_t *);
 #ifdef DEBUG_PRINT_TO_BUF
 extern void tfo_printf_dump(const char *);
 #endif
+extern void tfo_eflow_hash_stats_fp(FILE *fp);
+extern void tfo_mbuf_stats_fp(FILE *fp);
 #ifdef EXPOSE_EFLOW_DUMP
 extern void tfo_eflow_dump(void);
 extern void tfo_eflow_dump_fp(FILE *fp);
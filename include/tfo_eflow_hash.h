@@ -0,0 +1,296 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ * Copyright(c) 2022 P Quentin Armitage <quentin@armitage.org.uk>
+ */
+
+/*
+**
+** tfo_eflow_hash.h for tcp flow optimizer
+**
+** Author: P Quentin Armitage <quentin@armitage.org.uk>
+**
+*/
+
+#ifndef _TFO_EFLOW_HASH_H
+#define _TFO_EFLOW_HASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "linux_list.h"
+#include "tfo_worker.h"
+
+/*
+ * Adding eflows to and deleting them from the eflow hash table, and resizing
+ * the table. The lookups are in tfo_worker.h.
+ */
+
+#ifdef EFLOW_BUCKET_HASH
+static inline int
+eflow_bucket_free_slot(const struct tfo_eflow_bucket *b)
+{
+	int i;
+
+	for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+		if (b->sig[i] == EF_SIG_EMPTY)
+			return i;
+	}
+
+	return -1;
+}
+
+static inline bool
+eflow_bucket_add(struct tcp_worker *w, struct tfo_eflow *ef, uint32_t flow_hash)
+{
+	struct tfo_eflow_bucket *b;
+	uint16_t sig = tfo_eflow_bucket_sig(flow_hash);
+	uint32_t bkt = flow_hash & w->hef_mask;
+	uint32_t alt_bkt = tfo_eflow_alt_bucket(w->hef_mask, bkt, sig);
+	uint32_t path_bkt[EF_CUCKOO_MAX_DEPTH];
+	uint8_t path_slot[EF_CUCKOO_MAX_DEPTH];
+	uint32_t next_bkt;
+	unsigned depth;
+	int slot;
+
+	ef->flow_hash = flow_hash;
+
+	/* Use a free slot in the primary bucket, otherwise the alternative bucket */
+	if ((slot = eflow_bucket_free_slot(&w->hef[bkt])) < 0) {
+		bkt = alt_bkt;
+		if ((slot = eflow_bucket_free_slot(&w->hef[bkt])) >= 0)
+			++w->st.hash_alt_bucket;
+	}
+
+	if (slot < 0) {
+		/* Both buckets are full. Look for a path of entries that can each
+		 * be moved to their alternative bucket, ending in a bucket with
+		 * a free slot. Nothing is moved until such a path is found. */
+		for (depth = 0; ; depth++) {
+			if (depth == EF_CUCKOO_MAX_DEPTH) {
+#ifdef DEBUG_FLOW
+				printf("eflow bucket add failed for hash 0x%x\n", flow_hash);
+#endif
+				++w->st.hash_add_fail;
+				return false;
+			}
+
+			path_bkt[depth] = bkt;
+			path_slot[depth] = (flow_hash + depth) % EF_BUCKET_ENTRIES;
+			next_bkt = tfo_eflow_alt_bucket(w->hef_mask, bkt, w->hef[bkt].sig[path_slot[depth]]);
+			if (next_bkt != bkt &&
+			    (slot = eflow_bucket_free_slot(&w->hef[next_bkt])) >= 0)
+				break;
+
+			bkt = next_bkt;
+		}
+
+		/* Move the entries along the path, starting with the last */
+		bkt = next_bkt;
+		do {
+			w->hef[bkt].sig[slot] = w->hef[path_bkt[depth]].sig[path_slot[depth]];
+			w->hef[bkt].ef_idx[slot] = w->hef[path_bkt[depth]].ef_idx[path_slot[depth]];
+			bkt = path_bkt[depth];
+			slot = path_slot[depth];
+			++w->st.hash_cuckoo_moves;
+		} while (depth--);
+	}
+
+	b = &w->hef[bkt];
+	b->ef_idx[slot] = tfo_eflow_idx(w, ef);
+	b->sig[slot] = sig;
+
+	return true;
+}
+
+/* Returns the bucket of the table holding the eflow, and its slot */
+static inline struct tfo_eflow_bucket *
+eflow_bucket_find_table(struct tcp_worker *w, const struct tfo_eflow *ef, bool old, unsigned *slot)
+{
+	struct tfo_eflow_bucket *hef = old ? w->hef_old : w->hef;
+	uint32_t hef_mask = old ? w->hef_old_mask : w->hef_mask;
+	struct tfo_eflow_bucket *b;
+	uint16_t sig = tfo_eflow_bucket_sig(ef->flow_hash);
+	uint32_t bkt = ef->flow_hash & hef_mask;
+	uint32_t alt_bkt = tfo_eflow_alt_bucket(hef_mask, bkt, sig);
+	uint32_t ef_idx = tfo_eflow_idx(w, ef);
+	unsigned i;
+
+	/* The alternative bucket can be the same as the primary bucket */
+	b = &hef[bkt];
+	while (true) {
+		for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+			if (b->sig[i] == sig && b->ef_idx[i] == ef_idx) {
+				*slot = i;
+				return b;
+			}
+		}
+
+		if (b == &hef[alt_bkt])
+			break;
+		b = &hef[alt_bkt];
+	}
+
+	return NULL;
+}
+
+static inline struct tfo_eflow_bucket *
+eflow_bucket_find(struct tcp_worker *w, const struct tfo_eflow *ef, unsigned *slot)
+{
+	struct tfo_eflow_bucket *b;
+
+	b = eflow_bucket_find_table(w, ef, false, slot);
+	if (!b && w->hef_old)
+		b = eflow_bucket_find_table(w, ef, true, slot);
+
+	if (!b)
+		printf("ERROR eflow %p not found in hash bucket 0x%x\n", ef, ef->flow_hash & w->hef_mask);
+
+	return b;
+}
+
+static inline bool
+eflow_bucket_del_table(struct tcp_worker *w, const struct tfo_eflow *ef, bool old)
+{
+	struct tfo_eflow_bucket *b;
+	unsigned slot;
+
+	if (!(b = eflow_bucket_find_table(w, ef, old, &slot)))
+		return false;
+
+	b->sig[slot] = EF_SIG_EMPTY;
+
+	return true;
+}
+
+static inline void
+eflow_bucket_del(struct tcp_worker *w, const struct tfo_eflow *ef)
+{
+	struct tfo_eflow_bucket *b;
+	unsigned slot;
+
+	if ((b = eflow_bucket_find(w, ef, &slot)))
+		b->sig[slot] = EF_SIG_EMPTY;
+}
+#endif
+
+/* The eflow has been copied to new_ef. Make the hash table refer to new_ef. */
+static inline void
+eflow_hash_move(struct tcp_worker *w, const struct tfo_eflow *ef, struct tfo_eflow *new_ef)
+{
+#ifdef EFLOW_BUCKET_HASH
+	struct tfo_eflow_bucket *b;
+	unsigned slot;
+
+	if ((b = eflow_bucket_find(w, ef, &slot)))
+		b->ef_idx[slot] = tfo_eflow_idx(w, new_ef);
+#else
+	*new_ef->hlist.pprev = &new_ef->hlist;
+	if (new_ef->hlist.next)
+		new_ef->hlist.next->pprev = &new_ef->hlist.next;
+#endif
+}
+
+/* Move up to EF_HASH_MIGRATE_BUCKETS buckets from the old hash table to the
+ * new one. Once the old table is empty it becomes the spare table. */
+static inline void
+eflow_hash_migrate(struct tcp_worker *w)
+{
+	struct tfo_eflow *ef;
+	unsigned n;
+#ifdef EFLOW_BUCKET_HASH
+	struct tfo_eflow_bucket *b;
+	unsigned i;
+#else
+	struct hlist_node *tmp;
+#endif
+
+	for (n = 0; n < EF_HASH_MIGRATE_BUCKETS && w->hef_migrate <= w->hef_old_mask; n++, w->hef_migrate++) {
+#ifdef EFLOW_BUCKET_HASH
+		b = &w->hef_old[w->hef_migrate];
+		for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+			if (b->sig[i] == EF_SIG_EMPTY)
+				continue;
+
+			/* If there is no room, leave the rest of the bucket
+			 * until eflows have been freed. */
+			ef = tfo_eflow_from_idx(w, b->ef_idx[i]);
+			if (!eflow_bucket_add(w, ef, ef->flow_hash))
+				return;
+			b->sig[i] = EF_SIG_EMPTY;
+		}
+#else
+		hlist_for_each_entry_safe(ef, tmp, &w->hef_old[w->hef_migrate], hlist) {
+			__hlist_del(&ef->hlist);
+			hlist_add_head(&ef->hlist, &w->hef[ef->flow_hash & w->hef_mask]);
+		}
+#endif
+	}
+
+	if (w->hef_migrate > w->hef_old_mask) {
+#ifdef DEBUG_FLOW
+		printf("eflow hash migration to %u buckets complete\n", w->hef_mask + 1);
+#endif
+		w->hef_spare = w->hef_old;
+		w->hef_old = NULL;
+	}
+}
+
+/* Start resizing the hash table to hef_n buckets, using the spare table */
+static inline void
+eflow_hash_resize(struct tcp_worker *w, uint32_t hef_n)
+{
+#ifdef DEBUG_FLOW
+	printf("Resizing eflow hash table from %u to %u buckets, load %u%%\n", w->hef_mask + 1, hef_n, eflow_hash_load(w));
+#endif
+
+	if (hef_n > w->hef_mask + 1)
+		++w->st.hash_grow;
+	else
+		++w->st.hash_shrink;
+
+	w->hef_old = w->hef;
+	w->hef_old_mask = w->hef_mask;
+	w->hef_migrate = 0;
+	w->hef = w->hef_spare;
+	w->hef_spare = NULL;
+	w->hef_mask = hef_n - 1;
+}
+
+/* Start doubling the size of the hash table, unless it is being migrated or
+ * is already at its maximum size. Used when an eflow cannot be added. */
+static inline bool
+eflow_hash_grow(struct tcp_worker *w)
+{
+	if (w->hef_old || w->hef_mask + 1 >= w->hef_max)
+		return false;
+
+	eflow_hash_resize(w, (w->hef_mask + 1) * 2);
+
+	return true;
+}
+
+/* Start resizing the hash table if the load is too high or too low */
+static inline void
+eflow_hash_check_resize(struct tcp_worker *w)
+{
+	unsigned load = eflow_hash_load(w);
+	uint32_t hef_n = w->hef_mask + 1;
+
+	if (load > EF_HASH_GROW_LOAD) {
+		if (hef_n < w->hef_max)
+			eflow_hash_resize(w, hef_n * 2);
+	} else if (load < EF_HASH_SHRINK_LOAD && hef_n > EF_HASH_MIN_BUCKETS)
+		eflow_hash_resize(w, hef_n / 2);
+}
+
+/* Called once per burst to keep the hash table size in step with the load */
+static inline void
+eflow_hash_maintain(struct tcp_worker *w)
+{
+	if (unlikely(w->hef_old))
+		eflow_hash_migrate(w);
+	else
+		eflow_hash_check_resize(w);
+}
+
+#endif	/* defined _TFO_EFLOW_HASH_H */
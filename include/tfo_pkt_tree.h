@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ * Copyright(c) 2022 P Quentin Armitage <quentin@armitage.org.uk>
+ */
+
+/*
+**
+** tfo_pkt_tree.h for tcp flow optimizer
+**
+** Author: P Quentin Armitage <quentin@armitage.org.uk>
+**
+*/
+
+#ifndef _TFO_PKT_TREE_H
+#define _TFO_PKT_TREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "linux_list.h"
+#include "linux_rbtree_augmented.h"
+#include "tfo_worker.h"
+
+/*
+ * pkt_tree - the packets on a tfo_side's pktlist indexed by seq.
+ *
+ * The tree is augmented with the holes in the sequence space (see the comment
+ * before struct tfo_pkt in tfo_worker.h), so that both the packet to start
+ * from for a seq and the edges of the contiguous block of packets containing
+ * a packet can be found in O(log n), rather than by walking the pktlist.
+ */
+static inline bool
+pkt_tree_compute_sub_gap(struct tfo_pkt *pkt, bool exit)
+{
+	bool sub_gap = pkt->gap_after;
+
+	if (pkt->seq_node.rb_left)
+		sub_gap |= rb_entry(pkt->seq_node.rb_left, struct tfo_pkt, seq_node)->sub_gap;
+	if (pkt->seq_node.rb_right)
+		sub_gap |= rb_entry(pkt->seq_node.rb_right, struct tfo_pkt, seq_node)->sub_gap;
+
+	if (exit && pkt->sub_gap == sub_gap)
+		return true;
+
+	pkt->sub_gap = sub_gap;
+
+	return false;
+}
+
+RB_DECLARE_CALLBACKS(static, pkt_tree_callbacks, struct tfo_pkt, seq_node, sub_gap, pkt_tree_compute_sub_gap)
+
+/* Recalculate gap_after for pkt, and sub_gap up to the root of the tree. The
+ * whole path is updated, since the gap_after of the packet's predecessor may
+ * also have changed and be on the same path. */
+static void
+pkt_update_gap_after(struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	struct rb_node *node;
+
+	pkt->gap_after = !list_is_last(&pkt->list, &s->pktlist) &&
+			 before(segend(pkt), list_next_entry(pkt, list)->seq);
+
+	for (node = &pkt->seq_node; node; node = rb_parent(node))
+		pkt_tree_compute_sub_gap(rb_entry(node, struct tfo_pkt, seq_node), false);
+}
+
+/* pkt must already have been added to the pktlist */
+static void
+pkt_tree_insert(struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	struct rb_node **link = &s->pkt_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (before(pkt->seq, rb_entry(parent, struct tfo_pkt, seq_node)->seq))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&pkt->seq_node, parent, link);
+
+	pkt_update_gap_after(s, pkt);
+	if (!list_is_first(&pkt->list, &s->pktlist))
+		pkt_update_gap_after(s, list_prev_entry(pkt, list));
+
+	rb_insert_augmented(&pkt->seq_node, &s->pkt_tree, &pkt_tree_callbacks);
+}
+
+/* The caller must update the gap_after of the packet's predecessor once pkt
+ * has been removed from the pktlist */
+static inline void
+pkt_tree_erase(struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	rb_erase_augmented(&pkt->seq_node, &s->pkt_tree, &pkt_tree_callbacks);
+}
+
+/* Returns the last packet on the pktlist that starts before seq, or NULL */
+static struct tfo_pkt *
+pkt_find_before(const struct tfo_side *fos, uint32_t seq)
+{
+	struct rb_node *node = fos->pkt_tree.rb_node;
+	struct tfo_pkt *found = NULL;
+	struct tfo_pkt *pkt;
+
+	while (node) {
+		pkt = rb_entry(node, struct tfo_pkt, seq_node);
+
+		if (before(pkt->seq, seq)) {
+			found = pkt;
+			node = node->rb_right;
+		} else
+			node = node->rb_left;
+	}
+
+	return found;
+}
+
+/* Returns the last packet in the subtree followed by a hole */
+static struct tfo_pkt *
+pkt_tree_last_gap(struct rb_node *node)
+{
+	struct tfo_pkt *pkt;
+
+	while (node) {
+		pkt = rb_entry(node, struct tfo_pkt, seq_node);
+		if (!pkt->sub_gap)
+			return NULL;
+
+		if (node->rb_right && rb_entry(node->rb_right, struct tfo_pkt, seq_node)->sub_gap)
+			node = node->rb_right;
+		else if (pkt->gap_after)
+			return pkt;
+		else
+			node = node->rb_left;
+	}
+
+	return NULL;
+}
+
+/* Returns the first packet in the subtree followed by a hole */
+static struct tfo_pkt *
+pkt_tree_first_gap(struct rb_node *node)
+{
+	struct tfo_pkt *pkt;
+
+	while (node) {
+		pkt = rb_entry(node, struct tfo_pkt, seq_node);
+		if (!pkt->sub_gap)
+			return NULL;
+
+		if (node->rb_left && rb_entry(node->rb_left, struct tfo_pkt, seq_node)->sub_gap)
+			node = node->rb_left;
+		else if (pkt->gap_after)
+			return pkt;
+		else
+			node = node->rb_right;
+	}
+
+	return NULL;
+}
+
+/* Returns the last packet starting before seq that is followed by a hole */
+static struct tfo_pkt *
+pkt_find_gap_before(struct rb_node *node, uint32_t seq)
+{
+	struct tfo_pkt *pkt, *found;
+
+	if (!node)
+		return NULL;
+
+	pkt = rb_entry(node, struct tfo_pkt, seq_node);
+	if (!pkt->sub_gap)
+		return NULL;
+
+	if (!before(pkt->seq, seq))
+		return pkt_find_gap_before(node->rb_left, seq);
+
+	if ((found = pkt_find_gap_before(node->rb_right, seq)))
+		return found;
+
+	if (pkt->gap_after)
+		return pkt;
+
+	return pkt_tree_last_gap(node->rb_left);
+}
+
+/* Returns the first packet starting at or after seq that is followed by a hole */
+static struct tfo_pkt *
+pkt_find_gap_from(struct rb_node *node, uint32_t seq)
+{
+	struct tfo_pkt *pkt, *found;
+
+	if (!node)
+		return NULL;
+
+	pkt = rb_entry(node, struct tfo_pkt, seq_node);
+	if (!pkt->sub_gap)
+		return NULL;
+
+	if (before(pkt->seq, seq))
+		return pkt_find_gap_from(node->rb_right, seq);
+
+	if ((found = pkt_find_gap_from(node->rb_left, seq)))
+		return found;
+
+	if (pkt->gap_after)
+		return pkt;
+
+	return pkt_tree_first_gap(node->rb_right);
+}
+
+#endif	/* defined _TFO_PKT_TREE_H */
@@ -15,19 +15,22 @@
 
 #include "tfo_config.h"
 
+#include <assert.h>
 #include <limits.h>
+#include <stddef.h>
 #include <netinet/in.h>
 
 #include "tfo.h"
 #include "tfo_rbtree.h"
 #include "win_minmax.h"
 
+#include <rte_prefetch.h>
+#include <rte_hash_crc.h>
+
 #ifdef CONFIG_FOR_CGN
 # include <libfbxlist.h>
 # include <fmutils.h>
-# include <jhash.h>
 #else
-# include "linux_jhash.h"
 # include "linux_list.h"
 
 # define	min(a,b) ((a) < (b) ? (a) : (b))
@@ -105,6 +108,10 @@ struct tcp_sack_option {
 	} edges[];
 } __rte_packed;
 
+/* Number of packets of a burst that are parsed and have their flow state
+ * prefetched before any of them are processed */
+#define BURST_PREFETCH_SIZE	32
+
 /* Packets to process */
 struct tfo_pkts {
 	struct rte_mbuf		**pkts;
@@ -127,16 +134,40 @@ struct tfo_pkt_in
 	uint16_t		mss_opt;
 
 	uint32_t		seglen;
+	uint32_t		flow_hash;
 
 	struct timeval		tv;		/* current time for pkt capture */
 						/* Remove this - use w->ts */
 };
 
 /****************************************************************************
+ *
+ * The struct tfo_pkt of a buffered packet is held in the private area of its
+ *   mbuf (struct tfo_mbuf_priv), so it shares the mbuf's memory and does not
+ *   need allocating. If the mbuf of a SACK'd packet is freed while the packet
+ *   has to stay on the pktlist, the struct tfo_pkt is first moved to one taken
+ *   from the worker's p_free list (see pkt_detach_mbuf()). The same is done
+ *   when the data of a sent packet is moved to the side's send buffer (see
+ *   struct tfo_sndbuf). A packet without an mbuf is therefore always one from
+ *   p_free. If such a packet is rebuilt to be resent, it has an mbuf but is
+ *   not in the mbuf's private area; pkt_in_mbuf_priv() distinguishes the two.
  *
  * A packet can be on up to three lists. It will always be on the tfo_side's
  *   pktlist, and uses the list_head list. This list is maintained in order of
- *   the packet's seq.
+ *   the packet's seq. The packets on the pktlist are also on the tfo_side's
+ *   pkt_tree, using seq_node, so that queue_pkt() can find where an out of
+ *   order packet goes without walking the pktlist. Since the seqs of the packets
+ *   on the pktlist are strictly increasing, seq is unique on the tree.
+ *
+ * The pkt_tree is augmented so that it also serves as the SACK scoreboard.
+ *   gap_after is set if there is a hole in the sequence space between the
+ *   packet and the next packet on the pktlist, and sub_gap is set if gap_after
+ *   is set for any packet in the packet's subtree. The hole before or after a
+ *   packet, and hence the contiguous block of packets it is in, can then be
+ *   found without walking the pktlist (see update_sack_for_seq()). When a
+ *   packet is added or removed, or its seq or seglen change, gap_after of the
+ *   packet and of its predecessor on the pktlist must be updated (see
+ *   pkt_update_gap_after()).
  *
  * Once a packet has been successfully sent (i.e. rte_eth_tx_burst() has been
  *   called including the packet and it is included in the number of packets
@@ -147,13 +178,15 @@ struct tfo_pkt_in
  *   xmit_ts_list that has been sent iut not lost (i.e. the entry after that,
  *   if it exists  will be marked as lost). The xmit_ts_list is maintained in
  *   order of the latest sent time of the packets, but with any lost entries
- *   at the end.
+ *   at the end. This ordering allows rack_detect_loss() to stop at the first
+ *   packet sent after RACK.xmit_ts, so that it does not scan the whole flight.
  *
  * Any packet which fails to be sent when rte_eth_tx_burst() is called will
- *   be added to the global send_failed_list, using the send_failed_list
- *   list_head. This is used for quickly resending packets that failed to be
- *   sent, and once sucessfully sent the packets will be removed from the
- *   global send_failed_list.
+ *   be added to one of the worker's software TX queue rings (struct tfo_txq),
+ *   and has in_txq set; retransmissions and new data are queued separately.
+ *   The queue is drained when the next burst is processed, or by the timers
+ *   after the drain timeout, and once queued to be sent again the packets are
+ *   removed from the TX queue ring.
  *
  * There are various packet flags that relate to the lists:
  *
@@ -202,34 +235,35 @@ struct tfo_pkt_in
 /* We use time_ns_t to make it clearer that the variable is a nsec time */
 typedef uint64_t time_ns_t;
 
-/* buffered packet */
+/* buffered packet
+ *
+ * The headers are located by their offsets, rather than by pointers, to keep
+ * the structure small. ip_ofs and tcp_ofs are from the start of the mbuf data,
+ * and so are unchanged by rte_pktmbuf_prepend()/rte_pktmbuf_adj() moving the
+ * headers. ts_ofs and sack_ofs are from the start of the TCP header, and are
+ * 0 if the option is not present. Use pkt_ipv4(), pkt_tcp() etc to access the
+ * headers, which are only valid if m is not NULL.
+ *
+ * The options are within the 60 byte TCP header, so ts_ofs and sack_ofs fit
+ * in 6 bits, and share a uint16_t with the single bit fields. */
 struct tfo_pkt
 {
 	struct list_head	list;
 	struct list_head	xmit_ts_list;
-	struct list_head	send_failed_list;
+	struct rb_node		seq_node;	/* in the tfo_side's pkt_tree */
 	struct rte_mbuf		*m;
-/* Change to have:
- * 	uint8_t			ip_ofs;
- * 	uint8_t			tcp_ofs;
- * 	uint8_t			ts_ofs;
- * 	uint8_t			sack_offs;
- * and
- * 	pkt_ipv4(struct tfo_pkt *pkt) { return rte_pktmbuf_mtod_offset(pkt->m, struct rte_ipv4_hdr *, ip_ofs); }
- * 	pkt_ipv6(struct tfo_pkt *pkt) { return rte_pktmbuf_mtod_offset(pkt->m, struct rte_ipv6_hdr *, ip_ofs); }
- * 	pkt_tcp(struct tfo_pkt *pkt) { return rte_pktmbuf_mtod_offset(pkt->m, struct rte_tcp_hdr *, tcp_ofs); }
- * 	pkt_ts(struct tfo_pkt *pkt) { return pkt->ts_offs ? rte_pktmbuf_mtod_offset(pkt->m, struct tcp_timestamp_option *, ts_offs) : NULL; }
- * 	pkt_sack(struct tfo_pkt *pkt) { return pkt->sack_offs ? rte_pktmbuf_mtod_offset(pkt->m, struct tcp_sack_option *, sack_offs) : NULL; }
- */
-	union tfo_ip_p		iph;
-	struct rte_tcp_hdr	*tcp;
-	struct tcp_timestamp_option *ts;
-	struct tcp_sack_option *sack;
+	time_ns_t		ns;	/* timestamp in nanosecond */
 	uint32_t		seq;
 	uint32_t		seglen;
-	time_ns_t		ns;	/* timestamp in nanosecond */
-	uint16_t		flags;
 	uint16_t		rack_segs_sacked;
+	uint16_t		tcp_ofs;
+	uint8_t			flags;
+	uint8_t			ip_ofs;
+	uint16_t		ts_ofs:6;
+	uint16_t		sack_ofs:6;
+	uint16_t		gap_after:1;	/* hole between segend and the next packet */
+	uint16_t		sub_gap:1;	/* gap_after set in seq_node's subtree */
+	uint16_t		in_txq:1;	/* on a tfo_txq pkts ring */
 };
 
 typedef enum tfo_timer {
@@ -258,6 +292,8 @@ typedef enum tfo_timer {
 #ifdef DEBUG_EARLY_PACKETS
 #define	TFO_SIDE_FL_SEQ_WRAPPED			0x2000
 #endif
+#define	TFO_SIDE_FL_SACK_RENEGING		0x4000	/* ACK points to SACK'd data */
+#define	TFO_SIDE_FL_ACK_PENDING			0x8000	/* ACK to send at the end of the burst */
 
 #define TFO_TS_NONE				0UL
 #define TFO_INFINITE_TS				UINT64_MAX
@@ -283,13 +319,62 @@ typedef enum tfo_timer {
 /* Forward reference */
 struct tfo;
 
-/* tcp flow, only one side */
+/* Per side send buffer
+ *
+ * If the worker has a sndbuf_pool (see struct tfo_worker_params), once an in
+ * sequence data packet has been sent its payload is appended to the send
+ * buffer of the side, and its mbuf is released. The struct tfo_pkt stays on
+ * the pktlist without an mbuf, so RACK and the SACK scoreboard still work on
+ * packets, and if it has to be resent the packet is rebuilt from the side's
+ * header template and the data in the buffer.
+ *
+ * The buffer holds the bytes from start_seq to start_seq + len in fixed size
+ * chunks. Byte seq is at offset seq % TFO_SNDBUF_CHUNK_DATA of its chunk, so
+ * the offsets into the first and last chunks need not be stored. The chunks
+ * are on a ring of pointers, itself held in a chunk, starting at index first,
+ * so the chunk holding a byte is found without walking a list (see
+ * sndbuf_chunk()). This limits the buffer to TFO_SNDBUF_MAX_CHUNKS chunks.
+ * Chunks are freed as the data before the oldest packet on the pktlist is
+ * released, and an empty buffer has no chunks and no ring. The template's
+ * l2_len and l3_len are the offsets of the IP and TCP headers from the IP
+ * header. */
+#define TFO_SNDBUF_CHUNK_DATA	8192	/* Must be a power of 2 */
+
+struct tfo_sndbuf_chunk
+{
+	uint8_t			data[TFO_SNDBUF_CHUNK_DATA];
+};
+
+#define TFO_SNDBUF_MAX_CHUNKS	(TFO_SNDBUF_CHUNK_DATA / sizeof(struct tfo_sndbuf_chunk *))
+
+struct tfo_sndbuf
+{
+	struct tfo_sndbuf_chunk	**chunks;	/* ring of TFO_SNDBUF_MAX_CHUNKS */
+	struct rte_mbuf		*hdr;		/* header template, from the ack pool */
+	uint32_t		start_seq;
+	uint32_t		len;
+	uint16_t		first;		/* ring index of the chunk holding start_seq */
+};
+
+/* tcp flow, only one side
+ *
+ * The fields are grouped by how often they are used, each group starting on
+ * its own cache line:
+ *  - the first two cache lines hold everything processing an in sequence
+ *    pure ACK reads or writes, including the timer fields that
+ *    update_timer_ef() reads for both sides of the flow;
+ *  - then the RTT estimation, RACK-TLP and SACK state, which is only used
+ *    when sending data, taking an RTT sample or recovering from loss;
+ *  - last the fields only used for the handshake, keepalives, close and
+ *    diagnostics.
+ * lib/tfo_sizes reports the resulting size each time the library is built,
+ * and the static_assert below checks the hot block.
+ */
 struct tfo_side
 {
+	/* Hot - used for every packet */
 	struct tfo_eflow	*ef;
 
-	uint16_t		mss;		/* MSS we can send - only used for RFC5681 */
-
 	struct list_head	pktlist;	/* struct tfo_pkt, oldest first */
 	struct list_head	xmit_ts_list;
 	struct list_head	*last_sent;	/* Last entry on xmit_ts_list not marked lost */
@@ -297,15 +382,6 @@ struct tfo_side
 	uint32_t		rcv_nxt;
 	uint32_t		snd_una;
 	uint32_t		snd_nxt;
-	uint32_t		fin_seq;
-	uint32_t		first_seq;
-	uint32_t		last_ack_sent;	/* RFC7323 for updating ts_recent */
-
-	uint32_t		vtc_flow;
-
-	uint16_t		snd_win;	/* Last window received, i.e. controls what we can send */
-	uint16_t		rcv_win;	/* Last window sent, i.e. controlling what we can receive */
-	uint8_t			rcv_ttl;
 	uint32_t		last_rcv_win_end;
 
 	uint32_t		cwnd;
@@ -314,8 +390,24 @@ struct tfo_side
 	uint32_t		cum_ack;
 #endif
 
+	/* For RFC7323 timestamp updates */
+	uint32_t		ts_recent;	/* In network byte order */
+	uint32_t		latest_ts_val;	/* In host byte order - this is the highest ts_val we have received */
+	uint32_t		last_ack_sent;	/* RFC7323 for updating ts_recent */
+
+	uint32_t		pkts_in_flight;
+	uint32_t		rto_us;		/* In microseconds */
+
+	time_ns_t		timeout;		/* In nanoseconds */
+	time_ns_t		delayed_ack_timeout;
+
+	uint16_t		snd_win;	/* Last window received, i.e. controls what we can send */
+	uint16_t		rcv_win;	/* Last window sent, i.e. controlling what we can receive */
+	uint16_t		mss;		/* MSS we can send - unsent data is resegmented to it */
 	uint16_t		flags;
 
+	tfo_timer_t		cur_timer;
+
 	/* RFC2581 fast retransmission */
 	uint8_t			dup_ack;
 
@@ -323,40 +415,16 @@ struct tfo_side
 	uint8_t			snd_win_shift;	/* The window shift we received */
 	uint8_t			rcv_win_shift;	/* The window shift we sent */
 
-	/* SACK entries to send */
-	struct {
-		uint32_t	left_edge;
-		uint32_t	right_edge;	/* If right_edge == left_edge the entry is not in use */
-	} sack_edges[MAX_SACK_ENTRIES];
-	uint8_t			first_sack_entry;
-	uint8_t			sack_entries;
-	uint16_t		sack_gap;
-
-	/* For RFC7323 timestamp updates */
-	uint32_t		ts_recent;	/* In network byte order */
-	uint32_t		latest_ts_val;	/* In host byte order - this is the highest ts_val we have received */
-#ifdef CALC_TS_CLOCK
-	uint32_t		ts_start;	/* Initial ts_val received */
-	time_ns_t		ts_start_time;	/* Used to estimate speed of far end's TS clock */
-	uint32_t		nsecs_per_tock;	/* Used to avoid TSval overflow */
-	time_ns_t		latest_ts_val_time;	/* Time latest_ts_val was set */
-	uint32_t		last_ts_val_sent;	/* The latest ts_val sent */
-#endif
-	uint8_t			keepalive_probes; /* Number of probes remaining before reset the connection */
+	/* Sending data, RTT samples and loss recovery */
+	uint32_t		pkts_queued_send __rte_cache_aligned;
+	uint32_t		packet_type;	/* Set when generating ACKs. Update for 464XLAT */
 
-	/* RFC7323 RTTM calculation */
-	uint32_t		pkts_in_flight;
-	uint32_t		pkts_queued_send;
-	struct minmax		rtt_min;
+	struct rb_root		pkt_tree;	/* pktlist indexed by seq, and SACK scoreboard */
 
-	/* rtt. in microseconds */
+	/* RFC7323 RTTM calculation. rtt in microseconds */
 	uint32_t		srtt_us;
 	uint32_t		rttvar_us;
-	uint32_t		rto_us;
-
-	uint32_t		packet_type;	/* Set when generating ACKs. Update for 464XLAT */
-
-	uint32_t		pktcount;	/* stat */
+	struct minmax		rtt_min;
 
 	/* RFC8985 RACK-TLP */
 	time_ns_t		rack_xmit_ts;
@@ -371,11 +439,39 @@ struct tfo_side
 	uint32_t		tlp_end_seq;
 	uint32_t		tlp_max_ack_delay_us;	// This is a constant?
 	uint32_t		recovery_end_seq;
-
 //	time_ns_t		rack_reordering_to;
-	tfo_timer_t		cur_timer;
-	time_ns_t		timeout;		/* In nanoseconds */
-	time_ns_t		delayed_ack_timeout;
+
+	/* SACK entries to send */
+	struct {
+		uint32_t	left_edge;
+		uint32_t	right_edge;	/* If right_edge == left_edge the entry is not in use */
+	} sack_edges[MAX_SACK_ENTRIES];
+	uint8_t			first_sack_entry;
+	uint8_t			sack_entries;
+	uint16_t		sack_gap;
+
+	struct tfo_sndbuf	sndbuf;
+
+	/* Cold - handshake, keepalives, close and diagnostics */
+	uint32_t		first_seq __rte_cache_aligned;
+	uint32_t		fin_seq;
+
+	uint32_t		vtc_flow;
+	uint8_t			rcv_ttl;
+
+	uint8_t			keepalive_probes; /* Number of probes remaining before reset the connection */
+
+	uint32_t		pktcount;	/* stat */
+	uint32_t		buf_bytes;	/* payload of the packets on pktlist */
+	uint32_t		buf_mbufs;	/* mbufs held by the packets on pktlist */
+
+#ifdef CALC_TS_CLOCK
+	uint32_t		ts_start;	/* Initial ts_val received */
+	time_ns_t		ts_start_time;	/* Used to estimate speed of far end's TS clock */
+	uint32_t		nsecs_per_tock;	/* Used to avoid TSval overflow */
+	time_ns_t		latest_ts_val_time;	/* Time latest_ts_val was set */
+	uint32_t		last_ts_val_sent;	/* The latest ts_val sent */
+#endif
 
 #ifdef DEBUG_PKT_DELAYS
 	time_ns_t		last_rx_data;
@@ -403,15 +499,22 @@ struct tfo_side
 
 // Why do we need is_priv?
 //	bool			is_priv;
-};
+} __rte_cache_aligned;
+
+static_assert(offsetof(struct tfo_side, pkts_queued_send) <= 2 * RTE_CACHE_LINE_SIZE, "struct tfo_side hot block exceeds two cache lines");
+
+/* tcp optimized flow, both sides. The sides are cache line aligned, so idx
+ * and the rarely used TX queue throttling state go at the end. */
+#define TFO_THROTTLED_PRIV	0x01
+#define TFO_THROTTLED_PUB	0x02
 
-/* tcp optimized flow, both sides */
 struct tfo
 {
 	struct tfo_side			priv;
 	struct tfo_side			pub;
-	uint32_t			idx;	/* in tfo_ctx->f - this is only a corruption check - remove it */
-	struct list_head		list;
+	uint32_t			idx;	/* in w->oflows, and of the flow's ACK templates */
+	struct list_head		txq_throttled;	/* on w->txq.throttled */
+	uint8_t				throttled_sides;	/* TFO_THROTTLED_PRIV/PUB */
 
 	/* periodic tick */
 //	struct rb_node			node;
@@ -420,7 +523,8 @@ struct tfo
 /* data in the private area of the mbuf */
 struct tfo_mbuf_priv {
 	struct tfo_side *fos;
-	struct tfo_pkt *pkt;
+	struct tfo_pkt *pkt;		/* NULL unless the mbuf is buffered */
+	struct tfo_pkt pkt_store;	/* The buffered packet, while it has the mbuf */
 };
 
 
@@ -437,42 +541,134 @@ struct tfo_mbuf_priv {
 
 #define TFO_WIN_SCALE_UNSET		UINT8_MAX
 
-#define TFO_IDX_UNUSED			((uint32_t)~0)
-
 /*
  * existing flow (either optimized or not)
+ *
+ * The lookup key and the state used for every packet are in the first cache
+ * line, the timer and the handshake only fields in the second. The IPv6
+ * addresses are held in the following struct tfo_eflow6 (see struct tfo_flow),
+ * so that IPv4 lookups don't touch them.
  */
-union ip_addr {
-	struct in_addr	v4;
-	struct in6_addr	v6;
-};
-
 struct tfo_eflow
 {
 	struct hlist_node	hlist;		/* hash index or free list */
-	struct timer_rb_node	timer;
-	uint16_t		flags;
-	uint8_t			state;		/* enum tcp_state */
 	uint16_t		priv_port;	/* cpu order */
 	uint16_t		pub_port;	/* cpu order */
-	union ip_addr		priv_addr;
-	union ip_addr		pub_addr;
+	struct in_addr		priv_addr;	/* cpu order, IPv4 only */
+	struct in_addr		pub_addr;	/* cpu order, IPv4 only */
+	uint32_t		flow_hash;	/* full hash, for moving the eflow when the hash table is resized */
+	uint16_t		flags;
+	uint8_t			state;		/* enum tcp_state */
+	uint8_t			win_shift;	/* The win_shift in the SYN packet */
+	struct tfo		*fo;		/* NULL unless the flow is optimized */
 	time_ns_t		idle_timeout;
 	time_ns_t		start_time;
-// Why not just use a pointer for tfo_idx?
-	uint32_t		tfo_idx;	/* index in w->f */
+
+	struct timer_rb_node	timer;
 
 	/* The following are used until the SYN+ACK arrives */
 	uint32_t		server_snd_una;
 	uint32_t		client_rcv_nxt;
+
 	uint32_t		client_vtc_flow;
 	uint32_t		client_packet_type;
 	uint16_t		client_mss;
 	uint16_t		client_snd_win;
 	uint8_t			client_ttl;
-	uint8_t			win_shift;	/* The win_shift in the SYN packet */
+} __rte_cache_aligned;
+
+static_assert(offsetof(struct tfo_eflow, timer) <= RTE_CACHE_LINE_SIZE, "struct tfo_eflow per packet fields exceed a cache line");
+
+struct tfo_eflow6
+{
+	struct in6_addr		priv_addr;
+	struct in6_addr		pub_addr;
+};
+
+/*
+ * The per worker eflow slabs. Each eflow is allocated together with its IPv6
+ * addresses. Only config->f_n flows can be optimized, so there is a slab of
+ * that many eflows, w->oflows, each followed by the tfo used if the flow is
+ * optimized, and the rest of the eflows are in w->flows, without a tfo.
+ * New eflows are taken from w->oflows while there are any free. ef->fo points
+ * to the tfo following the eflow once the flow is optimized.
+ */
+struct tfo_flow
+{
+	struct tfo_eflow	ef;
+	struct tfo_eflow6	ef6;
 };
 
+struct tfo_oflow
+{
+	struct tfo_flow		flow;
+	struct tfo		fo;
+};
+
+/*
+ * Each worker's eflow hash table is resized with the number of eflows in use.
+ * It starts with EF_HASH_MIN_BUCKETS buckets, and can grow to the configured
+ * size, config->hef_n, which is w->hef_max. Two tables of hef_max buckets are
+ * allocated when the worker starts, and only the first hef_mask + 1 buckets
+ * of a table are used, so resizing never allocates memory on the packet path.
+ *
+ * On a resize the spare table, w->hef_spare, replaces w->hef, and the old one
+ * is kept in w->hef_old until all its buckets have been moved to the new
+ * table, EF_HASH_MIGRATE_BUCKETS per burst. Until then lookups that fail in
+ * w->hef also look in w->hef_old. Migrating a bucket leaves it empty, so the
+ * old table becomes the spare table without being cleared.
+ *
+ * The table is doubled when the load (eflows per bucket entry) exceeds
+ * EF_HASH_GROW_LOAD percent, and halved when it falls below EF_HASH_SHRINK_LOAD
+ * percent. A resize does not start while a migration is in progress. After
+ * doubling, the load is half EF_HASH_GROW_LOAD, and a burst adds far fewer
+ * eflows than are needed to double it again in the time the migration takes.
+ * If an eflow cannot be added and no migration is in progress, the table is
+ * doubled straight away and the eflow added to the new table.
+ */
+#define EF_HASH_MIGRATE_BUCKETS	16
+#define EF_HASH_MIN_BUCKETS	16
+#ifdef EFLOW_BUCKET_HASH
+#define EF_HASH_GROW_LOAD	80
+#define EF_HASH_SHRINK_LOAD	20
+#else
+#define EF_HASH_GROW_LOAD	100
+#define EF_HASH_SHRINK_LOAD	25
+#endif
+
+#ifdef EFLOW_BUCKET_HASH
+#define EF_HASH_BUCKET_ENTRIES	EF_BUCKET_ENTRIES
+#else
+#define EF_HASH_BUCKET_ENTRIES	1
+#endif
+
+#ifdef EFLOW_BUCKET_HASH
+/*
+ * Bucketed open addressing eflow hash table.
+ *
+ * Each bucket is one cache line holding the 16 bit signatures and the indices
+ * (see tfo_eflow_idx()) of up to EF_BUCKET_ENTRIES eflows, so an eflow is only looked at
+ * when its signature matches. An eflow lives in one of two buckets, the
+ * primary bucket (flow_hash & hef_mask) or the alternative bucket
+ * ((primary ^ sig) & hef_mask), which can be calculated from either bucket
+ * and the signature (cuckoo hashing). hef_n is the number of buckets.
+ */
+#define EF_BUCKET_ENTRIES	8
+#define EF_SIG_EMPTY		0
+
+/* The maximum length of a cuckoo displacement path. This must not exceed
+ * EF_BUCKET_ENTRIES since the slot used at each step is chosen by the depth,
+ * which ensures that a path cannot use the same slot twice. */
+#define EF_CUCKOO_MAX_DEPTH	EF_BUCKET_ENTRIES
+
+struct tfo_eflow_bucket
+{
+	uint16_t		sig[EF_BUCKET_ENTRIES];
+	uint32_t		ef_idx[EF_BUCKET_ENTRIES];
+	uint8_t			pad[RTE_CACHE_LINE_SIZE - EF_BUCKET_ENTRIES * (sizeof(uint16_t) + sizeof(uint32_t))];
+} __rte_cache_aligned;
+#endif
+
 
 /*
  * tcp flow stats, per worker
@@ -505,10 +701,119 @@ struct tfo_stats
 	uint64_t		fin_state_pkt;
 	uint64_t		rst_state_pkt;
 	uint64_t		bad_state_pkt;
+	uint64_t		coalesced_pkt;		/* segments coalesced into the previous segment */
+
+	/* Sent packets copied to the small mbuf pool */
+	uint64_t		small_mbuf_copies;
+	uint64_t		small_mbuf_alloc_fail;
+	uint64_t		small_mbuf_bytes_saved;	/* receive buffer space released by the copies */
+
+	/* Sent packets whose data was moved to the send buffer */
+	uint64_t		sndbuf_pkts;
+	uint64_t		sndbuf_bytes;
+	uint64_t		sndbuf_rebuilds;	/* packets rebuilt to be resent */
+	uint64_t		sndbuf_chunk_alloc_fail;
+	uint64_t		sndbuf_template_fail;
+	uint64_t		sndbuf_rebuild_fail;
+
+	uint64_t		buf_win_limited;	/* receive windows reduced by a buffer quota */
+
+	uint64_t		tx_bufs_early_send;	/* tx_bufs sent since the staging area was full */
+
+	uint64_t		acks_coalesced;		/* ACKs replaced by the side's ACK at the end of the burst */
+
+	uint64_t		rx_bad_cksum;		/* segments dropped with a bad checksum */
+	uint64_t		tx_cksum_sw;		/* packets rte_eth_tx_prepare() rejected for offload */
+	uint64_t		tx_prepare_drop;	/* packets rte_eth_tx_prepare() rejected for other reasons */
+
+	/* Software TX queue */
+	uint64_t		txq_queued;		/* packets tx_burst did not accept */
+	uint64_t		txq_drained;		/* queued packets sent again */
+	uint64_t		txq_drop_ack;
+	uint64_t		txq_drop_resend;
+	uint64_t		txq_drop_new;
+
+	/* Unsent packets resegmented to the MSS of the side they are sent to */
+	uint64_t		reseg_split;		/* packets split */
+	uint64_t		reseg_split_segs;	/* segments added by splitting */
+	uint64_t		reseg_merge;		/* packets merged into the previous packet */
+	uint64_t		reseg_alloc_fail;
+
+	/* SACK reneging, see rack_sack_reneged() */
+	uint64_t		sack_reneging_resend;	/* SACK'd packets resent by RTO recovery */
+	uint64_t		sack_reneging_rst;	/* connections reset since SACK'd data was no longer held */
 
 	uint32_t		flow_state[TCP_STATE_STAT_NUM];
+
+	uint64_t		hash_grow;		/* eflow hash table size doubled */
+	uint64_t		hash_shrink;		/* eflow hash table size halved */
+
+#ifdef EFLOW_BUCKET_HASH
+	/* eflow hash table */
+	uint64_t		hash_alt_bucket;	/* eflows added to their alternative bucket */
+	uint64_t		hash_cuckoo_moves;	/* eflows moved to make room */
+	uint64_t		hash_add_fail;		/* eflows not added since no room */
+#endif
+};
+
+
+/* Software TX queue, holding the packets that tx_burst did not accept until
+ * they can be sent again. Unbuffered packets, i.e. ACKs and forwarded packets,
+ * are held by their mbufs in the acks ring and are sent first, followed by
+ * retransmissions and then new data, which are held in the pkts rings. If the
+ * queue is full, the lowest priority packets are dropped. Each ring has depth
+ * entries, since the queue never holds more than depth packets in total.
+ *
+ * While retransmissions or new data are queued, no side sends new data (see
+ * get_snd_win_end()), and the flows held back are put on the throttled list.
+ * The new data of their throttled sides is sent when the queue is drained. */
+#define TFO_TXQ_RESEND		0
+#define TFO_TXQ_NEW		1
+#define TFO_TXQ_PKT_LISTS	2
+
+struct tfo_txq {
+	struct rte_mbuf		**acks;		/* ring of depth entries */
+	struct tfo_pkt		**pkts[TFO_TXQ_PKT_LISTS];	/* rings of depth entries */
+	uint16_t		ack_head;
+	uint16_t		nb_acks;
+	uint16_t		pkt_head[TFO_TXQ_PKT_LISTS];
+	uint16_t		nb_pkts[TFO_TXQ_PKT_LISTS];
+	uint16_t		depth;
+	uint16_t		max_use;
+	time_ns_t		drain_ns;	/* when the timers next drain the queue */
+	struct list_head	throttled;	/* flows with new data held back */
+};
+
+/* The ACK header template of one side of an optimized flow, built when the
+ * flow is optimized. It holds the Ethernet, VLAN, IP and TCP headers, and the
+ * timestamp option if timestamps are in use, with zero sequence numbers,
+ * window, TTL and timestamps, and the checksums for those values. An ACK is
+ * a copy of the template with those fields and any SACK blocks patched in,
+ * and the checksums updated incrementally. */
+#define TFO_ACK_TMPL_SIZE	(sizeof(struct rte_ether_hdr) + sizeof(struct rte_vlan_hdr) + sizeof(struct rte_ipv6_hdr) + \
+				 sizeof(struct rte_tcp_hdr) + 2 + sizeof(struct tcp_timestamp_option))
+
+struct tfo_ack_tmpl {
+	uint8_t			hdr_len;	/* 0 if there is no template */
+	uint8_t			ip_ofs;
+	uint8_t			tcp_ofs;
+	uint16_t		vlan_tci;
+	uint8_t			hdr[TFO_ACK_TMPL_SIZE];
+} __rte_cache_aligned;
+
+/* The ACKs due while a burst is processed are sent when the whole burst has
+ * been processed, so that each side is sent at most one, cumulative, ACK per
+ * burst. ACKs with a D-SACK block, RSTs and keepalives are sent immediately. */
+#define TFO_ACK_PENDING_SIZE	64
+
+struct tfo_ack_pending {
+	struct tfo_eflow	*ef;
+	struct tfo_side		*fos;
+	uint16_t		vlan_id;
 };
 
+#define TFO_RECLAIM_SIZE	64
+#define TFO_TX_BUFS_SIZE	1024
 
 struct tcp_worker
 {
@@ -516,31 +821,99 @@ struct tcp_worker
 
 	struct timespec		ts;
 
-//#ifdef DEBUG_PKTS
-	struct tfo_eflow	*ef;
-//#endif
+	struct tfo_oflow	*oflows;	/* eflows that can be optimized */
+	struct tfo_flow		*flows;		/* the other eflows, NULL if none */
+	uint32_t		of_n;
+	struct tfo_ack_tmpl	*ack_tmpl;	/* priv and pub for each flow, by tfo idx */
 	uint32_t		ef_use;
+	struct hlist_head	of_free;
 	struct hlist_head	ef_free;
+#ifndef EFLOW_BUCKET_HASH
 	struct hlist_head	*hef;	/* key: { user ip+port, pub ip+port } */
+	struct hlist_head	*hef_old;	/* table being migrated from */
+	struct hlist_head	*hef_spare;	/* empty, while not migrating */
+#else
+	struct tfo_eflow_bucket	*hef;	/* key: { user ip+port, pub ip+port } */
+	struct tfo_eflow_bucket	*hef_old;	/* table being migrated from */
+	struct tfo_eflow_bucket	*hef_spare;	/* empty, while not migrating */
+#endif
+	uint32_t		hef_max;	/* buckets allocated for each table */
+	uint32_t		hef_mask;
+	uint32_t		hef_old_mask;
+	uint32_t		hef_migrate;	/* next bucket of hef_old to migrate */
 
-//#ifdef DEBUG_PKTS
-	struct tfo		*f;
-//#endif
 	uint32_t		f_use;
-	struct list_head	f_free;
 
 #ifdef DEBUG_PKTS
 	struct tfo_pkt		*p;
 #endif
 	uint32_t		p_use;
 	uint32_t		p_max_use;
-	struct list_head	p_free;
+	struct list_head	p_free;		/* for packets whose mbuf has been freed */
+
+	/* Totals of the buf_bytes and buf_mbufs of the tfo_sides */
+	uint64_t		buf_bytes;
+	uint32_t		buf_mbufs;
+
+	/* Free mbufs of pool_avail_pool, counted once per burst */
+	const struct rte_mempool *pool_avail_pool;
+	time_ns_t		pool_avail_ns;
+	unsigned		pool_avail;
+
+	/* mbufs of freed packets, released together by rte_pktmbuf_free_bulk() */
+	uint16_t		nb_reclaim;
+	struct rte_mbuf		*reclaim[TFO_RECLAIM_SIZE];
+
+	/* Staging area for the packets to send, used as tfo_tx_bufs.m and
+	 * tfo_tx_bufs.discard */
+	struct rte_mbuf		**tx_m;
+	uint8_t			*tx_discard;
+	uint16_t		max_tx;
+
+	struct tfo_txq		txq;
+
+	/* ACKs to send at the end of the burst */
+	bool			defer_acks;
+	uint16_t		nb_ack_pending;
+	struct tfo_ack_pending	ack_pending[TFO_ACK_PENDING_SIZE];
 
 	struct tfo_stats	st;
 };
 
+static inline const struct tfo_eflow6 *
+tfo_eflow_addr6(const struct tfo_eflow *ef)
+{
+	return &const_container_of(ef, struct tfo_flow, ef)->ef6;
+}
+
+/* The eflows are numbered, for the hash table buckets, through w->oflows
+ * and then through w->flows */
+static inline struct tfo_eflow *
+tfo_eflow_from_idx(const struct tcp_worker *w, uint32_t idx)
+{
+	if (idx < w->of_n)
+		return &w->oflows[idx].flow.ef;
+
+	return &w->flows[idx - w->of_n].ef;
+}
+
+static inline bool
+tfo_eflow_in_oflows(const struct tcp_worker *w, const struct tfo_eflow *ef)
+{
+	return (uintptr_t)ef - (uintptr_t)w->oflows < w->of_n * sizeof(struct tfo_oflow);
+}
+
+static inline uint32_t
+tfo_eflow_idx(const struct tcp_worker *w, const struct tfo_eflow *ef)
+{
+	if (tfo_eflow_in_oflows(w, ef))
+		return const_container_of(ef, struct tfo_oflow, flow.ef) - w->oflows;
+
+	return w->of_n + (const_container_of(ef, struct tfo_flow, ef) - w->flows);
+}
+
 #define segend(p)	((p)->seq + (p)->seglen)
-#define payload_len(p)	((p)->seglen - !!((p)->tcp->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG)))
+#define payload_len(p)	((p)->seglen - !!(pkt_tcp(p)->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG)))
 
 /* Helper definitions for printing times */
 #define NSEC_TIME_PRINT_FORMAT			"%" PRIu64 ".%9.9" PRIu64
@@ -557,90 +930,273 @@ using_rack(const struct tfo_eflow *ef)
 }
 
 static inline struct rte_ipv4_hdr *
-pkt_ipv4(struct tfo_pkt *pkt)
+pkt_ipv4(const struct tfo_pkt *pkt)
 {
-	return pkt->iph.ip4h;
+	return rte_pktmbuf_mtod_offset(pkt->m, struct rte_ipv4_hdr *, pkt->ip_ofs);
 }
 
 static inline struct rte_ipv6_hdr *
-pkt_ipv6(struct tfo_pkt *pkt)
+pkt_ipv6(const struct tfo_pkt *pkt)
 {
-	return pkt->iph.ip6h;
+	return rte_pktmbuf_mtod_offset(pkt->m, struct rte_ipv6_hdr *, pkt->ip_ofs);
+}
+
+static inline union tfo_ip_p
+pkt_iph(const struct tfo_pkt *pkt)
+{
+	union tfo_ip_p iph;
+
+	/* The following works for IPv6 too */
+	iph.ip4h = pkt_ipv4(pkt);
+
+	return iph;
 }
 
 static inline struct rte_tcp_hdr *
-pkt_tcp(struct tfo_pkt *pkt)
+pkt_tcp(const struct tfo_pkt *pkt)
 {
-	return pkt->tcp;
+	return rte_pktmbuf_mtod_offset(pkt->m, struct rte_tcp_hdr *, pkt->tcp_ofs);
 }
 
 static inline struct tcp_timestamp_option *
-pkt_ts(struct tfo_pkt *pkt)
+pkt_ts(const struct tfo_pkt *pkt)
 {
-	return pkt->ts;
+	return pkt->ts_ofs ? rte_pktmbuf_mtod_offset(pkt->m, struct tcp_timestamp_option *, pkt->tcp_ofs + pkt->ts_ofs) : NULL;
 }
 
 static inline struct tcp_sack_option *
-pkt_sack(struct tfo_pkt *pkt)
+pkt_sack(const struct tfo_pkt *pkt)
 {
-	return pkt->sack;
+	return pkt->sack_ofs ? rte_pktmbuf_mtod_offset(pkt->m, struct tcp_sack_option *, pkt->tcp_ofs + pkt->sack_ofs) : NULL;
 }
 
+static inline uint8_t
+pkt_opt_ofs(const struct rte_tcp_hdr *tcp, const void *opt)
+{
+	return opt ? (const uint8_t *)opt - (const uint8_t *)tcp : 0;
+}
+
+/* pkt->m must be set before calling this */
+static inline void
+pkt_set_hdrs(struct tfo_pkt *pkt, union tfo_ip_p iph, const struct rte_tcp_hdr *tcp,
+		const struct tcp_timestamp_option *ts, const struct tcp_sack_option *sack)
+{
+	const uint8_t *data = rte_pktmbuf_mtod(pkt->m, const uint8_t *);
+
+	pkt->ip_ofs = (const uint8_t *)iph.ip4h - data;
+	pkt->tcp_ofs = (const uint8_t *)tcp - data;
+	pkt->ts_ofs = pkt_opt_ofs(tcp, ts);
+	pkt->sack_ofs = pkt_opt_ofs(tcp, sack);
+}
+
+/* The eflow hashes are CRC32C of the addresses and ports, which rte_hash_crc
+ * calculates with the SSE4.2 or ARMv8 CRC instructions where available. The
+ * protocol is always TCP, so it is only represented by the seed. */
+#define TFO_FLOW_HASH_SEED	(0xffffffffU ^ IPPROTO_TCP)
+
+/* The full hash is returned, since the bucket depends on the current size of
+ * the worker's hash table. */
 static inline uint32_t __attribute__((pure))
-tfo_eflow_v6_hash(const struct tcp_config *c, struct in6_addr *priv, uint16_t priv_port,
+tfo_eflow_v6_hash(struct in6_addr *priv, uint16_t priv_port,
 		  struct in6_addr *pub, uint16_t pub_port)
 {
 	uint32_t h;
 
-	h = jhash2(priv->s6_addr32, 4, priv_port) ^
-		jhash2(pub->s6_addr32, 4, pub_port);
-	return h & c->hef_mask;
+	h = rte_hash_crc(priv->s6_addr32, sizeof(*priv), TFO_FLOW_HASH_SEED);
+	h = rte_hash_crc(pub->s6_addr32, sizeof(*pub), h);
+
+	return rte_hash_crc_4byte(priv_port | (uint32_t)pub_port << 16, h);
 }
 
-static inline uint32_t //__attribute__((pure))
-tfo_eflow_v4_hash(const struct tcp_config *c, uint32_t priv, uint16_t priv_port,
+static inline uint32_t
+tfo_eflow_v4_hash(uint32_t priv, uint16_t priv_port,
 		  uint32_t pub, uint16_t pub_port)
 {
 	uint32_t h;
 
-	h = priv ^ pub ^ (priv_port | (pub_port << 16));
-// PQA - this ignores too many bits
-	return h & c->hef_mask;
+	h = rte_hash_crc_8byte((uint64_t)priv << 32 | pub, TFO_FLOW_HASH_SEED);
+
+	return rte_hash_crc_4byte(priv_port | (uint32_t)pub_port << 16, h);
 }
 
+#ifdef EFLOW_BUCKET_HASH
+static inline uint16_t __attribute__((const))
+tfo_eflow_bucket_sig(uint32_t flow_hash)
+{
+	uint16_t sig = flow_hash >> 16;
+
+	return sig == EF_SIG_EMPTY ? 1 : sig;
+}
+
+static inline uint32_t __attribute__((const))
+tfo_eflow_alt_bucket(uint32_t hef_mask, uint32_t bkt, uint16_t sig)
+{
+	return (bkt ^ sig) & hef_mask;
+}
+#endif
+
 
 static inline struct tfo_eflow * __attribute__((pure))
-tfo_eflow_v6_lookup(const struct tcp_worker *w, struct in6_addr *priv, uint16_t priv_port,
+_tfo_eflow_v6_lookup(const struct tcp_worker *w, bool old, struct in6_addr *priv, uint16_t priv_port,
 		    struct in6_addr *pub, uint16_t pub_port,
 		    uint32_t flow_hash)
 {
 	struct tfo_eflow *f;
+	uint32_t hef_mask = old ? w->hef_old_mask : w->hef_mask;
+#ifdef EFLOW_BUCKET_HASH
+	const struct tfo_eflow_bucket *hef = old ? w->hef_old : w->hef;
+	const struct tfo_eflow_bucket *b;
+	uint16_t sig = tfo_eflow_bucket_sig(flow_hash);
+	uint32_t bkt = flow_hash & hef_mask;
+	uint32_t alt_bkt = tfo_eflow_alt_bucket(hef_mask, bkt, sig);
+	unsigned i;
+
+	rte_prefetch0(&hef[alt_bkt]);
+
+	b = &hef[bkt];
+	while (true) {
+		for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+			if (b->sig[i] != sig)
+				continue;
+
+			f = tfo_eflow_from_idx(w, b->ef_idx[i]);
+			if (f->priv_port == priv_port && f->pub_port == pub_port &&
+			    (f->flags & TFO_EF_FL_IPV6) &&
+			    IN6_ARE_ADDR_EQUAL(&tfo_eflow_addr6(f)->priv_addr, priv) &&
+			    IN6_ARE_ADDR_EQUAL(&tfo_eflow_addr6(f)->pub_addr, pub)) {
+				return f;
+			}
+		}
 
-	hlist_for_each_entry(f, &w->hef[flow_hash], hlist) {
-		if (f->priv_port == priv_port && f->pub_port == pub_port &&
-		    IN6_ARE_ADDR_EQUAL(&f->priv_addr.v6, priv) &&
-		    IN6_ARE_ADDR_EQUAL(&f->pub_addr.v6, pub)) {
+		if (b == &hef[alt_bkt])
+			break;
+		b = &hef[alt_bkt];
+	}
+#else
+	const struct hlist_head *hef = old ? w->hef_old : w->hef;
+
+	hlist_for_each_entry(f, &hef[flow_hash & hef_mask], hlist) {
+		if (f->flow_hash == flow_hash &&
+		    f->priv_port == priv_port && f->pub_port == pub_port &&
+		    (f->flags & TFO_EF_FL_IPV6) &&
+		    IN6_ARE_ADDR_EQUAL(&tfo_eflow_addr6(f)->priv_addr, priv) &&
+		    IN6_ARE_ADDR_EQUAL(&tfo_eflow_addr6(f)->pub_addr, pub)) {
 			return f;
 		}
 	}
+#endif
 
 	return NULL;
 }
 
 static inline struct tfo_eflow * __attribute__((pure))
-tfo_eflow_v4_lookup(const struct tcp_worker *w, uint32_t priv, uint16_t priv_port,
+tfo_eflow_v6_lookup(const struct tcp_worker *w, struct in6_addr *priv, uint16_t priv_port,
+		    struct in6_addr *pub, uint16_t pub_port,
+		    uint32_t flow_hash)
+{
+	struct tfo_eflow *f;
+
+	f = _tfo_eflow_v6_lookup(w, false, priv, priv_port, pub, pub_port, flow_hash);
+	if (unlikely(!f && w->hef_old))
+		f = _tfo_eflow_v6_lookup(w, true, priv, priv_port, pub, pub_port, flow_hash);
+
+	return f;
+}
+
+static inline struct tfo_eflow * __attribute__((pure))
+_tfo_eflow_v4_lookup(const struct tcp_worker *w, bool old, uint32_t priv, uint16_t priv_port,
 		    uint32_t pub, uint16_t pub_port, uint32_t flow_hash)
 {
 	struct tfo_eflow *f;
+	uint32_t hef_mask = old ? w->hef_old_mask : w->hef_mask;
+#ifdef EFLOW_BUCKET_HASH
+	const struct tfo_eflow_bucket *hef = old ? w->hef_old : w->hef;
+	const struct tfo_eflow_bucket *b;
+	uint16_t sig = tfo_eflow_bucket_sig(flow_hash);
+	uint32_t bkt = flow_hash & hef_mask;
+	uint32_t alt_bkt = tfo_eflow_alt_bucket(hef_mask, bkt, sig);
+	unsigned i;
+
+	rte_prefetch0(&hef[alt_bkt]);
+
+	b = &hef[bkt];
+	while (true) {
+		for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+			if (b->sig[i] != sig)
+				continue;
+
+			f = tfo_eflow_from_idx(w, b->ef_idx[i]);
+			if (f->priv_port == priv_port && f->pub_port == pub_port &&
+			    pub == f->pub_addr.s_addr && priv == f->priv_addr.s_addr &&
+			    !(f->flags & TFO_EF_FL_IPV6)) {
+				return f;
+			}
+		}
 
-	hlist_for_each_entry(f, &w->hef[flow_hash], hlist) {
+		if (b == &hef[alt_bkt])
+			break;
+		b = &hef[alt_bkt];
+	}
+#else
+	const struct hlist_head *hef = old ? w->hef_old : w->hef;
+
+	hlist_for_each_entry(f, &hef[flow_hash & hef_mask], hlist) {
 		if (f->priv_port == priv_port && f->pub_port == pub_port &&
-		    pub == f->pub_addr.v4.s_addr && priv == f->priv_addr.v4.s_addr) {
+		    pub == f->pub_addr.s_addr && priv == f->priv_addr.s_addr &&
+		    !(f->flags & TFO_EF_FL_IPV6)) {
 			return f;
 		}
 	}
+#endif
+
+	return NULL;
+}
+
+static inline struct tfo_eflow * __attribute__((pure))
+tfo_eflow_v4_lookup(const struct tcp_worker *w, uint32_t priv, uint16_t priv_port,
+		    uint32_t pub, uint16_t pub_port, uint32_t flow_hash)
+{
+	struct tfo_eflow *f;
+
+	f = _tfo_eflow_v4_lookup(w, false, priv, priv_port, pub, pub_port, flow_hash);
+	if (unlikely(!f && w->hef_old))
+		f = _tfo_eflow_v4_lookup(w, true, priv, priv_port, pub, pub_port, flow_hash);
+
+	return f;
+}
+
+/* The eflow hash table load, as a percentage of the bucket entries */
+static inline unsigned __attribute__((pure))
+eflow_hash_load(const struct tcp_worker *w)
+{
+	return (uint64_t)w->ef_use * 100 / ((uint64_t)(w->hef_mask + 1) * EF_HASH_BUCKET_ENTRIES);
+}
+
+/* Prefetch the hash bucket for a flow, so that a later lookup doesn't stall */
+static inline void
+tfo_eflow_prefetch_bucket(const struct tcp_worker *w, uint32_t flow_hash)
+{
+	rte_prefetch0(&w->hef[flow_hash & w->hef_mask]);
+}
+
+/* The first eflow that might match, for prefetching once its bucket is in cache */
+static inline struct tfo_eflow * __attribute__((pure))
+tfo_eflow_candidate(const struct tcp_worker *w, uint32_t flow_hash)
+{
+#ifdef EFLOW_BUCKET_HASH
+	const struct tfo_eflow_bucket *b = &w->hef[flow_hash & w->hef_mask];
+	uint16_t sig = tfo_eflow_bucket_sig(flow_hash);
+	unsigned i;
+
+	for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+		if (b->sig[i] == sig)
+			return tfo_eflow_from_idx(w, b->ef_idx[i]);
+	}
 
 	return NULL;
+#else
+	return hlist_entry_safe(w->hef[flow_hash & w->hef_mask].first, struct tfo_eflow, hlist);
+#endif
 }
 
 static inline time_ns_t
@@ -456,7 +456,6 @@ void rb_erase(struct rb_node *node, struct rb_root *root)
 		____rb_erase_color(rebalance, root, dummy_rotate);
 }
 
-#if 0
 /*
  * Augmented rbtree manipulation functions.
  *
@@ -470,6 +469,8 @@ void __rb_insert_augmented(struct rb_node *node, struct rb_root *root,
 	__rb_insert(node, root, augment_rotate);
 }
 
+#if 0
+
 /*
  * This function returns the first node (in sort order) of the tree.
  */
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ * Copyright(c) 2022 P Quentin Armitage <quentin@armitage.org.uk>
+ */
+
+/*
+**
+** tfo_sizes.c for tcp flow optimizer
+**
+** Reports the memory used per flow with the current configuration.
+** It is built and run each time the library is built (see Makefile.am),
+** so that changes to the layout of the per flow structures can be checked.
+**
+*/
+
+#include "tfo_config.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "tfo_worker.h"
+
+
+#define CACHE_LINES(size)	(((size) + RTE_CACHE_LINE_SIZE - 1) / RTE_CACHE_LINE_SIZE)
+
+static void
+print_size(const char *name, size_t size)
+{
+	printf("  %-24s %5zu bytes, %3zu cache lines\n", name, size, CACHE_LINES(size));
+}
+
+int
+main(void)
+{
+	printf("Per flow memory, %u byte cache lines:\n", RTE_CACHE_LINE_SIZE);
+
+	print_size("struct tfo_eflow", sizeof(struct tfo_eflow));
+	print_size("struct tfo_eflow6", sizeof(struct tfo_eflow6));
+	print_size("struct tfo_side", sizeof(struct tfo_side));
+	print_size("  hot", offsetof(struct tfo_side, pkts_queued_send));
+	print_size("  recovery", offsetof(struct tfo_side, first_seq) - offsetof(struct tfo_side, pkts_queued_send));
+	print_size("  cold", sizeof(struct tfo_side) - offsetof(struct tfo_side, first_seq));
+	print_size("struct tfo", sizeof(struct tfo));
+	print_size("struct tfo_pkt", sizeof(struct tfo_pkt));
+	print_size("struct tfo_mbuf_priv", sizeof(struct tfo_mbuf_priv));
+
+	print_size("unoptimized flow", sizeof(struct tfo_flow));
+	print_size("optimized flow", sizeof(struct tfo_oflow) + 2 * sizeof(struct tfo_ack_tmpl));
+
+	return 0;
+}
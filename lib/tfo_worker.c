@@ -30,8 +30,6 @@
 
 // SEE https://fedoramagazine.org/tcp-window-scaling-timestamps-and-sack/
 
-// Use private area in pktmbuf rather than malloc for tfo_pkt structures
-//
 // SACK - we must keep data, mark packets as SACK'd, but if get another SACK we must be prepared to un-SACK packets
 //	- see https://hal.archives-ouvertes.fr/hal-02549760/document for non-renegable SACK
 
@@ -178,8 +176,16 @@ See https://access.redhat.com/documentation/en-us/red_hat_enterprise_linux_for_r
 
 #include "tfo_config.h"
 
-/* Definitions for optional behaviour */
-// TODO - RELEASE_SACKED_PACKETS	// XXX - add code for not releasing and detecting reneging (see Linux code/RFC8985 for detecting)
+/* Definitions for optional behaviour
+ *
+ * RELEASE_SACKED_PACKETS - free the mbufs of SACK'd packets, other than the
+ *   last packet which is kept for a tail loss probe. The data is kept in the
+ *   send buffer if there is one and it can be added. If the receiver reneges
+ *   on a SACK, the SACK'd packets are resent by RTO recovery, unless the data
+ *   of any of them is no longer held, in which case the connection is reset.
+ *   Configure defines this unless --disable-release-sacked-packets is given,
+ *   and then SACK'd packets are kept until they are ACK'd.
+ */
 
 
 #ifdef WRITE_PCAP
@@ -207,6 +213,7 @@ _Pragma("GCC diagnostic pop")
 #include <rte_net.h>
 #include <rte_malloc.h>
 #include <rte_ethdev.h>
+#include <rte_thash.h>
 #ifdef WRITE_PCAP
 #include <rte_cycles.h>
 #include <rte_pcapng.h>
@@ -227,6 +234,9 @@ _Pragma("GCC diagnostic pop")
 #include "tfo_common.h"
 #include "tfo_worker.h"
 #include "tfo_rbtree.h"
+#include "linux_rbtree_augmented.h"
+#include "tfo_pkt_tree.h"
+#include "tfo_eflow_hash.h"
 #include "win_minmax.h"
 #if defined DEBUG_PRINT_TO_BUF || defined PER_THREAD_LOGS
 #include "tfo_printf.h"
@@ -264,10 +274,14 @@ static thread_local uint16_t priv_vlan_tci;
 static thread_local unsigned option_flags;
 static thread_local struct rte_mempool *ack_pool;
 static thread_local uint16_t ack_pool_priv_size;
+static thread_local struct rte_mempool *small_pool;
+static thread_local uint16_t small_pool_max_len;
+static thread_local struct rte_mempool *sndbuf_pool;
+static thread_local struct rte_mempool *sndbuf_mbuf_pool;	/* for rebuilt packets */
+static thread_local bool buf_quotas;
 static thread_local uint16_t port_id;
 static thread_local uint16_t queue_idx;
 static thread_local time_ns_t now;
-static thread_local struct list_head send_failed_list;
 static thread_local struct rb_root_cached timer_tree;
 #ifdef WRITE_PCAP
 static thread_local struct rte_mempool *pcap_mempool;
@@ -650,8 +664,8 @@ update_timer_ef(struct tfo_eflow *ef)
 	time_ns_t min_time = TFO_INFINITE_TS;
 	struct tfo *fo;
 
-	if (ef->tfo_idx != TFO_IDX_UNUSED) {
-		fo = &worker.f[ef->tfo_idx];
+	if (ef->fo) {
+		fo = ef->fo;
 
 		/* Note, the timeouts cannot be TFO_TS_NONE */
 		if (fo->priv.timeout < min_time)
@@ -691,30 +705,37 @@ update_timer(struct tfo_eflow *ef, time_ns_t ns)
 	update_timer_ef(ef);
 }
 
-static inline void
-set_ack_bit(struct tfo_tx_bufs *tx_bufs, uint16_t bit)
+/* An mbuf that is not buffered, e.g. an ACK or a packet being forwarded, is
+ * freed once it has been sent. This is recorded in the worker's tx_discard,
+ * alongside the mbuf's tx_bufs slot, rather than in the mbuf, since the mbuf
+ * must not be read once the driver has accepted it. */
+static inline bool
+discard_after_send(const struct tfo_tx_bufs *tx_bufs, unsigned buf)
 {
-	tx_bufs->acks[bit / CHAR_BIT] |= (1U << (bit % CHAR_BIT));
+	return tx_bufs->discard[buf];
 }
 
-static inline void
-clear_ack_bit(struct tfo_tx_bufs *tx_bufs, uint16_t bit)
+static inline struct tfo_mbuf_priv *
+get_priv_addr(struct rte_mbuf *m)
 {
-	tx_bufs->acks[bit / CHAR_BIT] &= ~(1U << (bit % CHAR_BIT));
+	char *priv = rte_mbuf_to_priv(m);
+
+	return (struct tfo_mbuf_priv *)(priv + config->mbuf_priv_offset);
 }
 
+/* false for a packet without an mbuf, and for one rebuilt from the send buffer */
 static inline bool
-ack_bit_is_set(struct tfo_tx_bufs *tx_bufs, uint16_t bit)
+pkt_in_mbuf_priv(const struct tfo_pkt *pkt)
 {
-	return !!(tx_bufs->acks[bit / CHAR_BIT] & (1U << (bit % CHAR_BIT)));
+	return pkt->m && pkt == &get_priv_addr(pkt->m)->pkt_store;
 }
 
-static inline struct tfo_mbuf_priv *
-get_priv_addr(struct rte_mbuf *m)
+static inline bool
+sndbuf_holds(const struct tfo_sndbuf *sb, uint32_t seq, uint32_t len)
 {
-	char *priv = rte_mbuf_to_priv(m);
-
-	return (struct tfo_mbuf_priv *)(priv + config->mbuf_priv_offset);
+	return sb->len &&
+	       !before(seq, sb->start_seq) &&
+	       !after(seq + len, sb->start_seq + sb->len);
 }
 
 #if defined DEBUG_MEMPOOL || defined DEBUG_ACK_MEMPOOL || defined DEBUG_MEMPOOL_INIT || defined DEBUG_ACK_MEMPOOL_INIT || defined DEBUG_PCAP_MEMPOOL
@@ -1045,12 +1066,11 @@ print_side(FILE *fp, const struct tfo_side *s,
 	uint32_t next_exp;
 	time_ns_t time_diff;
 	uint16_t num_gaps = 0;
-	uint8_t *data_start;
 	unsigned sack_entry, last_sack_entry;
 	uint16_t num_in_flight = 0;
 	uint16_t num_sacked = 0;
 	uint16_t num_queued = 0;
-	char flags[14];
+	char flags[15];
 #ifdef DEBUG_MBUF_COOKIES
 	uint64_t cookie;
 #endif
@@ -1071,6 +1091,7 @@ print_side(FILE *fp, const struct tfo_side *s,
 #ifdef CALC_TS_CLOCK
 	if (s->flags & TFO_SIDE_FL_TS_CLOCK_OVERFLOW) strcat (flags, "T");
 #endif
+	if (s->flags & TFO_SIDE_FL_SACK_RENEGING) strcat(flags, "N");
 
 	fprintf(fp, SI SI SI "rcv_nxt 0x%x snd_una 0x%x snd_nxt 0x%x snd_win 0x%x rcv_win 0x%x ssthresh 0x%x"
 		" cwnd 0x%x dup_ack %u last_rcv_win_end 0x%x",
@@ -1090,7 +1111,7 @@ print_side(FILE *fp, const struct tfo_side *s,
 		fprintf(fp, " no last sent");
 	else
 		fprintf(fp, " last sent 0x%x", list_entry(s->last_sent, struct tfo_pkt, xmit_ts_list)->seq);
-	fprintf(fp, " last_ack 0x%x pktcount %u\n", s->last_ack_sent, s->pktcount);
+	fprintf(fp, " last_ack 0x%x pktcount %u buffered %u bytes %u mbufs\n", s->last_ack_sent, s->pktcount, s->buf_bytes, s->buf_mbufs);
 	if ((ef->flags & TFO_EF_FL_SACK) &&
 	     (s->sack_entries || s->sack_gap)) {
 		fprintf(fp, SI SI SI SIS "sack_gaps %u sack_entries %u, first_entry %u", s->sack_gap, s->sack_entries, s->first_sack_entry);
@@ -1207,7 +1228,7 @@ print_side(FILE *fp, const struct tfo_side *s,
 		if (p->flags & TFO_PKT_FL_ACKED) strcat(s_flags, "a");
 		if (p->flags & TFO_PKT_FL_SACKED) strcat(s_flags, "s");
 		if (p->flags & TFO_PKT_FL_QUEUED_SEND) strcat(s_flags, "Q");
-		if (list_is_queued(&p->send_failed_list)) strcat(s_flags, "F");
+		if (p->in_txq) strcat(s_flags, "F");
 
 		i++;
 		if (after(p->seq, next_exp)) {
@@ -1224,34 +1245,32 @@ print_side(FILE *fp, const struct tfo_side *s,
 		    !before(segend(p), segend(list_next_entry(p, list))))
 			fprintf(fp, " *** pkt ends after next pkt ends ERROR");
 
-		data_start = p->m ? rte_pktmbuf_mtod(p->m, uint8_t *) : 0;
 		if (p->m) {
 			tcp_flags[0] = '\0';
-			if (p->tcp->tcp_flags & RTE_TCP_SYN_FLAG) strcat(tcp_flags, "S");
-			if (p->tcp->tcp_flags & RTE_TCP_ACK_FLAG) strcat(tcp_flags, "A");
-			if (p->tcp->tcp_flags & RTE_TCP_URG_FLAG) strcat(tcp_flags, "U");
-			if (p->tcp->tcp_flags & RTE_TCP_PSH_FLAG) strcat(tcp_flags, "P");
-			if (p->tcp->tcp_flags & RTE_TCP_CWR_FLAG) strcat(tcp_flags, "C");
-			if (p->tcp->tcp_flags & RTE_TCP_ECE_FLAG) strcat(tcp_flags, "E");
-			if (p->tcp->tcp_flags & RTE_TCP_FIN_FLAG) strcat(tcp_flags, "F");
-			if (p->tcp->tcp_flags & RTE_TCP_RST_FLAG) strcat(tcp_flags, "R");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_SYN_FLAG) strcat(tcp_flags, "S");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_ACK_FLAG) strcat(tcp_flags, "A");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_URG_FLAG) strcat(tcp_flags, "U");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_PSH_FLAG) strcat(tcp_flags, "P");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_CWR_FLAG) strcat(tcp_flags, "C");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_ECE_FLAG) strcat(tcp_flags, "E");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_FIN_FLAG) strcat(tcp_flags, "F");
+			if (pkt_tcp(p)->tcp_flags & RTE_TCP_RST_FLAG) strcat(tcp_flags, "R");
 
 			fprintf(fp, SI SI SI "%4u:\tm %p, seq 0x%x%s"
 #ifdef DEBUG_RELATIVE_SEQ
 			       " (%u:%u)"
 #endif
-			       " ack 0x%x, len %u flags-%s tcp_flags-%s vlan %u ip %ld tcp %ld",
+			       " ack 0x%x, len %u flags-%s tcp_flags-%s vlan %u ip %u tcp %u",
 			       i, p->m, p->seq, after(segend(p), s->snd_una + (s->snd_win << s->snd_win_shift)) ? "*" : "",
 #ifdef DEBUG_RELATIVE_SEQ
 			       p->seq - s_other->first_seq, p->seq - s_other->first_seq + p->seglen,
 #endif
-			       ntohl(p->tcp->recv_ack), p->seglen, s_flags, tcp_flags, p->m->vlan_tci,
-			       (uint8_t *)p->iph.ip4h - data_start,
-			       (uint8_t *)p->tcp - data_start);
-			if (ef->flags & TFO_EF_FL_TIMESTAMP || p->ts)
-				fprintf(fp, " ts %ld", p->ts ? (uint8_t *)p->ts - data_start : 0U);
-			if (ef->flags & TFO_EF_FL_SACK || p->sack) {
-				fprintf(fp, " sack %ld", p->sack ? (uint8_t *)p->sack - data_start : 0U);
+			       ntohl(pkt_tcp(p)->recv_ack), p->seglen, s_flags, tcp_flags, p->m->vlan_tci,
+			       p->ip_ofs, p->tcp_ofs);
+			if (ef->flags & TFO_EF_FL_TIMESTAMP || p->ts_ofs)
+				fprintf(fp, " ts %u", p->ts_ofs ? (unsigned)p->tcp_ofs + p->ts_ofs : 0U);
+			if (ef->flags & TFO_EF_FL_SACK || p->sack_ofs) {
+				fprintf(fp, " sack %u", p->sack_ofs ? (unsigned)p->tcp_ofs + p->sack_ofs : 0U);
 				if (ef->flags & TFO_EF_FL_SACK)
 					fprintf(fp, " sacked segs %u", p->rack_segs_sacked);
 			}
@@ -1323,27 +1342,27 @@ print_side(FILE *fp, const struct tfo_side *s,
 		next_exp = segend(p);
 
 #ifdef DEBUG_PKT_SANITY
-		const struct tfo *fo = &worker.f[ef->tfo_idx];
+		const struct tfo *fo = ef->fo;
 		if (!p->m) {
 			if (!p->rack_segs_sacked) {
 				dump_pkt_mbuf(p);
-				fprintf(fp, "ERROR in pkt s %p pub %d p->m %p p->iph.ip4h %p data_start %p recv_ack 0x%x snd_una 0x%x snd_nxt 0x%x\n",
-					s, s== &fo->pub, p, p->iph.ip4h, data_start, p->tcp ? ntohl(p->tcp->recv_ack) : 0xcafeaded,
+				fprintf(fp, "ERROR in pkt s %p pub %d p->m %p ip_ofs %u tcp_ofs %u snd_una 0x%x snd_nxt 0x%x\n",
+					s, s== &fo->pub, p, p->ip_ofs, p->tcp_ofs,
 					s == &fo->pub ? fo->priv.snd_una : fo->pub.snd_una, s == &fo->pub ? fo->priv.snd_nxt : fo->pub.snd_nxt);
 			}
 		} else if ((s == &fo->pub &&
 		     (p->m->vlan_tci ||
-		      (uint8_t *)p->iph.ip4h - data_start != 14 /* ||
-		      before(ntohl(p->tcp->recv_ack), fo->priv.snd_una) ||
-		      after(ntohl(p->tcp->recv_ack), fo->priv.snd_nxt) */)) ||
+		      p->ip_ofs != 14 /* ||
+		      before(ntohl(pkt_tcp(p)->recv_ack), fo->priv.snd_una) ||
+		      after(ntohl(pkt_tcp(p)->recv_ack), fo->priv.snd_nxt) */)) ||
 		    (s == &fo->priv &&
 		     (p->m->vlan_tci != 100 ||
-		      (uint8_t *)p->iph.ip4h - data_start != 18 /* ||
-		      before(ntohl(p->tcp->recv_ack), fo->pub.snd_una) ||
-		      after(ntohl(p->tcp->recv_ack), fo->pub.snd_nxt) */))) {
+		      p->ip_ofs != 18 /* ||
+		      before(ntohl(pkt_tcp(p)->recv_ack), fo->pub.snd_una) ||
+		      after(ntohl(pkt_tcp(p)->recv_ack), fo->pub.snd_nxt) */))) {
 			dump_pkt_mbuf(p);
-			fprintf(fp, "ERROR in pkt s %p pub %d vlan %u p->iph.ip4h %p data_start %p recv_ack 0x%x snd_una 0x%x snd_nxt 0x%x\n",
-				s, s== &fo->pub, p->m->vlan_tci, p->iph.ip4h, data_start, ntohl(p->tcp->recv_ack),
+			fprintf(fp, "ERROR in pkt s %p pub %d vlan %u ip_ofs %u recv_ack 0x%x snd_una 0x%x snd_nxt 0x%x\n",
+				s, s== &fo->pub, p->m->vlan_tci, p->ip_ofs, ntohl(pkt_tcp(p)->recv_ack),
 				s == &fo->pub ? fo->priv.snd_una : fo->pub.snd_una, s == &fo->pub ? fo->priv.snd_nxt : fo->pub.snd_nxt);
 		}
 #endif
@@ -1374,26 +1393,25 @@ check_mbuf_in_use(struct rte_mbuf *m, struct tcp_worker *w, struct tfo_tx_bufs *
 	bool in_use = false;
 	unsigned pkt_no;
 
-	for (i = 0; i < config->hef_n; i++) {
-		if (hlist_empty(&w->hef[i]))
+	for (i = 0; i < config->ef_n; i++) {
+		ef = tfo_eflow_from_idx(w, i);
+		if (ef->state == TFO_STATE_NONE)
 			continue;
 
-		hlist_for_each_entry(ef, &w->hef[i], hlist) {
-			if (ef->tfo_idx == TFO_IDX_UNUSED)
-				continue;
-			fo = &w->f[ef->tfo_idx];
-			s = &fo->priv;
-			while (s) {
-				pkt_no = 0;
-				list_for_each_entry(pkt, &s->pktlist, list) {
-					pkt_no++;
-					if (pkt->m == m) {
-						printf("New mbuf %p already in use by eflow %p %s pkt %u\n", m, ef, s == &fo->priv ? "priv" : "pub", pkt_no);
-						in_use = true;
-					}
+		fo = ef->fo;
+		if (!fo)
+			continue;
+		s = &fo->priv;
+		while (s) {
+			pkt_no = 0;
+			list_for_each_entry(pkt, &s->pktlist, list) {
+				pkt_no++;
+				if (pkt->m == m) {
+					printf("New mbuf %p already in use by eflow %p %s pkt %u\n", m, ef, s == &fo->priv ? "priv" : "pub", pkt_no);
+					in_use = true;
 				}
-				s = s == &fo->priv ? &fo->pub : NULL;
 			}
+			s = s == &fo->priv ? &fo->pub : NULL;
 		}
 	}
 
@@ -1427,16 +1445,16 @@ do_dump_eflow(FILE *fp, const struct tcp_worker *w, const struct tfo_eflow *ef)
 	if (ef->flags & TFO_EF_FL_DUPLICATE_SYN) strcat(flags, "D");
 
 	if (ef->flags & TFO_EF_FL_IPV6) {
-		inet_ntop(AF_INET6, &ef->pub_addr.v6, pub_addr_str, sizeof(pub_addr_str));
-		inet_ntop(AF_INET6, &ef->priv_addr.v6, priv_addr_str, sizeof(priv_addr_str));
+		inet_ntop(AF_INET6, &tfo_eflow_addr6(ef)->pub_addr, pub_addr_str, sizeof(pub_addr_str));
+		inet_ntop(AF_INET6, &tfo_eflow_addr6(ef)->priv_addr, priv_addr_str, sizeof(priv_addr_str));
 	} else {
-		addr = rte_be_to_cpu_32(ef->pub_addr.v4.s_addr);
+		addr = rte_be_to_cpu_32(ef->pub_addr.s_addr);
 		inet_ntop(AF_INET, &addr, pub_addr_str, sizeof(pub_addr_str));
-		addr = rte_be_to_cpu_32(ef->priv_addr.v4.s_addr);
+		addr = rte_be_to_cpu_32(ef->priv_addr.s_addr);
 		inet_ntop(AF_INET, &addr, priv_addr_str, sizeof(priv_addr_str));
 	}
-	fprintf(fp, "ef %p state %s tfo_idx %u, addr: priv %s pub %s port: priv %u pub %u flags-%s\n",
-		ef, get_state_name(ef->state), ef->tfo_idx, priv_addr_str, pub_addr_str, ef->priv_port, ef->pub_port, flags);
+	fprintf(fp, "ef %p idx %u state %s tfo %p, addr: priv %s pub %s port: priv %u pub %u flags-%s\n",
+		ef, tfo_eflow_idx(w, ef), get_state_name(ef->state), ef->fo, priv_addr_str, pub_addr_str, ef->priv_port, ef->pub_port, flags);
 	fprintf(fp, "idle_timeout " NSEC_TIME_PRINT_FORMAT " (" NSEC_TIME_PRINT_FORMAT ") timer " NSEC_TIME_PRINT_FORMAT " (" NSEC_TIME_PRINT_FORMAT ") rb %p / %p \\ %p\n",
 		NSEC_TIME_PRINT_PARAMS(ef->idle_timeout), NSEC_TIME_PRINT_PARAMS_ABS(ef->idle_timeout - now),
 		NSEC_TIME_PRINT_PARAMS(ef->timer.time), NSEC_TIME_PRINT_PARAMS_ABS(ef->timer.time - now),
@@ -1446,13 +1464,13 @@ do_dump_eflow(FILE *fp, const struct tcp_worker *w, const struct tfo_eflow *ef)
 	if (ef->state == TCP_STATE_SYN)
 		fprintf(fp, "svr_snd_una 0x%x cl_snd_win 0x%x cl_rcv_nxt 0x%x cl_ttl %u SYN ns " NSEC_TIME_PRINT_FORMAT "\n",
 		       ef->server_snd_una, ef->client_snd_win, ef->client_rcv_nxt, ef->client_ttl, NSEC_TIME_PRINT_PARAMS(ef->start_time));
-	if (ef->tfo_idx != TFO_IDX_UNUSED) {
+	if (ef->fo) {
 		// Print tfo
-		fo = &w->f[ef->tfo_idx];
-		if (fo->idx == ef->tfo_idx)
+		fo = ef->fo;
+		if (fo->idx == tfo_eflow_idx(w, ef))
 			fprintf(fp, "idx %u\n", fo->idx);
 		else
-			fprintf(fp, "idx %u - does not match ef->tfo_idx ERROR\n" , fo->idx);
+			fprintf(fp, "idx %u - does not match eflow index ERROR\n" , fo->idx);
 		fprintf(fp, "private: (%p)\n", &fo->priv);
 		print_side(fp, &fo->priv, &fo->pub);
 		fprintf(fp, "public: (%p)\n", &fo->pub);
@@ -1468,28 +1486,65 @@ dump_eflow(const struct tcp_worker *w, const struct tfo_eflow *ef)
 }
 
 static void
-do_dump_details(FILE *fp, const struct tcp_worker *w)
+do_dump_hash_table(FILE *fp, const struct tcp_worker *w, bool old)
 {
 	struct tfo_eflow *ef;
 	unsigned i;
-#ifdef DEBUG_ETHDEV
-	uint16_t port;
-	struct rte_eth_stats eth_stats;
+#ifdef EFLOW_BUCKET_HASH
+	const struct tfo_eflow_bucket *hef = old ? w->hef_old : w->hef;
+	unsigned j;
+#else
+	const struct hlist_head *hef = old ? w->hef_old : w->hef;
 #endif
+	uint32_t hef_n = (old ? w->hef_old_mask : w->hef_mask) + 1;
 
-	fprintf(fp, "In use: eflows %u, flows %u, packets %u, max_packets %u timer rb root %p left %p\n", w->ef_use, w->f_use, w->p_use, w->p_max_use,
-		RB_EMPTY_ROOT(&timer_tree.rb_root) ? NULL : container_of(timer_tree.rb_root.rb_node, struct tfo_eflow, timer.node),
-		timer_tree.rb_leftmost ? container_of(timer_tree.rb_leftmost, struct tfo_eflow, timer.node) : NULL);
-	for (i = 0; i < config->hef_n; i++) {
-		if (hlist_empty(&w->hef[i]))
+	if (old)
+		fprintf(fp, "Old flow hash table, migrated to bucket %u of %u\n", w->hef_migrate, hef_n);
+
+	for (i = 0; i < hef_n; i++) {
+#ifdef EFLOW_BUCKET_HASH
+		bool printed_hash = false;
+
+		for (j = 0; j < EF_BUCKET_ENTRIES; j++) {
+			if (hef[i].sig[j] == EF_SIG_EMPTY)
+				continue;
+
+			if (!printed_hash) {
+				fprintf(fp, "Flow hash bucket %u\n", i);
+				printed_hash = true;
+			}
+			fprintf(fp, "  slot %u sig 0x%x\n", j, hef[i].sig[j]);
+			ef = tfo_eflow_from_idx(w, hef[i].ef_idx[j]);
+			do_dump_eflow(fp, w, ef);
+		}
+#else
+		if (hlist_empty(&hef[i]))
 			continue;
 
 		fprintf(fp, "Flow hash %u\n", i);
-		hlist_for_each_entry(ef, &w->hef[i], hlist) {
+		hlist_for_each_entry(ef, &hef[i], hlist) {
 			// print eflow
 			do_dump_eflow(fp, w, ef);
 		}
+#endif
 	}
+}
+
+static void
+do_dump_details(FILE *fp, const struct tcp_worker *w)
+{
+#ifdef DEBUG_ETHDEV
+	uint16_t port;
+	struct rte_eth_stats eth_stats;
+#endif
+
+	fprintf(fp, "In use: eflows %u, flows %u, packets %u, max_packets %u, buffered bytes %" PRIu64 " mbufs %u timer rb root %p left %p\n",
+		w->ef_use, w->f_use, w->p_use, w->p_max_use, w->buf_bytes, w->buf_mbufs,
+		RB_EMPTY_ROOT(&timer_tree.rb_root) ? NULL : container_of(timer_tree.rb_root.rb_node, struct tfo_eflow, timer.node),
+		timer_tree.rb_leftmost ? container_of(timer_tree.rb_leftmost, struct tfo_eflow, timer.node) : NULL);
+	do_dump_hash_table(fp, w, false);
+	if (w->hef_old)
+		do_dump_hash_table(fp, w, true);
 
 #ifdef DEBUG_ETHDEV
 	if (rte_eth_stats_get(port = (rte_lcore_id() - 1), &eth_stats))
@@ -1536,14 +1591,14 @@ do_post_tx_dump(const struct tcp_worker *w, struct tfo_tx_bufs *tx_bufs)
 
 	for (buf = 0; buf < tx_bufs->nb_tx; buf++) {
 		/* We don't do anything with ACKs */
-		if (ack_bit_is_set(tx_bufs, buf))
+		if (discard_after_send(tx_bufs, buf))
 			continue;
 
 		ef = get_priv_addr(tx_bufs->m[buf])->fos->ef;
 
 		/* Check we haven't already dumped the eflow */
 		for (prior = 0; prior < buf; prior++) {
-			if (ack_bit_is_set(tx_bufs, prior))
+			if (discard_after_send(tx_bufs, prior))
 				continue;
 			if (get_priv_addr(tx_bufs->m[buf])->fos->ef == ef)
 				break;
@@ -1585,6 +1640,187 @@ tfo_eflow_dump_fp(FILE *fp)
 #endif
 #endif
 
+/* The number of eflows in a hash bucket above which they are counted together */
+#define EF_HASH_STATS_MAX_CHAIN	8
+
+/* Show how evenly the eflows are spread over a hash table */
+static void
+do_dump_hash_table_stats(FILE *fp, const struct tcp_worker *w, bool old)
+{
+	unsigned hist[EF_HASH_STATS_MAX_CHAIN + 1] = { 0 };
+	unsigned used = 0, shared = 0, max_len = 0, n_ef = 0;
+	unsigned len;
+	unsigned i;
+	uint32_t hef_mask = old ? w->hef_old_mask : w->hef_mask;
+#ifdef EFLOW_BUCKET_HASH
+	const struct tfo_eflow_bucket *hef = old ? w->hef_old : w->hef;
+	unsigned j;
+	unsigned in_alt = 0;
+#else
+	const struct hlist_head *hef = old ? w->hef_old : w->hef;
+	const struct tfo_eflow *ef;
+#endif
+
+	for (i = 0; i <= hef_mask; i++) {
+		len = 0;
+#ifdef EFLOW_BUCKET_HASH
+		for (j = 0; j < EF_BUCKET_ENTRIES; j++) {
+			if (hef[i].sig[j] == EF_SIG_EMPTY)
+				continue;
+
+			len++;
+			if ((tfo_eflow_from_idx(w, hef[i].ef_idx[j])->flow_hash & hef_mask) != i)
+				in_alt++;
+		}
+#else
+		hlist_for_each_entry(ef, &hef[i], hlist)
+			len++;
+#endif
+
+		hist[min(len, EF_HASH_STATS_MAX_CHAIN)]++;
+		if (len) {
+			used++;
+			n_ef += len;
+			if (len > 1)
+				shared += len;
+			if (len > max_len)
+				max_len = len;
+		}
+	}
+
+	fprintf(fp, "  %s table: buckets %u used %u eflows %u sharing a bucket %u max per bucket %u",
+		old ? "old" : "current", hef_mask + 1, used, n_ef, shared, max_len);
+	if (used)
+		fprintf(fp, " mean per used bucket %u.%02u", n_ef / used, (n_ef % used) * 100 / used);
+	fprintf(fp, "\n    eflows per bucket:");
+	for (i = 0; i <= EF_HASH_STATS_MAX_CHAIN; i++)
+		fprintf(fp, " %u%s:%u", i, i == EF_HASH_STATS_MAX_CHAIN ? "+" : "", hist[i]);
+	fprintf(fp, "\n");
+#ifdef EFLOW_BUCKET_HASH
+	fprintf(fp, "    in alternative bucket %u\n", in_alt);
+#endif
+}
+
+static void
+do_dump_hash_stats(FILE *fp, const struct tcp_worker *w)
+{
+	fprintf(fp, "eflow hash: eflows %u load %u%% grown %" PRIu64 " shrunk %" PRIu64,
+		w->ef_use, eflow_hash_load(w), w->st.hash_grow, w->st.hash_shrink);
+	if (w->hef_old)
+		fprintf(fp, " migrated %u of %u buckets", w->hef_migrate, w->hef_old_mask + 1);
+	fprintf(fp, "\n");
+#ifdef EFLOW_BUCKET_HASH
+	fprintf(fp, "  added to alternative bucket %" PRIu64 " cuckoo moves %" PRIu64 " add failed %" PRIu64 "\n",
+		w->st.hash_alt_bucket, w->st.hash_cuckoo_moves, w->st.hash_add_fail);
+#endif
+
+	do_dump_hash_table_stats(fp, w, false);
+	if (w->hef_old)
+		do_dump_hash_table_stats(fp, w, true);
+}
+
+__visible void
+tfo_eflow_hash_stats_fp(FILE *fp)
+{
+	do_dump_hash_stats(fp, &worker);
+}
+
+static void
+do_dump_small_mbuf_stats(FILE *fp, const struct tcp_worker *w)
+{
+	unsigned in_use;
+
+	if (!small_pool) {
+		fprintf(fp, "small mbufs: not configured\n");
+		return;
+	}
+
+	/* The pool is shared by the workers on the NUMA node */
+	in_use = rte_mempool_in_use_count(small_pool);
+	fprintf(fp, "small mbufs: max data %u copied %" PRIu64 " alloc failed %" PRIu64 " receive buffer bytes released %" PRIu64 "\n",
+		small_pool_max_len, w->st.small_mbuf_copies, w->st.small_mbuf_alloc_fail, w->st.small_mbuf_bytes_saved);
+	fprintf(fp, "  pool %s: in use %u of %u, mean bytes saved per copy %" PRIu64 "\n",
+		small_pool->name, in_use, small_pool->size,
+		w->st.small_mbuf_copies ? w->st.small_mbuf_bytes_saved / w->st.small_mbuf_copies : 0);
+}
+
+static void
+do_dump_sndbuf_stats(FILE *fp, const struct tcp_worker *w)
+{
+	if (!sndbuf_pool) {
+		fprintf(fp, "send buffers: not configured\n");
+		return;
+	}
+
+	fprintf(fp, "send buffers: packets %" PRIu64 " bytes %" PRIu64 " rebuilt %" PRIu64 "\n",
+		w->st.sndbuf_pkts, w->st.sndbuf_bytes, w->st.sndbuf_rebuilds);
+	fprintf(fp, "  failures: chunk alloc %" PRIu64 " template %" PRIu64 " rebuild %" PRIu64 "\n",
+		w->st.sndbuf_chunk_alloc_fail, w->st.sndbuf_template_fail, w->st.sndbuf_rebuild_fail);
+	fprintf(fp, "  pool %s: chunks in use %u of %u, %zu bytes each\n",
+		sndbuf_pool->name, rte_mempool_in_use_count(sndbuf_pool), sndbuf_pool->size, sizeof(struct tfo_sndbuf_chunk));
+}
+
+static void
+do_dump_buf_stats(FILE *fp, const struct tcp_worker *w)
+{
+	fprintf(fp, "buffers: bytes %" PRIu64 " mbufs %u, windows limited by quota %" PRIu64 "\n",
+		w->buf_bytes, w->buf_mbufs, w->st.buf_win_limited);
+	fprintf(fp, "tx staging: size %u, sent early %" PRIu64 "\n", w->max_tx, w->st.tx_bufs_early_send);
+	fprintf(fp, "acks: coalesced %" PRIu64 "\n", w->st.acks_coalesced);
+	fprintf(fp, "checksums: rx bad %" PRIu64 ", tx not offloaded %" PRIu64 ", tx rejected %" PRIu64 "\n",
+		w->st.rx_bad_cksum, w->st.tx_cksum_sw, w->st.tx_prepare_drop);
+	if (buf_quotas)
+		fprintf(fp, "  quotas: flow %u bytes %u mbufs, worker %" PRIu64 " bytes %u mbufs\n",
+			config->flow_buf_bytes, config->flow_buf_mbufs, config->worker_buf_bytes, config->worker_buf_mbufs);
+}
+
+static void
+do_dump_txq_stats(FILE *fp, const struct tcp_worker *w)
+{
+	const struct tfo_txq *q = &w->txq;
+
+	fprintf(fp, "tx queue: depth %u, acks %u resends %u new %u, max %u\n",
+		q->depth, q->nb_acks, q->nb_pkts[TFO_TXQ_RESEND], q->nb_pkts[TFO_TXQ_NEW], q->max_use);
+	fprintf(fp, "  queued %" PRIu64 " drained %" PRIu64 ", dropped acks %" PRIu64 " resends %" PRIu64 " new %" PRIu64 "\n",
+		w->st.txq_queued, w->st.txq_drained, w->st.txq_drop_ack, w->st.txq_drop_resend, w->st.txq_drop_new);
+}
+
+static void
+do_dump_reseg_stats(FILE *fp, const struct tcp_worker *w)
+{
+	if (!(option_flags & TFO_CONFIG_FL_RESEGMENT)) {
+		fprintf(fp, "resegmentation: not configured\n");
+		return;
+	}
+
+	fprintf(fp, "resegmentation: split %" PRIu64 " into %" PRIu64 " extra segments, merged %" PRIu64 ", alloc failed %" PRIu64 "\n",
+		w->st.reseg_split, w->st.reseg_split_segs, w->st.reseg_merge, w->st.reseg_alloc_fail);
+}
+
+static void
+do_dump_sack_reneging_stats(FILE *fp, const struct tcp_worker *w)
+{
+	fprintf(fp, "sack reneging: resent %" PRIu64 " reset %" PRIu64 "%s\n",
+		w->st.sack_reneging_resend, w->st.sack_reneging_rst,
+#ifdef RELEASE_SACKED_PACKETS
+		", sacked packets released"
+#else
+		""
+#endif
+		);
+}
+
+__visible void
+tfo_mbuf_stats_fp(FILE *fp)
+{
+	do_dump_buf_stats(fp, &worker);
+	do_dump_txq_stats(fp, &worker);
+	do_dump_small_mbuf_stats(fp, &worker);
+	do_dump_sndbuf_stats(fp, &worker);
+	do_dump_reseg_stats(fp, &worker);
+	do_dump_sack_reneging_stats(fp, &worker);
+}
+
 #ifdef DEBUG_CHECK_PKTS
 static unsigned
 check_side_packets(const struct tfo_side *s, bool priv, const struct tfo_eflow *ef)
@@ -1608,7 +1844,7 @@ check_side_packets(const struct tfo_side *s, bool priv, const struct tfo_eflow *
 		errors[0] = '\0';
 
 		if (!pkt->m) {
-			if (pkt->rack_segs_sacked)
+			if (pkt->rack_segs_sacked || sndbuf_holds(&s->sndbuf, pkt->seq, pkt->seglen))
 				continue;
 			strcat(errors, " no-m-no-sackd");
 			continue;
@@ -1645,7 +1881,7 @@ check_side_packets(const struct tfo_side *s, bool priv, const struct tfo_eflow *
 		case RTE_PTYPE_L3_IPV6_EXT_UNKNOWN:
 			is_ipv6 = true;
 			off = hdr_len;
-			proto = rte_net_skip_ip6_ext(pkt->iph.ip6h->proto, pkt->m, &off, &frag);
+			proto = rte_net_skip_ip6_ext(pkt_ipv6(pkt)->proto, pkt->m, &off, &frag);
 			if (proto != IPPROTO_TCP) {
 				if (unlikely(proto < 0))
 					strcat(errors, " proto_invalid");
@@ -1667,26 +1903,26 @@ check_side_packets(const struct tfo_side *s, bool priv, const struct tfo_eflow *
 			strcat(errors, " vlan");
 
 		/* Check IP and TCP offsets */
-		if (ip.ip4h != pkt->iph.ip4h ||
-		    tcp != pkt->tcp)
+		if (ip.ip4h != pkt_ipv4(pkt) ||
+		    tcp != pkt_tcp(pkt))
 			strcat(errors, " offsets");
 
 		/* Check src and dest addrs */
 		if (!is_ipv6) {
 			if ((priv &&
-			     (rte_be_to_cpu_32(ip.ip4h->src_addr) != ef->pub_addr.v4.s_addr ||
-			      rte_be_to_cpu_32(ip.ip4h->dst_addr) != ef->priv_addr.v4.s_addr)) ||
+			     (rte_be_to_cpu_32(ip.ip4h->src_addr) != ef->pub_addr.s_addr ||
+			      rte_be_to_cpu_32(ip.ip4h->dst_addr) != ef->priv_addr.s_addr)) ||
 			    (!priv &&
-			     (rte_be_to_cpu_32(ip.ip4h->src_addr) != ef->priv_addr.v4.s_addr ||
-			      rte_be_to_cpu_32(ip.ip4h->dst_addr) != ef->pub_addr.v4.s_addr)))
+			     (rte_be_to_cpu_32(ip.ip4h->src_addr) != ef->priv_addr.s_addr ||
+			      rte_be_to_cpu_32(ip.ip4h->dst_addr) != ef->pub_addr.s_addr)))
 				strcat(errors," IP4 addr");
 		} else {
 			if ((priv &&
-			     (memcmp(&ip.ip6h->src_addr, &ef->pub_addr.v6, sizeof(ip.ip6h->src_addr)) ||
-			      memcmp(&ip.ip6h->dst_addr, &ef->priv_addr.v6, sizeof(ip.ip6h->dst_addr)))) ||
+			     (memcmp(&ip.ip6h->src_addr, &tfo_eflow_addr6(ef)->pub_addr, sizeof(ip.ip6h->src_addr)) ||
+			      memcmp(&ip.ip6h->dst_addr, &tfo_eflow_addr6(ef)->priv_addr, sizeof(ip.ip6h->dst_addr)))) ||
 			    (!priv &&
-			     (memcmp(&ip.ip6h->src_addr, &ef->priv_addr.v6, sizeof(ip.ip6h->src_addr)) ||
-			      memcmp(&ip.ip6h->dst_addr, &ef->pub_addr.v6, sizeof(ip.ip6h->dst_addr)))))
+			     (memcmp(&ip.ip6h->src_addr, &tfo_eflow_addr6(ef)->priv_addr, sizeof(ip.ip6h->src_addr)) ||
+			      memcmp(&ip.ip6h->dst_addr, &tfo_eflow_addr6(ef)->pub_addr, sizeof(ip.ip6h->dst_addr)))))
 				strcat(errors, " IP6 addr");
 		}
 
@@ -1706,9 +1942,9 @@ check_side_packets(const struct tfo_side *s, bool priv, const struct tfo_eflow *
 
 			/* Check TCP payload len */
 			if (!pkt->rack_segs_sacked &&
-			    pkt->seglen != pkt->m->pkt_len - ((uint8_t *)pkt->tcp - rte_pktmbuf_mtod(pkt->m, uint8_t *))
-						- ((pkt->tcp->data_off & 0xf0) >> 2)
-						+ !!(pkt->tcp->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG)))
+			    pkt->seglen != pkt->m->pkt_len - ((uint8_t *)pkt_tcp(pkt) - rte_pktmbuf_mtod(pkt->m, uint8_t *))
+						- ((pkt_tcp(pkt)->data_off & 0xf0) >> 2)
+						+ !!(pkt_tcp(pkt)->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG)))
 				strcat(errors, " seglen");
 
 			/*
@@ -1734,22 +1970,21 @@ check_packets(const char *where)
 	const struct tfo *fo;
 	unsigned error = 0;
 
-	for (i = 0; i < config->hef_n; i++) {
-		if (hlist_empty(&worker.hef[i]))
+	for (i = 0; i < config->ef_n; i++) {
+		ef = tfo_eflow_from_idx(&worker, i);
+		if (ef->state == TFO_STATE_NONE)
 			continue;
 
-		hlist_for_each_entry(ef, &worker.hef[i], hlist) {
-			if (ef->tfo_idx != TFO_IDX_UNUSED) {
-				fo = &worker.f[ef->tfo_idx];
-				error += check_side_packets(&fo->priv, true, ef);
-				error += check_side_packets(&fo->pub, false, ef);
-
-				if (error &&
-				    !(global_config_data.option_flags & TFO_CONFIG_FL_DUMP_ALL_EFLOWS)) {
-					dump_eflow(&worker, ef);
-					printf("check_packets (%s) -  %u packet(s) had an ERROR\n", where, error);
-					error = 0;
-				}
+		if (ef->fo) {
+			fo = ef->fo;
+			error += check_side_packets(&fo->priv, true, ef);
+			error += check_side_packets(&fo->pub, false, ef);
+
+			if (error &&
+			    !(global_config_data.option_flags & TFO_CONFIG_FL_DUMP_ALL_EFLOWS)) {
+				dump_eflow(&worker, ef);
+				printf("check_packets (%s) -  %u packet(s) had an ERROR\n", where, error);
+				error = 0;
 			}
 		}
 	}
@@ -1766,19 +2001,19 @@ static bool
 check_checksum(struct tfo_pkt *pkt, const char *msg)
 {
 	if (pkt->m->packet_type & RTE_PTYPE_L3_IPV4) {
-		if (rte_ipv4_udptcp_cksum_verify(pkt->iph.ip4h, pkt->tcp)) {
+		if (rte_ipv4_udptcp_cksum_verify(pkt_ipv4(pkt), pkt_tcp(pkt))) {
 			printf("%s: ip checksum 0x%4.4x (%4.4x), tcp checksum 0x%4.4x (%4.4x), not GOOD ERROR\n", msg,
-			(unsigned)rte_be_to_cpu_16(pkt->iph.ip4h->hdr_checksum), (unsigned)rte_ipv4_cksum(pkt->iph.ip4h),
-			(unsigned)rte_be_to_cpu_16(pkt->tcp->cksum), (unsigned)rte_ipv4_udptcp_cksum(pkt->iph.ip4h, pkt->tcp));
+			(unsigned)rte_be_to_cpu_16(pkt_ipv4(pkt)->hdr_checksum), (unsigned)rte_ipv4_cksum(pkt_ipv4(pkt)),
+			(unsigned)rte_be_to_cpu_16(pkt_tcp(pkt)->cksum), (unsigned)rte_ipv4_udptcp_cksum(pkt_ipv4(pkt), pkt_tcp(pkt)));
 
 			dump_m(pkt->m);
 
 			return false;
 		}
 	} else {
-		if (rte_ipv6_udptcp_cksum_verify(pkt->iph.ip6h, pkt->tcp)) {
+		if (rte_ipv6_udptcp_cksum_verify(pkt_ipv6(pkt), pkt_tcp(pkt))) {
 			printf("%s: tcp checksum 0x%4.4x (%4.4x), not GOOD ERROR\n", msg,
-			(unsigned)rte_be_to_cpu_16(pkt->tcp->cksum), (unsigned)rte_ipv6_udptcp_cksum(pkt->iph.ip6h, pkt->tcp));
+			(unsigned)rte_be_to_cpu_16(pkt_tcp(pkt)->cksum), (unsigned)rte_ipv6_udptcp_cksum(pkt_ipv6(pkt), pkt_tcp(pkt)));
 
 			dump_m(pkt->m);
 
@@ -1792,7 +2027,7 @@ check_checksum(struct tfo_pkt *pkt, const char *msg)
 static bool
 check_checksum_in(struct rte_mbuf *m, const char *msg)
 {
-	struct tfo_pkt pkt = { .tcp = NULL };
+	struct tfo_pkt pkt = { .tcp_ofs = 0 };
 	uint16_t hdr_len = 0;
 	uint32_t off;
 	int16_t proto;
@@ -1807,28 +2042,28 @@ check_checksum_in(struct rte_mbuf *m, const char *msg)
 		hdr_len = sizeof (struct rte_ether_hdr) + sizeof (struct rte_vlan_hdr);
 		break;
 	}
-	pkt.iph.ip4h = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, hdr_len);
+	pkt.ip_ofs = hdr_len;
 	switch (m->packet_type & RTE_PTYPE_L3_MASK) {
 	case RTE_PTYPE_L3_IPV4:
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + sizeof(struct rte_ipv4_hdr));
+		pkt.tcp_ofs = hdr_len + sizeof(struct rte_ipv4_hdr);
 		break;
 	case RTE_PTYPE_L3_IPV4_EXT:
 	case RTE_PTYPE_L3_IPV4_EXT_UNKNOWN:
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + rte_ipv4_hdr_len(pkt.iph.ip4h));
+		pkt.tcp_ofs = hdr_len + rte_ipv4_hdr_len(pkt_ipv4(&pkt));
 		break;
 	case RTE_PTYPE_L3_IPV6:
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + sizeof(struct rte_ipv6_hdr));
+		pkt.tcp_ofs = hdr_len + sizeof(struct rte_ipv6_hdr);
 		break;
 	case RTE_PTYPE_L3_IPV6_EXT:
 	case RTE_PTYPE_L3_IPV6_EXT_UNKNOWN:
 		off = hdr_len;
-		proto = rte_net_skip_ip6_ext(pkt.iph.ip6h->proto, m, &off, &frag);
+		proto = rte_net_skip_ip6_ext(pkt_ipv6(&pkt)->proto, m, &off, &frag);
 		if (unlikely(proto < 0))
 			return false;
 		if (proto != IPPROTO_TCP)
 			return false;
 
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + off);
+		pkt.tcp_ofs = hdr_len + off;
 		break;
 	}
 
@@ -1836,6 +2071,28 @@ check_checksum_in(struct rte_mbuf *m, const char *msg)
 }
 #endif
 
+/* With TX checksum offload, the NIC calculates the IPv4 header and TCP
+ * checksums. The TCP checksum is set to the pseudo header checksum, which
+ * rte_eth_tx_prepare() adjusts if the driver needs something else. An IPv6
+ * packet must not have extension headers. */
+static inline void
+set_tx_cksum_offload(struct rte_mbuf *m, union tfo_ip_p iph, struct rte_tcp_hdr *tcp, bool ipv6)
+{
+	m->l2_len = (uint8_t *)iph.ip4h - rte_pktmbuf_mtod(m, uint8_t *);
+	m->l3_len = (uint8_t *)tcp - (uint8_t *)iph.ip4h;
+	m->l4_len = (tcp->data_off & 0xf0) >> 2;
+
+	m->ol_flags &= ~(RTE_MBUF_F_TX_IPV4 | RTE_MBUF_F_TX_IPV6 | RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_L4_MASK);
+	if (ipv6) {
+		m->ol_flags |= RTE_MBUF_F_TX_IPV6 | RTE_MBUF_F_TX_TCP_CKSUM;
+		tcp->cksum = rte_ipv6_phdr_cksum(iph.ip6h, m->ol_flags);
+	} else {
+		m->ol_flags |= RTE_MBUF_F_TX_IPV4 | RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_TCP_CKSUM;
+		iph.ip4h->hdr_checksum = 0;
+		tcp->cksum = rte_ipv4_phdr_cksum(iph.ip4h, m->ol_flags);
+	}
+}
+
 static inline uint16_t
 update_checksum(uint16_t old_cksum, void *old_bytes, void *new_bytes, uint16_t len)
 {
@@ -1897,9 +2154,11 @@ remove_from_checksum(uint16_t old_cksum, void *old_bytes, uint16_t len)
 	return new_cksum ^ 0xffff;
 }
 
+static void tfo_send_burst_early(struct tfo_tx_bufs *);
+
 /* Change this so that we return m and it can be added to tx_bufs */
 static inline void
-add_tx_buf(const struct tcp_worker *w, struct rte_mbuf *m, struct tfo_tx_bufs *tx_bufs, bool from_priv, union tfo_ip_p iph, bool discard_after_send)
+add_tx_buf(const struct tcp_worker *w, struct rte_mbuf *m, struct tfo_tx_bufs *tx_bufs, bool from_priv, union tfo_ip_p iph, bool discard)
 {
 #ifdef DEBUG_QUEUE_PKTS
 	printf("Adding packet m %p data_len %u pkt_len %u vlan %u\n", m, m->data_len, m->pkt_len, m->vlan_tci);
@@ -1910,22 +2169,18 @@ add_tx_buf(const struct tcp_worker *w, struct rte_mbuf *m, struct tfo_tx_bufs *t
 
 	/* Update TTL, timestamp and ack */
 
+	/* The packets are staged in the worker's tx_m, allocated by
+	 * tcp_worker_init(). If it is full, the packets already staged are sent
+	 * now rather than growing it. */
 	if (unlikely(!tx_bufs->m)) {
-		tx_bufs->max_tx = tx_bufs->nb_inc;
-		tx_bufs->m = rte_malloc("tx_bufs", tx_bufs->max_tx * sizeof(struct rte_mbuf *), 0);
-		tx_bufs->acks = rte_malloc("tx_bufs_ack", (tx_bufs->max_tx - 1) / CHAR_BIT + 1, 0);
-	} else if (unlikely(tx_bufs->nb_tx == tx_bufs->max_tx)) {
-		tx_bufs->max_tx += tx_bufs->nb_inc;
-		tx_bufs->m = rte_realloc(tx_bufs->m, tx_bufs->max_tx * sizeof(struct rte_mbuf *), 0);
-		tx_bufs->acks = rte_realloc(tx_bufs->acks, (tx_bufs->max_tx - 1) / CHAR_BIT + 1, 0);
-	}
-
-	tx_bufs->m[tx_bufs->nb_tx] = m;
-	if (discard_after_send)
-		set_ack_bit(tx_bufs, tx_bufs->nb_tx);
-	else
-		clear_ack_bit(tx_bufs, tx_bufs->nb_tx);
-	tx_bufs->nb_tx++;
+		tx_bufs->m = w->tx_m;
+		tx_bufs->discard = w->tx_discard;
+		tx_bufs->max_tx = w->max_tx;
+	} else if (unlikely(tx_bufs->nb_tx == tx_bufs->max_tx))
+		tfo_send_burst_early(tx_bufs);
+
+	tx_bufs->discard[tx_bufs->nb_tx] = discard;
+	tx_bufs->m[tx_bufs->nb_tx++] = m;
 
 	if (iph.ip4h && config->capture_output_packet)
 		config->capture_output_packet(w->param, m->packet_type & RTE_PTYPE_L3_IPV6 ? IPPROTO_IPV6 : IPPROTO_IP, m, &w->ts, from_priv, iph);
@@ -1974,9 +2229,56 @@ tfo_restart_keepalive_timer(struct tfo_side *fos)
 		tfo_cancel_xmit_timer(fos);
 }
 
+/* Buffer accounting for the flow and worker quotas. The bytes are the payload
+ * of the packets on a side's pktlist, wherever it is held, and the mbufs are
+ * the mbufs held by those packets, counting each segment of a coalesced
+ * packet. */
+static inline void
+buf_acct(struct tcp_worker *w, struct tfo_side *s, int32_t bytes, int32_t mbufs)
+{
+	s->buf_bytes += bytes;
+	s->buf_mbufs += mbufs;
+	w->buf_bytes += bytes;
+	w->buf_mbufs += mbufs;
+}
+
+static inline uint64_t
+quota_room(uint64_t quota, uint64_t used)
+{
+	return quota > used ? quota - used : 0;
+}
+
+/* How much more data can be buffered on side s within the quotas. The worker
+ * quotas are shared equally between the optimized flows, so that a few flows
+ * cannot use all of them, and an mbuf is allowed for each MSS of data. The
+ * result is limited to the largest window that can be advertised. */
+static uint32_t
+buf_room(const struct tcp_worker *w, const struct tfo_side *s)
+{
+	uint64_t room = (uint64_t)UINT16_MAX << TCP_MAX_WINSHIFT;
+	uint32_t mss = s->mss ? s->mss : TCP_MSS_DEFAULT;
+	uint32_t flows = w->f_use ? w->f_use : 1;
+
+	if (config->flow_buf_bytes)
+		room = RTE_MIN(room, quota_room(config->flow_buf_bytes, s->buf_bytes));
+	if (config->flow_buf_mbufs)
+		room = RTE_MIN(room, quota_room(config->flow_buf_mbufs, s->buf_mbufs) * mss);
+	if (config->worker_buf_bytes) {
+		room = RTE_MIN(room, quota_room(config->worker_buf_bytes / flows, s->buf_bytes));
+		room = RTE_MIN(room, quota_room(config->worker_buf_bytes, w->buf_bytes));
+	}
+	if (config->worker_buf_mbufs) {
+		room = RTE_MIN(room, quota_room(config->worker_buf_mbufs / flows, s->buf_mbufs) * mss);
+		room = RTE_MIN(room, quota_room(config->worker_buf_mbufs, w->buf_mbufs) * mss);
+	}
+
+	return room;
+}
+
 static inline bool
-set_rcv_win(struct tfo_side *fos, struct tfo_side *foos) {
+set_rcv_win(struct tcp_worker *w, struct tfo_side *fos, struct tfo_side *foos) {
 	uint32_t win_end;
+	uint32_t room;
 	uint16_t old_rcv_win = fos->rcv_win;
 
 #ifdef DEBUG_RCV_WIN
@@ -2013,6 +2315,16 @@ set_rcv_win(struct tfo_side *fos, struct tfo_side *foos) {
 	win_end = foos->snd_una + (foos->snd_win << foos->snd_win_shift);
 #endif
 
+	/* Data received on fos is buffered on foos. Since the window is not
+	 * explicitly reduced, this stops it advancing as foos nears a quota. */
+	if (buf_quotas) {
+		room = buf_room(w, foos);
+		if (after(win_end, fos->rcv_nxt + room)) {
+			win_end = fos->rcv_nxt + room;
+			++w->st.buf_win_limited;
+		}
+	}
+
 	if (after(win_end, fos->last_rcv_win_end))
 		fos->last_rcv_win_end = win_end;
 	if (after(fos->last_rcv_win_end, fos->rcv_nxt)) {
@@ -2055,8 +2367,18 @@ set_rcv_win(struct tfo_side *fos, struct tfo_side *foos) {
 	return false;
 }
 
+static inline void
+tfo_throttle_side(const struct tfo_side *fos)
+{
+	struct tfo *fo = fos->ef->fo;
+
+	if (!fo->throttled_sides)
+		list_add_tail(&fo->txq_throttled, &worker.txq.throttled);
+	fo->throttled_sides |= fos == &fo->priv ? TFO_THROTTLED_PRIV : TFO_THROTTLED_PUB;
+}
+
 static inline uint32_t
-get_snd_win_end(const struct tfo_side *fos)
+get_snd_win_end(struct tfo_side *fos)
 {
 	uint32_t len;
 
@@ -2064,6 +2386,15 @@ get_snd_win_end(const struct tfo_side *fos)
 	if (fos->cwnd < len)
 		len = fos->cwnd;
 
+	/* While the TX queue holds buffered packets, the NIC is not keeping up,
+	 * so no new data is sent until they have been sent. The side is
+	 * recorded so that txq_drain() can send its new data afterwards. */
+	if (unlikely(worker.txq.nb_pkts[TFO_TXQ_RESEND] || worker.txq.nb_pkts[TFO_TXQ_NEW]) &&
+	    before(fos->snd_nxt, fos->snd_una + len)) {
+		tfo_throttle_side(fos);
+		return fos->snd_nxt;
+	}
+
 	return fos->snd_una + len;
 }
 
@@ -2192,6 +2523,8 @@ update_packet_length(struct tfo_pkt *pkt, uint8_t *offs, int8_t len)
 {
 	uint8_t *pkt_start = rte_pktmbuf_mtod(pkt->m, uint8_t *);
 	uint8_t *pkt_end = pkt_start + pkt->m->data_len;
+	struct rte_tcp_hdr *tcp = pkt_tcp(pkt);
+	uint16_t offs_ofs = offs - (uint8_t *)tcp;
 	uint16_t before_len, after_len;
 	struct {
 		uint8_t data_off;
@@ -2207,13 +2540,15 @@ update_packet_length(struct tfo_pkt *pkt, uint8_t *offs, int8_t len)
 
 	if (len < 0) {
 		/* Remove the checksum for what is being removed */
-		pkt->tcp->cksum = remove_from_checksum(pkt->tcp->cksum, offs, -len);
+		tcp->cksum = remove_from_checksum(tcp->cksum, offs, -len);
 		after_len = pkt_end - (offs - len);
 	} else
 		after_len = pkt_end - offs;
 	before_len = offs - pkt_start;
 
-	if (before_len < after_len) {
+	/* If segments have been coalesced into the packet, the data continues
+	 * in the following mbufs, so only the headers can be moved. */
+	if (before_len < after_len || pkt->m->nb_segs > 1) {
 		/* The header is shorter than the data */
 		if (len > 0) {
 			uint8_t *new_start = (uint8_t *)rte_pktmbuf_prepend(pkt->m, len);
@@ -2230,14 +2565,9 @@ update_packet_length(struct tfo_pkt *pkt, uint8_t *offs, int8_t len)
 			rte_pktmbuf_adj(pkt->m, -len);
 		}
 
-		pkt_start -= len;
-		/* The following works for IPv6 too */
-		pkt->iph.ip4h = (struct rte_ipv4_hdr *)((uint8_t *)pkt->iph.ip4h - len);
-		pkt->tcp = (struct rte_tcp_hdr*)((uint8_t *)pkt->tcp - len);
-		if (pkt->ts && (uint8_t *)pkt->ts < offs)
-			pkt->ts = (struct tcp_timestamp_option *)((uint8_t *)pkt->ts - len);
-		if (pkt->sack && (uint8_t *)pkt->sack < offs)
-			pkt->sack = (struct tcp_sack_option *)((uint8_t *)pkt->sack - len);
+		/* The headers have moved with the start of the data, so ip_ofs
+		 * and tcp_ofs are unchanged */
+		tcp = pkt_tcp(pkt);
 	} else {
 		if (len > 0) {
 			if (!rte_pktmbuf_append(pkt->m, len)) {
@@ -2254,28 +2584,38 @@ update_packet_length(struct tfo_pkt *pkt, uint8_t *offs, int8_t len)
 		}
 	}
 
+	/* Options after the change have moved relative to the TCP header */
+	if (pkt->ts_ofs >= offs_ofs)
+		pkt->ts_ofs += len;
+	if (pkt->sack_ofs >= offs_ofs)
+		pkt->sack_ofs += len;
+
 	/* Update tcp header length */
-	new_hdr.tcp_flags = pkt->tcp->tcp_flags;
-	new_hdr.data_off = (((pkt->tcp->data_off >> 4) + len / 4) << 4) | (pkt->tcp->data_off & 0x0f);
-	pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, &pkt->tcp->data_off, &new_hdr, sizeof(new_hdr));
+	new_hdr.tcp_flags = tcp->tcp_flags;
+	new_hdr.data_off = (((tcp->data_off >> 4) + len / 4) << 4) | (tcp->data_off & 0x0f);
+	tcp->cksum = update_checksum(tcp->cksum, &tcp->data_off, &new_hdr, sizeof(new_hdr));
 
 	if (pkt->m->packet_type & RTE_PTYPE_L3_IPV4) {
+		struct rte_ipv4_hdr *ip4h = pkt_ipv4(pkt);
+
 		/* Update the TCP checksum for the length change in the TCP pseudo header */
-		ph_old_len_v4 = rte_cpu_to_be_16(pkt->m->pkt_len - ((uint8_t *)pkt->tcp - pkt_start));
-		new_len_v4 = rte_cpu_to_be_16(pkt->m->pkt_len - ((uint8_t *)pkt->tcp - pkt_start) + len);
-		pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, &ph_old_len_v4, &new_len_v4, sizeof(new_len_v4));
+		ph_old_len_v4 = rte_cpu_to_be_16(pkt->m->pkt_len - pkt->tcp_ofs);
+		new_len_v4 = rte_cpu_to_be_16(pkt->m->pkt_len - pkt->tcp_ofs + len);
+		tcp->cksum = update_checksum(tcp->cksum, &ph_old_len_v4, &new_len_v4, sizeof(new_len_v4));
 
 		/* Update IP packet length */
-		new_len_v4 = rte_cpu_to_be_16(rte_be_to_cpu_16(pkt->iph.ip4h->total_length) + len);
-		pkt->iph.ip4h->hdr_checksum = update_checksum(pkt->iph.ip4h->hdr_checksum, &pkt->iph.ip4h->total_length, &new_len_v4, sizeof(new_len_v4));
+		new_len_v4 = rte_cpu_to_be_16(rte_be_to_cpu_16(ip4h->total_length) + len);
+		ip4h->hdr_checksum = update_checksum(ip4h->hdr_checksum, &ip4h->total_length, &new_len_v4, sizeof(new_len_v4));
 	} else {
+		struct rte_ipv6_hdr *ip6h = pkt_ipv6(pkt);
+
 		/* Update the TCP checksum for the length change in the TCP pseudo header */
-		ph_old_len_v6 = rte_cpu_to_be_32(pkt->m->pkt_len - ((uint8_t *)pkt->tcp - pkt_start));
-		new_len_v6 = rte_cpu_to_be_32(pkt->m->pkt_len - ((uint8_t *)pkt->tcp - pkt_start) + len);
-		pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, &ph_old_len_v6, &new_len_v6, sizeof(new_len_v6));
+		ph_old_len_v6 = rte_cpu_to_be_32(pkt->m->pkt_len - pkt->tcp_ofs);
+		new_len_v6 = rte_cpu_to_be_32(pkt->m->pkt_len - pkt->tcp_ofs + len);
+		tcp->cksum = update_checksum(tcp->cksum, &ph_old_len_v6, &new_len_v6, sizeof(new_len_v6));
 
 		/* Update IP packet length */
-		pkt->iph.ip6h->payload_len = rte_cpu_to_be_16(rte_be_to_cpu_16(pkt->iph.ip6h->payload_len) + len);
+		ip6h->payload_len = rte_cpu_to_be_16(rte_be_to_cpu_16(ip6h->payload_len) + len);
 	}
 
 	return true;
@@ -2288,12 +2628,12 @@ check_addr(struct tfo_pkt *pkt, const char *msg)
 	if (!pkt->m->packet_type & RTE_PTYPE_L3_IPV4)
 		return;
 
-	if ((pkt->iph.ip4h->src_addr != rte_cpu_to_be_32(0x0a000003) &&
-	     pkt->iph.ip4h->src_addr != rte_cpu_to_be_32(0xc0a80002)) ||
-	    (pkt->iph.ip4h->dst_addr != rte_cpu_to_be_32(0x0a000003) &&
-	     pkt->iph.ip4h->dst_addr != rte_cpu_to_be_32(0xc0a80002))) {
-		printf("%s: WRONG src/dst 0x%x/0x%x\n", msg, rte_be_to_cpu_32(pkt->ipv4->src_addr), rte_be_to_cpu_32(pkt->ipv4->dst_addr));
-		printf("Orig packet m %p eh %p ipv4 %p tcp %p ts %p sack %p\n", pkt->m, rte_pktmbuf_mtod(pkt->m, char *), pkt->ipv4, pkt->tcp, pkt->ts, pkt->sack);
+	if ((pkt_ipv4(pkt)->src_addr != rte_cpu_to_be_32(0x0a000003) &&
+	     pkt_ipv4(pkt)->src_addr != rte_cpu_to_be_32(0xc0a80002)) ||
+	    (pkt_ipv4(pkt)->dst_addr != rte_cpu_to_be_32(0x0a000003) &&
+	     pkt_ipv4(pkt)->dst_addr != rte_cpu_to_be_32(0xc0a80002))) {
+		printf("%s: WRONG src/dst 0x%x/0x%x\n", msg, rte_be_to_cpu_32(pkt_ipv4(pkt)->src_addr), rte_be_to_cpu_32(pkt_ipv4(pkt)->dst_addr));
+		printf("Orig packet m %p eh %p ipv4 %p tcp %p ts %p sack %p\n", pkt->m, rte_pktmbuf_mtod(pkt->m, char *), pkt_ipv4(pkt), pkt_tcp(pkt), pkt_ts(pkt), pkt_sack(pkt));
 		dump_m(pkt->m);
 
 		/* Produce a core dump */
@@ -2331,53 +2671,53 @@ update_sack_option(struct tfo_pkt *pkt, struct tfo_side *fos)
 #ifdef DEBUG_CHECK_ADDR
 	check_addr(pkt, "uso start");
 #endif
-	tcp_end = (uint8_t *)pkt->tcp + ((pkt->tcp->data_off & 0xf0) >> 2);
+	tcp_end = (uint8_t *)pkt_tcp(pkt) + ((pkt_tcp(pkt)->data_off & 0xf0) >> 2);
 
 	/* If there is a sack option, there must be at least 12 bytes used */
-	if (pkt->sack) {
+	if (pkt_sack(pkt)) {
 		/* It should be (cur_sack->opt_len - 2) / sizeof(struct sack_edges)
 		 * but integer arithmetic gives the same result */
-		cur_sack_blocks = pkt->sack->opt_len / sizeof(struct sack_edges);
+		cur_sack_blocks = pkt_sack(pkt)->opt_len / sizeof(struct sack_edges);
 	} else
 		cur_sack_blocks = 0;
 
 #ifdef DEBUG_CHECK_ADDR
 	printf("uso: eh %p ipv4 %p tcp %p ts %p sack %p tcp_end %p fos->sack_entries %u, cur_sack_blocks %u, sack_blocks %d\n",
-		rte_pktmbuf_mtod(pkt->m, uint8_t *), pkt->ipv4, pkt->tcp, pkt->ts, pkt->sack, tcp_end, fos->sack_entries,
-		cur_sack_blocks, min(fos->sack_entries, 4 - !!(pkt->ts)));
+		rte_pktmbuf_mtod(pkt->m, uint8_t *), pkt_ipv4(pkt), pkt_tcp(pkt), pkt_ts(pkt), pkt_sack(pkt), tcp_end, fos->sack_entries,
+		cur_sack_blocks, min(fos->sack_entries, 4 - !!(pkt_ts(pkt))));
 #endif
 
 	if (!fos->sack_entries && !cur_sack_blocks)
 		return true;
 
-	sack_blocks = min(fos->sack_entries, 4 - !!(pkt->ts));
+	sack_blocks = min(fos->sack_entries, 4 - !!(pkt_ts(pkt)));
 
 	/* XXX The sack option can be repeatedly inserted and removed. We need to ensure that we don't keep
 	 * moving the packet earlier and earlier, or later and later until there is no room. */
 	if (sack_blocks > cur_sack_blocks) {
 		insert_len = (sack_blocks - cur_sack_blocks) * sizeof(struct sack_edges) + (cur_sack_blocks ? 0 : 4);
-		if (!update_packet_length(pkt, cur_sack_blocks ? ((uint8_t *)pkt->sack + sizeof(struct tcp_sack_option) + cur_sack_blocks * sizeof(struct sack_edges)) : tcp_end, insert_len))
+		if (!update_packet_length(pkt, cur_sack_blocks ? ((uint8_t *)pkt_sack(pkt) + sizeof(struct tcp_sack_option) + cur_sack_blocks * sizeof(struct sack_edges)) : tcp_end, insert_len))
 			return false;
 	} else if (sack_blocks < cur_sack_blocks) {
 		insert_len = (sack_blocks - cur_sack_blocks) * sizeof(struct sack_edges) - (sack_blocks ? 0 : 4);
-		if (!update_packet_length(pkt, sack_blocks ? ((uint8_t *)pkt->sack + sizeof(struct tcp_sack_option) + sack_blocks * sizeof(struct sack_edges)) : ((uint8_t *)pkt->sack - 2), insert_len))
+		if (!update_packet_length(pkt, sack_blocks ? ((uint8_t *)pkt_sack(pkt) + sizeof(struct tcp_sack_option) + sack_blocks * sizeof(struct sack_edges)) : ((uint8_t *)pkt_sack(pkt) - 2), insert_len))
 			return false;
 	} else
 		insert_len = 0;
 
 	if (!sack_blocks) {
-		pkt->sack = NULL;
+		pkt->sack_ofs = 0;
 
 #ifdef DEBUG_CHECK_ADDR
-		printf("End uso no new sack: eh %p ipv4 %p tcp %p ts %p sack %p\n", rte_pktmbuf_mtod(pkt->m, uint8_t *), pkt->ipv4, pkt->tcp, pkt->ts, pkt->sack);
+		printf("End uso no new sack: eh %p ipv4 %p tcp %p ts %p sack %p\n", rte_pktmbuf_mtod(pkt->m, uint8_t *), pkt_ipv4(pkt), pkt_tcp(pkt), pkt_ts(pkt), pkt_sack(pkt));
 		check_addr(pkt, "uso end none");
 #endif
 
 		return true;
 	}
 
-	if (!pkt->sack)
-		pkt->sack = (struct tcp_sack_option *)((pkt->ts ? ((uint8_t *)pkt->ts + sizeof(struct tcp_timestamp_option)) : ((uint8_t *)pkt->tcp + sizeof(struct rte_tcp_hdr))) + 2);
+	if (!pkt->sack_ofs)
+		pkt->sack_ofs = (pkt->ts_ofs ? pkt->ts_ofs + sizeof(struct tcp_timestamp_option) : sizeof(struct rte_tcp_hdr)) + 2;
 
 	sack.sack_len = sizeof(struct tcp_sack_option) + sack_blocks * sizeof(struct sack_edges);
 
@@ -2387,10 +2727,10 @@ update_sack_option(struct tfo_pkt *pkt, struct tfo_side *fos)
 	}
 
 	/* Update the TCP checksum */
-	pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, (uint8_t *)pkt->sack - 2, &sack, sack.sack_len + 2);
+	pkt_tcp(pkt)->cksum = update_checksum(pkt_tcp(pkt)->cksum, (uint8_t *)pkt_sack(pkt) - 2, &sack, sack.sack_len + 2);
 
 #ifdef DEBUG_CHECK_ADDR
-	printf("End uso: eh %p ipv4 %p tcp %p ts %p sack %p\n", rte_pktmbuf_mtod(pkt->m, uint8_t *), pkt->ipv4, pkt->tcp, pkt->ts, pkt->sack);
+	printf("End uso: eh %p ipv4 %p tcp %p ts %p sack %p\n", rte_pktmbuf_mtod(pkt->m, uint8_t *), pkt_ipv4(pkt), pkt_tcp(pkt), pkt_ts(pkt), pkt_sack(pkt));
 	check_addr(pkt, "uso end with");	// Stalls just without this with gcc 11.3.1 and -O2 or -O3
 #endif
 
@@ -2401,80 +2741,296 @@ update_sack_option(struct tfo_pkt *pkt, struct tfo_side *fos)
 }
 _Pragma("GCC pop_options")
 
+static inline struct tfo_ack_tmpl *
+ack_tmpl(struct tcp_worker *w, struct tfo *fo, struct tfo_side *fos)
+{
+	return &w->ack_tmpl[fo->idx * 2 + (fos == &fo->pub)];
+}
+
+/* The addresses of ACKs sent to fos */
 static void
-_send_ack_pkt(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos, struct tfo_pkt *pkt, struct tfo_addr_info *addr,
-		uint16_t vlan_id, struct tfo_side *foos, uint32_t *dup_sack, struct tfo_tx_bufs *tx_bufs,
-		bool same_dirn, bool must_send, bool is_keepalive, bool send_rst)
+set_ack_addr(struct tfo_eflow *ef, struct tfo_side *fos, struct tfo_addr_info *addr)
 {
-	struct rte_ether_hdr *eh;
+	if (fos == &ef->fo->pub) {
+		if (ef->flags & TFO_EF_FL_IPV6) {
+			addr->src_addr.v6 = tfo_eflow_addr6(ef)->priv_addr;
+			addr->dst_addr.v6 = tfo_eflow_addr6(ef)->pub_addr;
+		} else {
+			addr->src_addr.v4.s_addr = rte_cpu_to_be_32(ef->priv_addr.s_addr);
+			addr->dst_addr.v4.s_addr = rte_cpu_to_be_32(ef->pub_addr.s_addr);
+		}
+		addr->src_port = rte_cpu_to_be_16(ef->priv_port);
+		addr->dst_port = rte_cpu_to_be_16(ef->pub_port);
+	} else {
+		if (ef->flags & TFO_EF_FL_IPV6) {
+			addr->src_addr.v6 = tfo_eflow_addr6(ef)->pub_addr;
+			addr->dst_addr.v6 = tfo_eflow_addr6(ef)->priv_addr;
+		} else {
+			addr->src_addr.v4.s_addr = rte_cpu_to_be_32(ef->pub_addr.s_addr);
+			addr->dst_addr.v4.s_addr = rte_cpu_to_be_32(ef->priv_addr.s_addr);
+		}
+		addr->src_port = rte_cpu_to_be_16(ef->pub_port);
+		addr->dst_port = rte_cpu_to_be_16(ef->priv_port);
+	}
+}
+
+static void
+build_ack_tmpl(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos)
+{
+	struct tfo_ack_tmpl *tmpl = ack_tmpl(w, ef->fo, fos);
+	struct tfo_addr_info addr;
+	struct rte_ether_hdr *eh = (struct rte_ether_hdr *)tmpl->hdr;
 	struct rte_vlan_hdr *vl;
 	union tfo_ip_p iph;
 	struct rte_tcp_hdr *tcp;
-	struct tcp_timestamp_option *ts_opt;
-	struct rte_mbuf *m;
-	uint8_t *ptr;
-	uint16_t pkt_len;
-	uint8_t sack_blocks;
-	bool do_dup_sack = (dup_sack && dup_sack[0] != dup_sack[1]);
 	bool is_ipv6 = !!(ef->flags & TFO_EF_FL_IPV6);
+	uint16_t tcp_len;
 
-/* CREATE AND KEEP COPY OF ACK FOR SENDING. */
-	if (unlikely(!ack_pool)) {
-		if (unlikely(!pkt)) {
-			/* This should never occur. We can't send an ACK
-			 * without receiving a packet first. */
-			return;
-		}
+	set_ack_addr(ef, fos, &addr);
 
-		ack_pool = pkt->m->pool;
-		ack_pool_priv_size = rte_pktmbuf_priv_size(ack_pool);
-	}
+	/* With TFO_CONFIG_FL_NO_VLAN_CHG _send_ack_pkt() doesn't set a vlan */
+	if (option_flags & TFO_CONFIG_FL_NO_VLAN_CHG)
+		tmpl->vlan_tci = 0;
+	else
+		tmpl->vlan_tci = fos == &ef->fo->pub ? pub_vlan_tci : priv_vlan_tci;
 
-	/* See Linux commit 5d9f4262b7ea for SACK compression. Delay appears
-	 * to be 0.625% of rtt, rather than the stated 5%. */
-	if (fos->delayed_ack_timeout == TFO_INFINITE_TS && !must_send && !do_dup_sack) {
-		if (!(ef->flags & TFO_EF_FL_SACK)) {
-#ifdef DO_QUICKACK
-			time_ns_t ato = TFO_ATO_MIN;	// see Linux net/ipv4/tcp_output.c
-							// This is from Linux, see pingpong mode
-							// icsk->icsk_ack.ato doubles for something
+	tcp_len = sizeof(struct rte_tcp_hdr) +
+		  (ef->flags & TFO_EF_FL_TIMESTAMP ? sizeof(struct tcp_timestamp_option) + 2 : 0);
 
-			if (ato > TFO_DELACK_MIN) {
-				time_ns_t max_ato = SECS_TO_NSECS / 2;
+	memset(tmpl->hdr, 0x00, sizeof(tmpl->hdr));
 
-				if (in_pingpong || ack_pending)
-					max_ato = TFO_DELACK_MAX;
+	rte_ether_addr_copy(&local_mac_addr, &eh->src_addr);
+	rte_ether_addr_copy(&remote_mac_addr, &eh->dst_addr);
 
-				rtt = max(fos->srtt_us / 8, TFO_DELACK_MIN);
-				if (rtt < max_ato)
-					max_ato = rtt;
+	if (tmpl->vlan_tci) {
+		eh->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN);
+		vl = (struct rte_vlan_hdr *)(eh + 1);
+		vl->vlan_tci = rte_cpu_to_be_16(tmpl->vlan_tci);
+		vl->eth_proto = rte_cpu_to_be_16(is_ipv6 ? RTE_ETHER_TYPE_IPV6 : RTE_ETHER_TYPE_IPV4);
+		iph.ip4h = (struct rte_ipv4_hdr *)(vl + 1);
+	} else {
+		eh->ether_type = rte_cpu_to_be_16(is_ipv6 ? RTE_ETHER_TYPE_IPV6 : RTE_ETHER_TYPE_IPV4);
+		iph.ip4h = (struct rte_ipv4_hdr *)(eh + 1);
+	}
 
-				ato = min(ato, max_ato);
-			}
-			ato = min(ato, socket_delack_max);
-#endif
+	/* The TTL/hop limit is patched in for each ACK */
+	if (!is_ipv6) {
+		iph.ip4h->version_ihl = 0x45;
+		iph.ip4h->type_of_service = 0x10;
+		iph.ip4h->total_length = rte_cpu_to_be_16(sizeof(struct rte_ipv4_hdr) + tcp_len);
+		iph.ip4h->packet_id = 0x3412;
+		iph.ip4h->fragment_offset = rte_cpu_to_be_16(RTE_IPV4_HDR_DF_FLAG);
+		iph.ip4h->next_proto_id = IPPROTO_TCP;
+		iph.ip4h->src_addr = addr.src_addr.v4.s_addr;
+		iph.ip4h->dst_addr = addr.dst_addr.v4.s_addr;
+		iph.ip4h->hdr_checksum = rte_ipv4_cksum(iph.ip4h);
 
-			fos->delayed_ack_timeout = now + NSEC_PER_SEC / 25;
-			update_timer(ef, fos->delayed_ack_timeout);
-		} else if (fos->tlp_max_ack_delay_us > fos->srtt_us) {
-			/* We want to ensure the other end received the ACK before it
-			 * times out and retransmits, so reduce the ack delay by
-			 * 2 * (srtt / 2). srtt / 2 is best estimate of time for ack
-			 * to reach the other end, and allow 2 of those intervals to
-			 * be conservative. */
-			fos->delayed_ack_timeout = now + (fos->tlp_max_ack_delay_us - fos->srtt_us) * NSEC_PER_USEC;
-			update_timer(ef, fos->delayed_ack_timeout);
-		}
+		tcp = (struct rte_tcp_hdr *)(iph.ip4h + 1);
+	} else {
+		iph.ip6h->vtc_flow = fos->vtc_flow;
+		iph.ip6h->payload_len = rte_cpu_to_be_16(tcp_len);
+		iph.ip6h->proto = IPPROTO_TCP;
+		memcpy(iph.ip6h->src_addr, &addr.src_addr.v6, sizeof(iph.ip6h->src_addr));
+		memcpy(iph.ip6h->dst_addr, &addr.dst_addr.v6, sizeof(iph.ip6h->dst_addr));
 
-		if (fos->delayed_ack_timeout != TFO_INFINITE_TS) {
-#ifdef DEBUG_DELAYED_ACK
-			printf("Delaying ack for %lu us, same_dirn %d\n", (fos->delayed_ack_timeout - now ) / NSEC_PER_USEC, same_dirn);
-#endif
-			return;
-		}
+		tcp = (struct rte_tcp_hdr *)(iph.ip6h + 1);
 	}
-#ifdef DEBUG_DELAYED_ACK
-	printf("Not delaying ack_delay ");
+
+	tcp->src_port = addr.src_port;
+	tcp->dst_port = addr.dst_port;
+	tcp->data_off = (tcp_len / 4) << 4;
+	tcp->tcp_flags = RTE_TCP_ACK_FLAG;
+	if (ef->flags & TFO_EF_FL_TIMESTAMP)
+		*(uint32_t *)(tcp + 1) = rte_cpu_to_be_32(TCPOPT_TSTAMP_HDR);
+
+	if (is_ipv6)
+		tcp->cksum = rte_ipv6_udptcp_cksum(iph.ip6h, tcp);
+	else
+		tcp->cksum = rte_ipv4_udptcp_cksum(iph.ip4h, tcp);
+
+	tmpl->ip_ofs = (uint8_t *)iph.ip4h - tmpl->hdr;
+	tmpl->tcp_ofs = (uint8_t *)tcp - tmpl->hdr;
+	tmpl->hdr_len = tmpl->tcp_ofs + tcp_len;
+}
+
+/* Fill in an ACK, already prepended to m, from the side's template. Returns
+ * where the SACK option, if any, starts. */
+static uint8_t *
+ack_from_tmpl(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos, struct tfo_side *foos,
+		const struct tfo_ack_tmpl *tmpl, struct rte_mbuf *m, uint8_t sack_blocks, uint32_t *dup_sack,
+		bool is_keepalive, bool send_rst)
+{
+	uint8_t *eh = rte_pktmbuf_mtod(m, uint8_t *);
+	union tfo_ip_p iph = { .ip4h = (struct rte_ipv4_hdr *)(eh + tmpl->ip_ofs) };
+	struct rte_tcp_hdr *tcp = (struct rte_tcp_hdr *)(eh + tmpl->tcp_ofs);
+	struct tcp_timestamp_option *ts_opt;
+	uint8_t *ptr = eh + tmpl->hdr_len;
+	uint16_t sack_len;
+	struct {
+		uint32_t sent_seq;
+		uint32_t recv_ack;
+		uint8_t data_off;
+		uint8_t tcp_flags;
+		uint16_t rx_win;
+	} __rte_packed new_hdr;
+	struct {
+		uint32_t ts_val;
+		uint32_t ts_ecr;
+	} __rte_packed new_ts;
+	struct {
+		uint8_t ttl;
+		uint8_t proto;
+	} new_ttl;
+	uint8_t no_sack[2 + sizeof(struct tcp_sack_option) + MAX_SACK_ENTRIES * sizeof(struct sack_edges)];
+	uint16_t new_len_v4;
+	uint16_t ph_old_len_v4;
+	uint32_t new_len_v6;
+	uint32_t ph_old_len_v6;
+	uint16_t cksum;
+
+	rte_memcpy(eh, tmpl->hdr, tmpl->hdr_len);
+
+	sack_len = m->pkt_len - tmpl->hdr_len;
+
+	new_hdr.sent_seq = rte_cpu_to_be_32(fos->snd_nxt - !!is_keepalive);
+	new_hdr.recv_ack = rte_cpu_to_be_32(fos->rcv_nxt);
+	new_hdr.data_off = tcp->data_off + ((sack_len / 4) << 4);
+	new_hdr.tcp_flags = unlikely(send_rst) ? RTE_TCP_RST_FLAG | RTE_TCP_ACK_FLAG : RTE_TCP_ACK_FLAG;
+	set_rcv_win(w, fos, foos);
+	new_hdr.rx_win = rte_cpu_to_be_16(fos->rcv_win);
+	cksum = update_checksum(tcp->cksum, &tcp->sent_seq, &new_hdr, sizeof(new_hdr));
+
+	if (ef->flags & TFO_EF_FL_TIMESTAMP) {
+		ts_opt = (struct tcp_timestamp_option *)((uint8_t *)(tcp + 1) + 2);
+#ifdef CALC_TS_CLOCK
+		new_ts.ts_val = calc_ts_val(fos, foos);
+#else
+		new_ts.ts_val = rte_cpu_to_be_32(foos->latest_ts_val);
+#endif
+		new_ts.ts_ecr = fos->ts_recent;
+		cksum = update_checksum(cksum, &ts_opt->ts_val, &new_ts, sizeof(new_ts));
+
+		/* For ts_recent updates */
+		fos->last_ack_sent = fos->rcv_nxt;
+	}
+
+	if (sack_blocks) {
+		/* The template's checksum is without the SACK option and its length */
+		add_sack_option(fos, ptr, sack_blocks, dup_sack);
+		memset(no_sack, 0x00, sack_len);
+		cksum = update_checksum(cksum, no_sack, ptr, sack_len);
+		if (!(ef->flags & TFO_EF_FL_IPV6)) {
+			ph_old_len_v4 = rte_cpu_to_be_16(tmpl->hdr_len - tmpl->tcp_ofs);
+			new_len_v4 = rte_cpu_to_be_16(m->pkt_len - tmpl->tcp_ofs);
+			cksum = update_checksum(cksum, &ph_old_len_v4, &new_len_v4, sizeof(new_len_v4));
+		} else {
+			ph_old_len_v6 = rte_cpu_to_be_32(tmpl->hdr_len - tmpl->tcp_ofs);
+			new_len_v6 = rte_cpu_to_be_32(m->pkt_len - tmpl->tcp_ofs);
+			cksum = update_checksum(cksum, &ph_old_len_v6, &new_len_v6, sizeof(new_len_v6));
+		}
+	}
+	tcp->cksum = cksum;
+
+	if (!(ef->flags & TFO_EF_FL_IPV6)) {
+		new_ttl.ttl = foos->rcv_ttl;
+		new_ttl.proto = IPPROTO_TCP;
+		iph.ip4h->hdr_checksum = update_checksum(iph.ip4h->hdr_checksum, &iph.ip4h->time_to_live, &new_ttl, sizeof(new_ttl));
+		if (sack_blocks) {
+			new_len_v4 = rte_cpu_to_be_16(m->pkt_len - tmpl->ip_ofs);
+			iph.ip4h->hdr_checksum = update_checksum(iph.ip4h->hdr_checksum, &iph.ip4h->total_length, &new_len_v4, sizeof(new_len_v4));
+		}
+	} else {
+		iph.ip6h->hop_limits = foos->rcv_ttl;
+		iph.ip6h->payload_len = rte_cpu_to_be_16(m->pkt_len - tmpl->tcp_ofs);
+	}
+
+	if (option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD)
+		set_tx_cksum_offload(m, iph, tcp, ef->flags & TFO_EF_FL_IPV6);
+
+	return ptr;
+}
+
+static void
+_send_ack_pkt(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos, struct tfo_pkt *pkt, struct tfo_addr_info *addr,
+		uint16_t vlan_id, struct tfo_side *foos, uint32_t *dup_sack, struct tfo_tx_bufs *tx_bufs,
+		bool same_dirn, bool must_send, bool is_keepalive, bool send_rst)
+{
+	struct rte_ether_hdr *eh;
+	struct rte_vlan_hdr *vl;
+	union tfo_ip_p iph;
+	struct rte_tcp_hdr *tcp;
+	struct tcp_timestamp_option *ts_opt;
+	struct rte_mbuf *m;
+	struct tfo_ack_tmpl *tmpl;
+	uint8_t *ptr;
+	uint16_t pkt_len;
+	uint8_t sack_blocks;
+	bool do_dup_sack = (dup_sack && dup_sack[0] != dup_sack[1]);
+	bool is_ipv6 = !!(ef->flags & TFO_EF_FL_IPV6);
+
+/* CREATE AND KEEP COPY OF ACK FOR SENDING. */
+	if (unlikely(!ack_pool)) {
+		if (unlikely(!pkt)) {
+			/* This should never occur. We can't send an ACK
+			 * without receiving a packet first. */
+			return;
+		}
+
+		ack_pool = pkt->m->pool;
+		ack_pool_priv_size = rte_pktmbuf_priv_size(ack_pool);
+	}
+
+	/* The ACK at the end of the burst will cover this one */
+	if ((fos->flags & TFO_SIDE_FL_ACK_PENDING) && !do_dup_sack && !is_keepalive && !send_rst) {
+		++w->st.acks_coalesced;
+		return;
+	}
+
+	/* See Linux commit 5d9f4262b7ea for SACK compression. Delay appears
+	 * to be 0.625% of rtt, rather than the stated 5%. */
+	if (fos->delayed_ack_timeout == TFO_INFINITE_TS && !must_send && !do_dup_sack) {
+		if (!(ef->flags & TFO_EF_FL_SACK)) {
+#ifdef DO_QUICKACK
+			time_ns_t ato = TFO_ATO_MIN;	// see Linux net/ipv4/tcp_output.c
+							// This is from Linux, see pingpong mode
+							// icsk->icsk_ack.ato doubles for something
+
+			if (ato > TFO_DELACK_MIN) {
+				time_ns_t max_ato = SECS_TO_NSECS / 2;
+
+				if (in_pingpong || ack_pending)
+					max_ato = TFO_DELACK_MAX;
+
+				rtt = max(fos->srtt_us / 8, TFO_DELACK_MIN);
+				if (rtt < max_ato)
+					max_ato = rtt;
+
+				ato = min(ato, max_ato);
+			}
+			ato = min(ato, socket_delack_max);
+#endif
+
+			fos->delayed_ack_timeout = now + NSEC_PER_SEC / 25;
+			update_timer(ef, fos->delayed_ack_timeout);
+		} else if (fos->tlp_max_ack_delay_us > fos->srtt_us) {
+			/* We want to ensure the other end received the ACK before it
+			 * times out and retransmits, so reduce the ack delay by
+			 * 2 * (srtt / 2). srtt / 2 is best estimate of time for ack
+			 * to reach the other end, and allow 2 of those intervals to
+			 * be conservative. */
+			fos->delayed_ack_timeout = now + (fos->tlp_max_ack_delay_us - fos->srtt_us) * NSEC_PER_USEC;
+			update_timer(ef, fos->delayed_ack_timeout);
+		}
+
+		if (fos->delayed_ack_timeout != TFO_INFINITE_TS) {
+#ifdef DEBUG_DELAYED_ACK
+			printf("Delaying ack for %lu us, same_dirn %d\n", (fos->delayed_ack_timeout - now ) / NSEC_PER_USEC, same_dirn);
+#endif
+			return;
+		}
+	}
+#ifdef DEBUG_DELAYED_ACK
+	printf("Not delaying ack_delay ");
 	if (fos->delayed_ack_timeout == TFO_INFINITE_TS)
 		printf("unset");
 	else if (fos->delayed_ack_timeout == TFO_ACK_NOW_TS)
@@ -2488,6 +3044,18 @@ _send_ack_pkt(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos,
 	fos->delayed_ack_timeout = TFO_INFINITE_TS;
 	update_timer_ef(ef);
 
+	if (w->defer_acks && !do_dup_sack && !is_keepalive && !send_rst &&
+	    w->nb_ack_pending < TFO_ACK_PENDING_SIZE) {
+		w->ack_pending[w->nb_ack_pending].ef = ef;
+		w->ack_pending[w->nb_ack_pending].fos = fos;
+		w->ack_pending[w->nb_ack_pending++].vlan_id = vlan_id;
+		fos->flags |= TFO_SIDE_FL_ACK_PENDING;
+		return;
+	}
+
+	/* Any pending ACK is superseded by this one */
+	fos->flags &= ~TFO_SIDE_FL_ACK_PENDING;
+
 	m = rte_pktmbuf_alloc(ack_pool);
 
 // Handle not forwarding ACK somehow
@@ -2529,6 +3097,23 @@ _send_ack_pkt(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos,
 		printf("Sending D-SACK 0x%x -> 0x%x\n", dup_sack[0], dup_sack[1]);
 #endif
 
+	/* Optimized flows have a prebuilt header */
+	tmpl = ack_tmpl(w, ef->fo, fos);
+	if (likely(tmpl->hdr_len && tmpl->vlan_tci == m->vlan_tci)) {
+		rte_pktmbuf_prepend(m, tmpl->hdr_len +
+			(sack_blocks ? (sizeof(struct tcp_sack_option) + 2 + sizeof(struct sack_edges) * sack_blocks) : 0));
+
+		if (unlikely(addr))
+			m->port = port_id;
+		else
+			m->port = pkt->m->port;
+
+		ptr = ack_from_tmpl(w, ef, fos, foos, tmpl, m, sack_blocks, dup_sack, is_keepalive, send_rst);
+		iph.ip4h = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, tmpl->ip_ofs);
+
+		goto ack_built;
+	}
+
 	pkt_len = sizeof (struct rte_ether_hdr) +
 		   (m->vlan_tci ? sizeof(struct rte_vlan_hdr) : 0) +
 		   (is_ipv6 ? sizeof(struct rte_ipv6_hdr) : sizeof (struct rte_ipv4_hdr)) +
@@ -2575,14 +3160,14 @@ iph.ip4h->packet_id = 0x3412;
 			iph.ip4h->src_addr = addr->src_addr.v4.s_addr;
 			iph.ip4h->dst_addr = addr->dst_addr.v4.s_addr;
 		} else if (likely(!same_dirn)) {
-			iph.ip4h->src_addr = pkt->iph.ip4h->dst_addr;
-			iph.ip4h->dst_addr = pkt->iph.ip4h->src_addr;
+			iph.ip4h->src_addr = pkt_ipv4(pkt)->dst_addr;
+			iph.ip4h->dst_addr = pkt_ipv4(pkt)->src_addr;
 		} else {
-			iph.ip4h->src_addr = pkt->iph.ip4h->src_addr;
-			iph.ip4h->dst_addr = pkt->iph.ip4h->dst_addr;
+			iph.ip4h->src_addr = pkt_ipv4(pkt)->src_addr;
+			iph.ip4h->dst_addr = pkt_ipv4(pkt)->dst_addr;
 		}
-// Checksum offload?
-		iph.ip4h->hdr_checksum = rte_ipv4_cksum(iph.ip4h);
+		if (!(option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD))
+			iph.ip4h->hdr_checksum = rte_ipv4_cksum(iph.ip4h);
 // Should we copy IPv4 options ?
 
 		tcp = (struct rte_tcp_hdr *)(iph.ip4h + 1);
@@ -2598,11 +3183,11 @@ iph.ip4h->packet_id = 0x3412;
 			memcpy(iph.ip6h->src_addr, &addr->src_addr.v6, sizeof(iph.ip6h->src_addr));
 			memcpy(iph.ip6h->dst_addr, &addr->dst_addr.v6, sizeof(iph.ip6h->dst_addr));
 		} else if (likely(!same_dirn)) {
-			memcpy(iph.ip6h->src_addr, pkt->iph.ip6h->dst_addr, sizeof(iph.ip6h->src_addr));
-			memcpy(iph.ip6h->dst_addr, pkt->iph.ip6h->src_addr, sizeof(iph.ip6h->dst_addr));
+			memcpy(iph.ip6h->src_addr, pkt_ipv6(pkt)->dst_addr, sizeof(iph.ip6h->src_addr));
+			memcpy(iph.ip6h->dst_addr, pkt_ipv6(pkt)->src_addr, sizeof(iph.ip6h->dst_addr));
 		} else {
-			memcpy(iph.ip6h->src_addr, pkt->iph.ip6h->src_addr, sizeof(iph.ip6h->src_addr));
-			memcpy(iph.ip6h->dst_addr, pkt->iph.ip6h->dst_addr, sizeof(iph.ip6h->dst_addr));
+			memcpy(iph.ip6h->src_addr, pkt_ipv6(pkt)->src_addr, sizeof(iph.ip6h->src_addr));
+			memcpy(iph.ip6h->dst_addr, pkt_ipv6(pkt)->dst_addr, sizeof(iph.ip6h->dst_addr));
 		}
 
 		tcp = (struct rte_tcp_hdr *)(iph.ip6h + 1);
@@ -2612,11 +3197,11 @@ iph.ip4h->packet_id = 0x3412;
 		tcp->src_port = addr->src_port;
 		tcp->dst_port = addr->dst_port;
 	} else if (likely(!same_dirn)) {
-		tcp->src_port = pkt->tcp->dst_port;
-		tcp->dst_port = pkt->tcp->src_port;
+		tcp->src_port = pkt_tcp(pkt)->dst_port;
+		tcp->dst_port = pkt_tcp(pkt)->src_port;
 	} else {
-		tcp->src_port = pkt->tcp->src_port;
-		tcp->dst_port = pkt->tcp->dst_port;
+		tcp->src_port = pkt_tcp(pkt)->src_port;
+		tcp->dst_port = pkt_tcp(pkt)->dst_port;
 	}
 	tcp->sent_seq = rte_cpu_to_be_32(fos->snd_nxt - !!is_keepalive);
 	tcp->recv_ack = rte_cpu_to_be_32(fos->rcv_nxt);
@@ -2625,7 +3210,7 @@ iph.ip4h->packet_id = 0x3412;
 		tcp->tcp_flags = RTE_TCP_RST_FLAG | RTE_TCP_ACK_FLAG;
 	else
 		tcp->tcp_flags = RTE_TCP_ACK_FLAG;
-	set_rcv_win(fos, foos);
+	set_rcv_win(w, fos, foos);
 	tcp->rx_win = rte_cpu_to_be_16(fos->rcv_win);
 	tcp->cksum = 0;
 	tcp->tcp_urp = 0;
@@ -2655,12 +3240,14 @@ iph.ip4h->packet_id = 0x3412;
 		tcp->data_off += ((1 + 1 + sizeof(struct tcp_sack_option) + sack_blocks * sizeof(struct sack_edges)) / 4) << 4;
 	}
 
-// Checksum offload?
-	if (ef->flags & TFO_EF_FL_IPV6)
+	if (option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD)
+		set_tx_cksum_offload(m, iph, tcp, ef->flags & TFO_EF_FL_IPV6);
+	else if (ef->flags & TFO_EF_FL_IPV6)
 		tcp->cksum = rte_ipv6_udptcp_cksum(iph.ip6h, tcp);
 	else
 		tcp->cksum = rte_ipv4_udptcp_cksum(iph.ip4h, tcp);
 
+ack_built:
 #ifdef DEBUG_ACK
 	bool sack_err = false;
 
@@ -2714,7 +3301,7 @@ iph.ip4h->packet_id = 0x3412;
 	}
 #endif
 
-	add_tx_buf(w, m, tx_bufs, pkt ? !(pkt->flags & TFO_PKT_FL_FROM_PRIV) : foos == &w->f[ef->tfo_idx].pub, iph, true);
+	add_tx_buf(w, m, tx_bufs, pkt ? !(pkt->flags & TFO_PKT_FL_FROM_PRIV) : foos == &ef->fo->pub, iph, true);
 }
 
 static inline void
@@ -2724,8 +3311,7 @@ _send_ack_pkt_in(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fo
 	struct tfo_pkt pkt;
 
 	pkt.m = p->m;
-	pkt.iph = p->iph;
-	pkt.tcp = p->tcp;
+	pkt_set_hdrs(&pkt, p->iph, p->tcp, NULL, NULL);
 	pkt.flags = p->from_priv ? TFO_PKT_FL_FROM_PRIV : 0;
 
 	_send_ack_pkt(w, ef, fos, &pkt, NULL, vlan_id, foos, dup_sack, tx_bufs, same_dirn, true, false, false);
@@ -2736,29 +3322,9 @@ generate_ack_rst(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fo
 {
 // Change send_ack_pkt to make up address if pkt == NULL
 	struct tfo_addr_info addr;
-	struct tfo *fo = &w->f[ef->tfo_idx];
+	struct tfo *fo = ef->fo;
 
-	if (fos == &fo->pub) {
-		if (ef->flags & TFO_EF_FL_IPV6) {
-			addr.src_addr.v6 = ef->priv_addr.v6;
-			addr.dst_addr.v6 = ef->pub_addr.v6;
-		} else {
-			addr.src_addr.v4.s_addr = rte_cpu_to_be_32(ef->priv_addr.v4.s_addr);
-			addr.dst_addr.v4.s_addr = rte_cpu_to_be_32(ef->pub_addr.v4.s_addr);
-		}
-		addr.src_port = rte_cpu_to_be_16(ef->priv_port);
-		addr.dst_port = rte_cpu_to_be_16(ef->pub_port);
-	} else {
-		if (ef->flags & TFO_EF_FL_IPV6) {
-			addr.src_addr.v6 = ef->pub_addr.v6;
-			addr.dst_addr.v6 = ef->priv_addr.v6;
-		} else {
-			addr.src_addr.v4.s_addr = rte_cpu_to_be_32(ef->pub_addr.v4.s_addr);
-			addr.dst_addr.v4.s_addr = rte_cpu_to_be_32(ef->priv_addr.v4.s_addr);
-		}
-		addr.src_port = rte_cpu_to_be_16(ef->pub_port);
-		addr.dst_port = rte_cpu_to_be_16(ef->priv_port);
-	}
+	set_ack_addr(ef, fos, &addr);
 
 #ifdef DEBUG_DELAYED_ACK
 	printf("Sending %s 0x%x\n", is_keepalive ? "keepalive ACK" : send_rst ? "RST" : "delayed ACK", fos->rcv_nxt);
@@ -2766,6 +3332,35 @@ generate_ack_rst(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fo
 	_send_ack_pkt(w, ef, fos, NULL, &addr, fos == &fo->pub ? pub_vlan_tci : priv_vlan_tci, foos, NULL, tx_bufs, false, true, is_keepalive, send_rst);
 }
 
+/* Send the ACKs deferred while the burst was processed. A side's flag is
+ * cleared if an ACK was sent to it later in the burst, and the entries of a
+ * flow that has been freed are cleared by ack_pending_clear(). */
+static void
+send_pending_acks(struct tcp_worker *w, struct tfo_tx_bufs *tx_bufs)
+{
+	struct tfo_ack_pending *ap;
+	struct tfo_addr_info addr;
+	struct tfo_side *foos;
+	uint16_t i;
+
+	w->defer_acks = false;
+
+	for (i = 0; i < w->nb_ack_pending; i++) {
+		ap = &w->ack_pending[i];
+
+		if (!ap->ef || !(ap->fos->flags & TFO_SIDE_FL_ACK_PENDING))
+			continue;
+
+		ap->fos->flags &= ~TFO_SIDE_FL_ACK_PENDING;
+		foos = ap->fos == &ap->ef->fo->pub ? &ap->ef->fo->priv : &ap->ef->fo->pub;
+
+		set_ack_addr(ap->ef, ap->fos, &addr);
+		_send_ack_pkt(w, ap->ef, ap->fos, NULL, &addr, ap->vlan_id, foos, NULL, tx_bufs, false, true, false, false);
+	}
+
+	w->nb_ack_pending = 0;
+}
+
 static inline void
 generate_rst(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos, struct tfo_side *foos, struct tfo_tx_bufs *tx_bufs)
 {
@@ -2802,7 +3397,7 @@ send_keepalive(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_side *fos,
 	return false;
 }
 
-static inline uint32_t
+static inline struct tfo *
 _flow_alloc(struct tcp_worker *w, struct tfo_eflow *ef)
 {
 	struct tfo* fo;
@@ -2810,9 +3405,8 @@ _flow_alloc(struct tcp_worker *w, struct tfo_eflow *ef)
 
 	/* Allocated when decide to optimize flow (following SYN ACK) */
 
-	/* alloc flow */
-	fo = list_first_entry(&w->f_free, struct tfo, list);
-	list_del_init(&fo->list);
+	/* The tfo follows the eflow, which check_do_optimize() has checked is in w->oflows */
+	fo = &container_of(ef, struct tfo_oflow, flow.ef)->fo;
 
 	fos = &fo->priv;
 	while (true) {
@@ -2826,8 +3420,8 @@ _flow_alloc(struct tcp_worker *w, struct tfo_eflow *ef)
 #endif
 
 		INIT_LIST_HEAD(&fos->pktlist);
+		fos->pkt_tree = RB_ROOT;
 		INIT_LIST_HEAD(&fos->xmit_ts_list);
-		INIT_LIST_HEAD(&send_failed_list);
 		fos->last_sent = &fos->xmit_ts_list;
 
 		if (fos == &fo->pub)
@@ -2836,11 +3430,14 @@ _flow_alloc(struct tcp_worker *w, struct tfo_eflow *ef)
 		fos = &fo->pub;
 	}
 
+	INIT_LIST_HEAD(&fo->txq_throttled);
+	fo->throttled_sides = 0;
+
 // fo->flags is not set
 
 #ifdef DEBUG_MEM
-	if (fo != &w->f[fo->idx])
-		printf("flow %p, allocated from %p has index %u instead of %zu\n", fo, w->f, fo->idx, (fo - w->f) / sizeof(*fo));
+	if (fo->idx != tfo_eflow_idx(w, ef))
+		printf("flow %p, allocated with eflow %p has index %u instead of %u\n", fo, ef, fo->idx, tfo_eflow_idx(w, ef));
 #endif
 
 	++w->f_use;
@@ -2849,7 +3446,7 @@ _flow_alloc(struct tcp_worker *w, struct tfo_eflow *ef)
 	printf("Alloc'd flow %u to worker %p\n", fo->idx, w);
 #endif
 
-	return fo->idx;
+	return fo;
 }
 
 /* A packet can be marked as lost, queued to resend, but is then ack'd/sack'd
@@ -2866,121 +3463,860 @@ remove_pkt_from_tx_bufs(struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_bufs, struct
 		if (pkt->m != tx_bufs->m[p])
 			continue;
 
-		rte_pktmbuf_refcnt_update(pkt->m, -1);
-		pkt->flags &= ~TFO_PKT_FL_QUEUED_SEND;
-		fos->pkts_queued_send--;
+		rte_pktmbuf_refcnt_update(pkt->m, -1);
+		pkt->flags &= ~TFO_PKT_FL_QUEUED_SEND;
+		fos->pkts_queued_send--;
+
+		/* Yes - it might be the last entry, but it doesn't matter */
+		tx_bufs->m[p] = tx_bufs->m[--tx_bufs->nb_tx];
+		tx_bufs->discard[p] = tx_bufs->discard[tx_bufs->nb_tx];
+
+#ifdef DEBUG_REMOVE_TX_PKT
+		printf("Removed pkt %p seq 0x%x from tx_bufs\n", pkt->m, pkt->seq);
+#endif
+
+		return;
+	}
+
+#ifdef DEBUG_REMOVE_TX_PKT
+	printf("FAILED to remove pkt %p seq 0x%x from tx_bufs\n", pkt->m, pkt->seq);
+#endif
+}
+
+/*
+ * Send buffer - see struct tfo_sndbuf.
+ */
+#define TFO_SNDBUF_MAX_PKT_CHUNKS	(UINT16_MAX / TFO_SNDBUF_CHUNK_DATA + 2)
+
+#define sndbuf_chunk_ofs(seq)		((seq) & (TFO_SNDBUF_CHUNK_DATA - 1))
+
+/* The position on the ring, relative to first, of the chunk holding seq */
+static inline uint32_t
+sndbuf_chunk_num(const struct tfo_sndbuf *sb, uint32_t seq)
+{
+	return (sndbuf_chunk_ofs(sb->start_seq) + (seq - sb->start_seq)) / TFO_SNDBUF_CHUNK_DATA;
+}
+
+static inline struct tfo_sndbuf_chunk *
+sndbuf_chunk(const struct tfo_sndbuf *sb, uint32_t seq)
+{
+	return sb->chunks[(sb->first + sndbuf_chunk_num(sb, seq)) & (TFO_SNDBUF_MAX_CHUNKS - 1)];
+}
+
+/* Append len bytes of m from offset ofs. The chunks needed, and the ring if
+ * the buffer is empty, are allocated first, so that nothing is appended if
+ * the pool is exhausted. */
+static bool
+sndbuf_append(struct tcp_worker *w, struct tfo_sndbuf *sb, const struct rte_mbuf *m, uint32_t ofs, uint32_t len)
+{
+	void *chunks[TFO_SNDBUF_MAX_PKT_CHUNKS + 1];
+	uint32_t seq = sb->start_seq + sb->len;
+	uint32_t chunk_ofs = sndbuf_chunk_ofs(seq);
+	uint32_t used = sb->len ? sndbuf_chunk_num(sb, seq - 1) + 1 : 0;
+	uint32_t copy_len;
+	unsigned num, i;
+	const void *data;
+	uint8_t *buf;
+
+	/* The last chunk is full if the end is at the start of a chunk */
+	num = (chunk_ofs + len - 1) / TFO_SNDBUF_CHUNK_DATA + 1 - (sb->len && chunk_ofs);
+	if (unlikely(num > TFO_SNDBUF_MAX_PKT_CHUNKS || used + num > TFO_SNDBUF_MAX_CHUNKS))
+		return false;
+	if (unlikely(rte_mempool_get_bulk(sndbuf_pool, chunks, num + !sb->len))) {
+		++w->st.sndbuf_chunk_alloc_fail;
+		return false;
+	}
+
+	if (!sb->len) {
+		sb->chunks = chunks[num];
+		sb->first = 0;
+	}
+	for (i = 0; i < num; i++)
+		sb->chunks[(sb->first + used + i) & (TFO_SNDBUF_MAX_CHUNKS - 1)] = chunks[i];
+
+	sb->len += len;
+	w->st.sndbuf_bytes += len;
+
+	for ( ; len; seq += copy_len, ofs += copy_len, len -= copy_len) {
+		chunk_ofs = sndbuf_chunk_ofs(seq);
+		copy_len = min(len, TFO_SNDBUF_CHUNK_DATA - chunk_ofs);
+		buf = sndbuf_chunk(sb, seq)->data + chunk_ofs;
+		data = rte_pktmbuf_read(m, ofs, copy_len, buf);
+		if (data != buf)
+			rte_memcpy(buf, data, copy_len);
+	}
+
+	return true;
+}
+
+static void
+sndbuf_read(const struct tfo_sndbuf *sb, uint32_t seq, uint32_t len, uint8_t *buf)
+{
+	uint32_t ofs, copy_len;
+
+	for ( ; len; seq += copy_len, buf += copy_len, len -= copy_len) {
+		ofs = sndbuf_chunk_ofs(seq);
+		copy_len = min(len, TFO_SNDBUF_CHUNK_DATA - ofs);
+		rte_memcpy(buf, sndbuf_chunk(sb, seq)->data + ofs, copy_len);
+	}
+}
+
+/* Free the first num chunks */
+static void
+sndbuf_put_chunks(struct tfo_sndbuf *sb, uint32_t num)
+{
+	uint32_t i;
+
+	for (i = 0; i < num; i++)
+		rte_mempool_put(sndbuf_pool, sb->chunks[(sb->first + i) & (TFO_SNDBUF_MAX_CHUNKS - 1)]);
+
+	sb->first = (sb->first + num) & (TFO_SNDBUF_MAX_CHUNKS - 1);
+}
+
+static void
+sndbuf_empty(struct tfo_sndbuf *sb)
+{
+	sndbuf_put_chunks(sb, sndbuf_chunk_num(sb, sb->start_seq + sb->len - 1) + 1);
+	rte_mempool_put(sndbuf_pool, sb->chunks);
+
+	sb->chunks = NULL;
+	sb->len = 0;
+}
+
+/* Release the data before seq */
+static void
+sndbuf_release(struct tfo_sndbuf *sb, uint32_t seq)
+{
+	if (!after(seq, sb->start_seq))
+		return;
+
+	if (!before(seq, sb->start_seq + sb->len)) {
+		sndbuf_empty(sb);
+		return;
+	}
+
+	sndbuf_put_chunks(sb, sndbuf_chunk_num(sb, seq));
+
+	sb->len -= seq - sb->start_seq;
+	sb->start_seq = seq;
+}
+
+static void
+sndbuf_free(struct tfo_sndbuf *sb)
+{
+	if (sb->len)
+		sndbuf_empty(sb);
+
+	if (sb->hdr) {
+		rte_pktmbuf_free(sb->hdr);
+		sb->hdr = NULL;
+	}
+}
+
+/* The mbufs of packets freed while processing a burst or the timers, or
+ * released once sent (see release_sent_mbufs()), are released together at
+ * the end, rather than one at a time. A large cumulative ACK can free many
+ * packets, and the bulk free makes fewer calls to the mempool. Since the mbufs' reference counts are respected, the
+ * NIC can still hold a reference to an mbuf being reclaimed. */
+static void
+reclaim_flush(struct tcp_worker *w)
+{
+	if (w->nb_reclaim) {
+		rte_pktmbuf_free_bulk(w->reclaim, w->nb_reclaim);
+		w->nb_reclaim = 0;
+	}
+}
+
+static inline void
+reclaim_mbuf(struct tcp_worker *w, struct rte_mbuf *m)
+{
+	if (unlikely(w->nb_reclaim == TFO_RECLAIM_SIZE))
+		reclaim_flush(w);
+
+	w->reclaim[w->nb_reclaim++] = m;
+}
+
+/* A packet's TFO_PKT_FL_SENT flag cannot change while it is on a TX queue
+ * list, since it is removed from the list when it is queued to be sent. */
+static inline unsigned
+txq_pkt_list(const struct tfo_pkt *pkt)
+{
+	return pkt->flags & TFO_PKT_FL_SENT ? TFO_TXQ_RESEND : TFO_TXQ_NEW;
+}
+
+static inline struct tfo_pkt **
+txq_pkt_slot(const struct tfo_txq *q, unsigned list, unsigned i)
+{
+	return &q->pkts[list][(q->pkt_head[list] + i) % q->depth];
+}
+
+/* The position of pkt on its TX queue ring, counted from the head. Packets
+ * are only looked for when they are freed or moved while queued, which is
+ * rare, so the ring is searched. */
+static unsigned
+txq_pkt_pos(const struct tfo_txq *q, unsigned list, const struct tfo_pkt *pkt)
+{
+	unsigned i;
+
+	for (i = 0; i < q->nb_pkts[list]; i++) {
+		if (*txq_pkt_slot(q, list, i) == pkt)
+			break;
+	}
+
+	return i;
+}
+
+static inline void
+txq_remove_pkt(struct tcp_worker *w, struct tfo_pkt *pkt)
+{
+	struct tfo_txq *q = &w->txq;
+	unsigned list, i;
+
+	if (likely(!pkt->in_txq))
+		return;
+
+	list = txq_pkt_list(pkt);
+	for (i = txq_pkt_pos(q, list, pkt) + 1; i < q->nb_pkts[list]; i++)
+		*txq_pkt_slot(q, list, i - 1) = *txq_pkt_slot(q, list, i);
+	q->nb_pkts[list]--;
+	pkt->in_txq = false;
+}
+
+/* new_pkt, a copy of pkt, takes pkt's place on the TX queue */
+static inline void
+txq_replace_pkt(struct tcp_worker *w, const struct tfo_pkt *pkt, struct tfo_pkt *new_pkt)
+{
+	unsigned list = txq_pkt_list(pkt);
+
+	*txq_pkt_slot(&w->txq, list, txq_pkt_pos(&w->txq, list, pkt)) = new_pkt;
+}
+
+static void
+pkt_free(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_bufs)
+{
+	struct rte_mbuf *m = pkt->m;
+	struct tfo_pkt *prev_pkt;
+
+#if defined DEBUG_MEMPOOL || defined DEBUG_ACK_MEMPOOL
+	printf("pkt_free m %p refcnt %u seq 0x%x\n", pkt->m, pkt->m ? rte_mbuf_refcnt_read(pkt->m) : ~0U, pkt->seq);
+	show_mempool("packet_pool_0");
+#endif
+
+	/* A packet without an mbuf can still be on the xmit_ts_list if its data
+	 * has been moved to the send buffer, but cannot be queued to be sent */
+	if (pkt->flags & TFO_PKT_FL_QUEUED_SEND)
+		remove_pkt_from_tx_bufs(pkt, tx_bufs, s);
+
+	if ((pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_LOST)) == TFO_PKT_FL_SENT &&
+	    list_is_queued(&pkt->xmit_ts_list)) {
+		s->pkts_in_flight--;
+
+#ifdef DEBUG_IN_FLIGHT
+		printf("pkt_free(0x%x) pkts_in_flight decremented to %u\n", pkt->seq, s->pkts_in_flight);
+#endif
+	}
+
+	if (&pkt->xmit_ts_list == s->last_sent)
+		s->last_sent = pkt->xmit_ts_list.prev;
+
+	if (likely(list_is_queued(&pkt->xmit_ts_list)))
+		list_del_init(&pkt->xmit_ts_list);
+
+	txq_remove_pkt(w, pkt);
+
+	--w->p_use;
+	--s->pktcount;
+	buf_acct(w, s, -(int32_t)pkt->seglen, m ? -(int32_t)m->nb_segs : 0);
+	s->rack_segs_sacked -= pkt->rack_segs_sacked;
+
+#ifdef DEBUG_RACK_SACKED
+	printf("pkt_free decremented s->rack_segs_sacked by %u to %u\n", pkt->rack_segs_sacked, s->rack_segs_sacked);
+#endif
+
+	prev_pkt = list_is_first(&pkt->list, &s->pktlist) ? NULL : list_prev_entry(pkt, list);
+	pkt_tree_erase(s, pkt);
+
+	if (pkt_in_mbuf_priv(pkt)) {
+		list_del(&pkt->list);
+		reclaim_mbuf(w, m);
+	} else {
+		if (m) {
+			get_priv_addr(m)->pkt = NULL;
+			reclaim_mbuf(w, m);
+		}
+		list_move(&pkt->list, &w->p_free);
+	}
+
+	if (prev_pkt)
+		pkt_update_gap_after(s, prev_pkt);
+	else if (s->sndbuf.len) {
+		/* The data before the first packet is no longer needed */
+		sndbuf_release(&s->sndbuf, list_empty(&s->pktlist) ? s->sndbuf.start_seq + s->sndbuf.len :
+					list_first_entry(&s->pktlist, struct tfo_pkt, list)->seq);
+	}
+
+#ifdef DEBUG_MEMPOOL
+	printf("After:\n");
+	show_mempool("packet_pool_0");
+#endif
+#ifdef DEBUG_ACK_MEMPOOL
+	show_mempool("ack_pool_0");
+#endif
+}
+
+static inline void
+pkt_not_in_flight(struct tfo_pkt *pkt, struct tfo_side *s, struct tfo_tx_bufs *tx_bufs)
+{
+	if (pkt->flags & TFO_PKT_FL_QUEUED_SEND) {
+		remove_pkt_from_tx_bufs(pkt, tx_bufs, s);
+		pkt->flags &= ~TFO_PKT_FL_QUEUED_SEND;
+	}
+
+	if (list_is_queued(&pkt->xmit_ts_list) &&
+	    (pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_LOST)) == TFO_PKT_FL_SENT) {
+		s->pkts_in_flight--;
+#ifdef DEBUG_IN_FLIGHT
+		printf("pkt_not_in_flight(0x%x) pkts_in_flight decremented to %u\n", pkt->seq, s->pkts_in_flight);
+#endif
+	}
+
+	if (likely(list_is_queued(&pkt->xmit_ts_list))) {
+		if (&pkt->xmit_ts_list == s->last_sent)
+			s->last_sent = pkt->xmit_ts_list.prev;
+
+		list_del_init(&pkt->xmit_ts_list);
+	}
+	txq_remove_pkt(&worker, pkt);
+
+	pkt->flags &= ~TFO_PKT_FL_LOST;
+
+#ifdef DEBUG_MEMPOOL
+	printf("After:\n");
+	show_mempool("packet_pool_0");
+#endif
+#ifdef DEBUG_ACK_MEMPOOL
+	show_mempool("ack_pool_0");
+#endif
+}
+
+/* Move pkt out of its mbuf's private area to a struct tfo_pkt from w->p_free,
+ * so that the mbuf can be released while the packet stays on the pktlist.
+ * pkt must not be on the xmit_ts_list or a TX queue list. If p_free is
+ * empty, or pkt is not in the mbuf's private area, the packet keeps its mbuf,
+ * and pkt is returned. */
+static struct tfo_pkt *
+pkt_detach_mbuf(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	struct tfo_pkt *new_pkt;
+
+	if (unlikely(list_empty(&w->p_free)) || !pkt_in_mbuf_priv(pkt))
+		return pkt;
+
+	new_pkt = list_first_entry(&w->p_free, struct tfo_pkt, list);
+	list_del(&new_pkt->list);
+
+	*new_pkt = *pkt;
+	list_replace(&pkt->list, &new_pkt->list);
+	rb_replace_node(&pkt->seq_node, &new_pkt->seq_node, &s->pkt_tree);
+	INIT_LIST_HEAD(&new_pkt->xmit_ts_list);
+	new_pkt->in_txq = false;
+
+	/* The mbuf might still be queued to be sent */
+	get_priv_addr(pkt->m)->pkt = new_pkt;
+
+	new_pkt->m = NULL;
+	buf_acct(w, s, 0, -(int32_t)pkt->m->nb_segs);
+	new_pkt->ip_ofs = 0;
+	new_pkt->tcp_ofs = 0;
+	new_pkt->ts_ofs = 0;
+	new_pkt->sack_ofs = 0;
+
+	return new_pkt;
+}
+
+/* new_pkt takes the place of pkt on all the lists pkt is on, and on the
+ * pkt_tree */
+static void
+pkt_replace(struct tfo_side *s, struct tfo_pkt *pkt, struct tfo_pkt *new_pkt)
+{
+	*new_pkt = *pkt;
+	list_replace(&pkt->list, &new_pkt->list);
+	rb_replace_node(&pkt->seq_node, &new_pkt->seq_node, &s->pkt_tree);
+
+	if (list_is_queued(&pkt->xmit_ts_list)) {
+		list_replace(&pkt->xmit_ts_list, &new_pkt->xmit_ts_list);
+		if (s->last_sent == &pkt->xmit_ts_list)
+			s->last_sent = &new_pkt->xmit_ts_list;
+	} else
+		INIT_LIST_HEAD(&new_pkt->xmit_ts_list);
+
+	if (unlikely(pkt->in_txq))
+		txq_replace_pkt(&worker, pkt, new_pkt);
+}
+
+/* Free the mbuf of a packet that is not in the mbuf's private area */
+static inline void
+pkt_release_mbuf(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	/* The NIC may still hold a reference to the mbuf */
+	get_priv_addr(pkt->m)->pkt = NULL;
+	buf_acct(w, s, 0, -(int32_t)pkt->m->nb_segs);
+	reclaim_mbuf(w, pkt->m);
+
+	pkt->m = NULL;
+	pkt->ip_ofs = 0;
+	pkt->tcp_ofs = 0;
+	pkt->ts_ofs = 0;
+	pkt->sack_ofs = 0;
+}
+
+/* Copy a packet that has been sent into an mbuf from the worker's small mbuf
+ * pool, and free its receive mbuf, so that a small segment waiting to be
+ * acked does not hold a full sized mbuf of the NIC's pool. The struct tfo_pkt
+ * moves to the private area of the new mbuf, and is returned. If the packet
+ * is not copied, pkt is returned. */
+static struct tfo_pkt *
+pkt_move_to_small_mbuf(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	struct rte_mbuf *m = pkt->m;
+	struct rte_mbuf *new_m;
+	struct tfo_mbuf_priv *priv;
+	struct tfo_pkt *new_pkt;
+	const void *data;
+	void *buf;
+
+	if (m->pkt_len > small_pool_max_len || m->pool == small_pool ||
+	    rte_pktmbuf_data_room_size(m->pool) <= rte_pktmbuf_data_room_size(small_pool))
+		return pkt;
+
+	if (unlikely(!(new_m = rte_pktmbuf_alloc(small_pool)))) {
+		++w->st.small_mbuf_alloc_fail;
+		return pkt;
+	}
+
+	/* The data of a coalesced packet is in several segments */
+	buf = rte_pktmbuf_append(new_m, m->pkt_len);
+	data = rte_pktmbuf_read(m, 0, m->pkt_len, buf);
+	if (data != buf)
+		rte_memcpy(buf, data, m->pkt_len);
+
+	new_m->packet_type = m->packet_type;
+	new_m->ol_flags = m->ol_flags;
+	new_m->vlan_tci = m->vlan_tci;
+	new_m->vlan_tci_outer = m->vlan_tci_outer;
+	new_m->hash = m->hash;
+	new_m->port = m->port;
+	new_m->tx_offload = m->tx_offload;
+
+	priv = get_priv_addr(new_m);
+	priv->fos = s;
+	new_pkt = &priv->pkt_store;
+	priv->pkt = new_pkt;
+
+	pkt_replace(s, pkt, new_pkt);
+	new_pkt->m = new_m;
+
+	buf_acct(w, s, 0, 1 - (int32_t)m->nb_segs);
+
+	++w->st.small_mbuf_copies;
+	w->st.small_mbuf_bytes_saved += rte_pktmbuf_data_room_size(m->pool) - rte_pktmbuf_data_room_size(small_pool);
+
+	/* The NIC may still hold a reference to the mbuf */
+	get_priv_addr(m)->pkt = NULL;
+	reclaim_mbuf(w, m);
+
+	return new_pkt;
+}
+
+static inline bool
+pkt_has_ipv6_ext_hdrs(const struct tfo_side *s, const struct tfo_pkt *pkt)
+{
+	return (s->ef->flags & TFO_EF_FL_IPV6) && pkt->tcp_ofs != pkt->ip_ofs + sizeof(struct rte_ipv6_hdr);
+}
+
+/* The header template of the side's send buffer is made from the first
+ * packet moved to the buffer. It has the packet's headers, and the timestamp
+ * option if the packet has one; update_sack_option() adds any SACK blocks
+ * when a rebuilt packet is sent. */
+static bool
+sndbuf_set_template(struct tcp_worker *w, struct tfo_side *s, const struct tfo_pkt *pkt)
+{
+	struct tfo_sndbuf *sb = &s->sndbuf;
+	const struct rte_mbuf *m = pkt->m;
+	struct tcp_timestamp_option *ts;
+	struct rte_tcp_hdr *tcp;
+	struct rte_mbuf *hdr;
+	uint16_t hdr_len = pkt->tcp_ofs + sizeof(struct rte_tcp_hdr);
+	uint8_t *data;
+
+	/* IPv6 extension headers are included in the payload length */
+	if (pkt_has_ipv6_ext_hdrs(s, pkt))
+		return false;
+
+	/* Packets are rebuilt in mbufs from the pool the NIC receives into */
+	if (!sndbuf_mbuf_pool) {
+		if (m->pool == small_pool)
+			return false;
+		sndbuf_mbuf_pool = m->pool;
+	}
+
+	if (unlikely(!(hdr = rte_pktmbuf_alloc(ack_pool)))) {
+		++w->st.sndbuf_template_fail;
+		return false;
+	}
+
+	if (unlikely(!(data = (uint8_t *)rte_pktmbuf_append(hdr, hdr_len + (pkt->ts_ofs ? sizeof(*ts) + 2 : 0))))) {
+		rte_pktmbuf_free(hdr);
+		++w->st.sndbuf_template_fail;
+		return false;
+	}
+
+	rte_memcpy(data, rte_pktmbuf_mtod(m, const uint8_t *), hdr_len);
+	if (pkt->ts_ofs) {
+		*(uint32_t *)(data + hdr_len) = rte_cpu_to_be_32(TCPOPT_TSTAMP_HDR);
+		ts = (struct tcp_timestamp_option *)(data + hdr_len + 2);
+		ts->ts_val = pkt_ts(pkt)->ts_val;
+		ts->ts_ecr = pkt_ts(pkt)->ts_ecr;
+	}
+
+	tcp = (struct rte_tcp_hdr *)(data + pkt->tcp_ofs);
+	tcp->data_off = (hdr->data_len - pkt->tcp_ofs) << 2;
+	tcp->tcp_flags = RTE_TCP_ACK_FLAG;
+	tcp->tcp_urp = 0;
+
+	hdr->packet_type = m->packet_type;
+	hdr->ol_flags = m->ol_flags;
+	hdr->vlan_tci = m->vlan_tci;
+	hdr->vlan_tci_outer = m->vlan_tci_outer;
+
+	hdr->l2_len = pkt->ip_ofs;
+	hdr->l3_len = pkt->tcp_ofs - pkt->ip_ofs;
+	sb->hdr = hdr;
+
+	return true;
+}
+
+static inline bool
+sndbuf_pkt_fits(const struct tfo_sndbuf *sb, uint32_t seglen)
+{
+	return sb->hdr->data_len + seglen <= (unsigned)(rte_pktmbuf_data_room_size(sndbuf_mbuf_pool) - RTE_PKTMBUF_HEADROOM);
+}
+
+/* Move the payload of a data packet that has been sent to the side's send
+ * buffer, and free its mbuf. If the packet is in its mbuf's private area,
+ * it moves to a struct tfo_pkt from w->p_free. The packet is returned, and
+ * still has its mbuf if it could not be moved. */
+static struct tfo_pkt *
+pkt_move_to_sndbuf(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	struct tfo_sndbuf *sb = &s->sndbuf;
+	const struct rte_tcp_hdr *tcp = pkt_tcp(pkt);
+	struct tfo_pkt *new_pkt;
+	uint32_t end;
+
+	if (!pkt->seglen ||
+	    (tcp->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG | RTE_TCP_URG_FLAG)) ||
+	    pkt->in_txq)
+		return pkt;
+
+	/* Data can only be added at the end of the buffer */
+	end = sb->start_seq + sb->len;
+	if (sb->len && (before(pkt->seq, sb->start_seq) || after(pkt->seq, end)))
+		return pkt;
+
+	if (pkt_in_mbuf_priv(pkt) && unlikely(list_empty(&w->p_free)))
+		return pkt;
+
+	if (!sb->hdr && !sndbuf_set_template(w, s, pkt))
+		return pkt;
+
+	/* It must be possible to rebuild the packet in a single mbuf */
+	if (!sndbuf_pkt_fits(sb, pkt->seglen))
+		return pkt;
+
+	if (!sb->len)
+		sb->start_seq = end = pkt->seq;
+
+	/* A rebuilt packet's data is already in the buffer */
+	if (after(segend(pkt), end) &&
+	    !sndbuf_append(w, sb, pkt->m, pkt->tcp_ofs + ((tcp->data_off & 0xf0) >> 2) + (end - pkt->seq), segend(pkt) - end))
+		return pkt;
+
+	if (pkt_in_mbuf_priv(pkt)) {
+		new_pkt = list_first_entry(&w->p_free, struct tfo_pkt, list);
+		list_del(&new_pkt->list);
+		pkt_replace(s, pkt, new_pkt);
+		pkt = new_pkt;
+	}
+
+	pkt_release_mbuf(w, s, pkt);
+	++w->st.sndbuf_pkts;
+
+	return pkt;
+}
+
+/* Set the IP length of a packet from the length of its mbuf, and recalculate
+ * the IP and TCP checksums. The packet must be in a single segment, and an
+ * IPv6 packet must not have extension headers. */
+static void
+pkt_set_len_cksum(const struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	union tfo_ip_p iph = pkt_iph(pkt);
+	struct rte_tcp_hdr *tcp = pkt_tcp(pkt);
+
+	if (s->ef->flags & TFO_EF_FL_IPV6)
+		iph.ip6h->payload_len = rte_cpu_to_be_16(pkt->m->pkt_len - pkt->tcp_ofs);
+	else
+		iph.ip4h->total_length = rte_cpu_to_be_16(pkt->m->pkt_len - pkt->ip_ofs);
+
+	if (option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD) {
+		set_tx_cksum_offload(pkt->m, iph, tcp, s->ef->flags & TFO_EF_FL_IPV6);
+		return;
+	}
+
+	tcp->cksum = 0;
+	if (s->ef->flags & TFO_EF_FL_IPV6)
+		tcp->cksum = rte_ipv6_udptcp_cksum(iph.ip6h, tcp);
+	else {
+		iph.ip4h->hdr_checksum = 0;
+		iph.ip4h->hdr_checksum = rte_ipv4_cksum(iph.ip4h);
+		tcp->cksum = rte_ipv4_udptcp_cksum(iph.ip4h, tcp);
+	}
+}
+
+/* Rebuild a packet whose data is in the send buffer, so that it can be resent.
+ * The packet keeps its struct tfo_pkt, and is not in the new mbuf's private
+ * area. */
+static bool
+pkt_sndbuf_rebuild(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt)
+{
+	const struct tfo_sndbuf *sb = &s->sndbuf;
+	uint16_t hdr_len = sb->hdr ? sb->hdr->data_len : 0;
+	struct tfo_mbuf_priv *priv;
+	struct rte_mbuf *m;
+	uint8_t *data;
+
+	if (!sb->hdr || !sndbuf_holds(sb, pkt->seq, pkt->seglen))
+		return false;
+
+	if (!sndbuf_pkt_fits(sb, pkt->seglen))
+		return false;
+
+	if (unlikely(!(m = rte_pktmbuf_alloc(sndbuf_mbuf_pool)))) {
+		++w->st.sndbuf_rebuild_fail;
+		return false;
+	}
+
+	data = (uint8_t *)rte_pktmbuf_append(m, hdr_len + pkt->seglen);
+	rte_memcpy(data, rte_pktmbuf_mtod(sb->hdr, const uint8_t *), hdr_len);
+	sndbuf_read(sb, pkt->seq, pkt->seglen, data + hdr_len);
 
-		/* Yes - it might be the last entry, but it doesn't matter */
-		tx_bufs->m[p] = tx_bufs->m[--tx_bufs->nb_tx];
-		if (ack_bit_is_set(tx_bufs, tx_bufs->nb_tx))
-			set_ack_bit(tx_bufs, p);
-		else
-			clear_ack_bit(tx_bufs, p);
+	m->packet_type = sb->hdr->packet_type;
+	m->ol_flags = sb->hdr->ol_flags;
+	m->vlan_tci = sb->hdr->vlan_tci;
+	m->vlan_tci_outer = sb->hdr->vlan_tci_outer;
 
-#ifdef DEBUG_REMOVE_TX_PKT
-		printf("Removed pkt %p seq 0x%x from tx_bufs\n", pkt->m, pkt->seq);
-#endif
+	priv = get_priv_addr(m);
+	priv->fos = s;
+	priv->pkt = pkt;
 
-		return;
-	}
+	pkt->m = m;
+	pkt->ip_ofs = sb->hdr->l2_len;
+	pkt->tcp_ofs = sb->hdr->l2_len + sb->hdr->l3_len;
+	pkt->ts_ofs = hdr_len > pkt->tcp_ofs + sizeof(struct rte_tcp_hdr) ? sizeof(struct rte_tcp_hdr) + 2 : 0;
+	pkt->sack_ofs = 0;
 
-#ifdef DEBUG_REMOVE_TX_PKT
-	printf("FAILED to remove pkt %p seq 0x%x from tx_bufs\n", pkt->m, pkt->seq);
-#endif
+	pkt_tcp(pkt)->sent_seq = rte_cpu_to_be_32(pkt->seq);
+	pkt_set_len_cksum(s, pkt);
+
+	buf_acct(w, s, 0, 1);
+	++w->st.sndbuf_rebuilds;
+
+	return true;
 }
 
+#define TFO_RESEG_MAX_SPLIT	16
+
+/* Split an unsent packet into segments of max_len bytes of payload. The
+ * new segments are in mbufs from the packet's own pool, and all are
+ * allocated before the packet is changed, so either the whole packet is
+ * split or it is left as it is. */
 static void
-pkt_free(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_bufs)
+pkt_split(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt, uint16_t max_len)
 {
-#if defined DEBUG_MEMPOOL || defined DEBUG_ACK_MEMPOOL
-	printf("pkt_free m %p refcnt %u seq 0x%x\n", pkt->m, pkt->m ? rte_mbuf_refcnt_read(pkt->m) : ~0U, pkt->seq);
-	show_mempool("packet_pool_0");
-#endif
-
-	/* We might have already freed the mbuf if using SACK */
-	if (pkt->m) {
-		if (pkt->flags & TFO_PKT_FL_QUEUED_SEND)
-			remove_pkt_from_tx_bufs(pkt, tx_bufs, s);
+	struct rte_mbuf *new_m[TFO_RESEG_MAX_SPLIT];
+	struct rte_mbuf *m = pkt->m;
+	struct rte_tcp_hdr *tcp = pkt_tcp(pkt);
+	struct tfo_pkt *prev_pkt = pkt;
+	struct tfo_pkt *new_pkt;
+	struct tfo_mbuf_priv *priv;
+	uint16_t hdr_len = pkt->tcp_ofs + ((tcp->data_off & 0xf0) >> 2);
+	uint32_t n, i, ofs, len;
+	uint8_t *data;
 
-		NO_INLINE_WARNING(rte_pktmbuf_free(pkt->m));
-		if ((pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_LOST)) == TFO_PKT_FL_SENT &&
-		    list_is_queued(&pkt->xmit_ts_list)) {
-			s->pkts_in_flight--;
+	n = (pkt->seglen - 1) / max_len;
+	if (n > TFO_RESEG_MAX_SPLIT ||
+	    hdr_len + max_len > rte_pktmbuf_data_room_size(m->pool) - RTE_PKTMBUF_HEADROOM)
+		return;
 
-#ifdef DEBUG_IN_FLIGHT
-			printf("pkt_free(0x%x) pkts_in_flight decremented to %u\n", pkt->seq, s->pkts_in_flight);
-#endif
-		}
+	if (unlikely(rte_pktmbuf_alloc_bulk(m->pool, new_m, n))) {
+		++w->st.reseg_alloc_fail;
+		return;
+	}
 
-		if (&pkt->xmit_ts_list == s->last_sent)
-			s->last_sent = pkt->xmit_ts_list.prev;
+	for (i = 0, ofs = max_len; i < n; i++, ofs += len) {
+		len = pkt->seglen - ofs < max_len ? pkt->seglen - ofs : max_len;
+
+		data = (uint8_t *)rte_pktmbuf_append(new_m[i], hdr_len + len);
+		rte_memcpy(data, rte_pktmbuf_mtod(m, const uint8_t *), hdr_len);
+		rte_memcpy(data + hdr_len, rte_pktmbuf_mtod_offset(m, const uint8_t *, hdr_len + ofs), len);
+
+		new_m[i]->packet_type = m->packet_type;
+		new_m[i]->ol_flags = m->ol_flags;
+		new_m[i]->vlan_tci = m->vlan_tci;
+		new_m[i]->vlan_tci_outer = m->vlan_tci_outer;
+		new_m[i]->hash = m->hash;
+		new_m[i]->port = m->port;
+		new_m[i]->tx_offload = m->tx_offload;
+
+		priv = get_priv_addr(new_m[i]);
+		priv->fos = s;
+		new_pkt = &priv->pkt_store;
+		priv->pkt = new_pkt;
+
+		new_pkt->m = new_m[i];
+		new_pkt->seq = pkt->seq + ofs;
+		new_pkt->seglen = len;
+		new_pkt->ip_ofs = pkt->ip_ofs;
+		new_pkt->tcp_ofs = pkt->tcp_ofs;
+		new_pkt->ts_ofs = pkt->ts_ofs;
+		new_pkt->sack_ofs = pkt->sack_ofs;
+		new_pkt->flags = pkt->flags;
+		new_pkt->ns = 0;
+		new_pkt->rack_segs_sacked = 0;
+		new_pkt->in_txq = false;
+		INIT_LIST_HEAD(&new_pkt->xmit_ts_list);
+
+		/* Only the last segment keeps PSH */
+		pkt_tcp(new_pkt)->sent_seq = rte_cpu_to_be_32(new_pkt->seq);
+		if (i != n - 1)
+			pkt_tcp(new_pkt)->tcp_flags &= ~RTE_TCP_PSH_FLAG;
+		pkt_set_len_cksum(s, new_pkt);
+	}
+
+	rte_pktmbuf_trim(m, m->pkt_len - (hdr_len + max_len));
+	pkt->seglen = max_len;
+	tcp->tcp_flags &= ~RTE_TCP_PSH_FLAG;
+	pkt_set_len_cksum(s, pkt);
+
+	for (i = 0; i < n; i++) {
+		new_pkt = get_priv_addr(new_m[i])->pkt;
+		list_add(&new_pkt->list, &prev_pkt->list);
+		pkt_tree_insert(s, new_pkt);
+		prev_pkt = new_pkt;
+	}
+
+	s->pktcount += n;
+	buf_acct(w, s, 0, n);
+	w->p_use += n;
+	if (w->p_use > w->p_max_use)
+		w->p_max_use = w->p_use;
 
-		if (likely(list_is_queued(&pkt->xmit_ts_list)))
-			list_del_init(&pkt->xmit_ts_list);
-	}
+	++w->st.reseg_split;
+	w->st.reseg_split_segs += n;
+}
 
-	if (unlikely(list_is_queued(&pkt->send_failed_list)))
-		list_del_init(&pkt->send_failed_list);
-	list_move(&pkt->list, &w->p_free);
+/* Append the payload of the unsent packets that follow pkt to pkt, while the
+ * total payload is no more than max_len and the mbuf has room. A packet is
+ * only merged if all of it is within the send window, and keep_m, if set,
+ * is an mbuf the caller still references, so its packet must not be freed. */
+static void
+pkt_merge_next(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt, uint16_t max_len,
+		uint32_t win_end, const struct rte_mbuf *keep_m, struct tfo_tx_bufs *tx_bufs)
+{
+	struct rte_mbuf *m = pkt->m;
+	struct tfo_pkt *next_pkt;
+	const struct rte_tcp_hdr *next_tcp;
+	const void *src;
+	void *dst;
+	bool merged = false;
+
+	while (!list_is_last(&pkt->list, &s->pktlist)) {
+		next_pkt = list_next_entry(pkt, list);
+
+		if (next_pkt->seq != segend(pkt) ||
+		    (next_pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_QUEUED_SEND)) ||
+		    !next_pkt->m ||
+		    next_pkt->m == keep_m ||
+		    after(segend(next_pkt), win_end) ||
+		    pkt->seglen + next_pkt->seglen > max_len ||
+		    rte_pktmbuf_tailroom(m) < next_pkt->seglen)
+			break;
 
-	--w->p_use;
-	--s->pktcount;
-	s->rack_segs_sacked -= pkt->rack_segs_sacked;
+		next_tcp = pkt_tcp(next_pkt);
+		if (next_tcp->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG | RTE_TCP_URG_FLAG))
+			break;
 
-#ifdef DEBUG_RACK_SACKED
-	printf("pkt_free decremented s->rack_segs_sacked by %u to %u\n", pkt->rack_segs_sacked, s->rack_segs_sacked);
-#endif
+		/* The data of a coalesced packet is in several segments */
+		dst = rte_pktmbuf_append(m, next_pkt->seglen);
+		src = rte_pktmbuf_read(next_pkt->m, next_pkt->tcp_ofs + ((next_tcp->data_off & 0xf0) >> 2), next_pkt->seglen, dst);
+		if (src != dst)
+			rte_memcpy(dst, src, next_pkt->seglen);
 
-#ifdef DEBUG_MEMPOOL
-	printf("After:\n");
-	show_mempool("packet_pool_0");
-#endif
-#ifdef DEBUG_ACK_MEMPOOL
-	show_mempool("ack_pool_0");
-#endif
-}
+		pkt_tcp(pkt)->tcp_flags |= next_tcp->tcp_flags & RTE_TCP_PSH_FLAG;
+		pkt->seglen += next_pkt->seglen;
+		buf_acct(w, s, next_pkt->seglen, 0);
+		merged = true;
 
-static inline void
-pkt_not_in_flight(struct tfo_pkt *pkt, struct tfo_side *s, struct tfo_tx_bufs *tx_bufs)
-{
-	if (pkt->m) {
-		if (pkt->flags & TFO_PKT_FL_QUEUED_SEND) {
-			remove_pkt_from_tx_bufs(pkt, tx_bufs, s);
-			pkt->flags &= ~TFO_PKT_FL_QUEUED_SEND;
-		}
+		pkt_free(w, s, next_pkt, tx_bufs);
+		++w->st.reseg_merge;
+	}
 
-		if (list_is_queued(&pkt->xmit_ts_list) &&
-		    (pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_LOST)) == TFO_PKT_FL_SENT) {
-			s->pkts_in_flight--;
-#ifdef DEBUG_IN_FLIGHT
-			printf("pkt_not_in_flight(0x%x) pkts_in_flight decremented to %u\n", pkt->seq, s->pkts_in_flight);
-#endif
-		}
+	if (merged)
+		pkt_set_len_cksum(s, pkt);
+}
 
-		if (likely(list_is_queued(&pkt->xmit_ts_list))) {
-			if (&pkt->xmit_ts_list == s->last_sent)
-				s->last_sent = pkt->xmit_ts_list.prev;
+/* Before an unsent packet is sent for the first time, resegment it to the
+ * MSS of the side it is sent to. Segments received from the other side are
+ * sized to that side's MSS, so an oversize packet is split, and an undersize
+ * one has the following unsent data merged into it. The payload limit allows
+ * for the packet's TCP options, as for coalescing. */
+static void
+pkt_resegment(struct tcp_worker *w, struct tfo_side *s, struct tfo_pkt *pkt, uint32_t win_end,
+		const struct rte_mbuf *keep_m, struct tfo_tx_bufs *tx_bufs)
+{
+	const struct rte_tcp_hdr *tcp;
+	uint16_t opt_len;
+	uint16_t max_len;
+
+	if (!s->mss ||
+	    (pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_QUEUED_SEND)) ||
+	    !pkt->m ||
+	    !pkt_in_mbuf_priv(pkt) ||
+	    pkt->m->nb_segs != 1 ||
+	    pkt_has_ipv6_ext_hdrs(s, pkt))
+		return;
 
-			list_del_init(&pkt->xmit_ts_list);
-		}
-		if (unlikely(list_is_queued(&pkt->send_failed_list)))
-			list_del_init(&pkt->send_failed_list);
+	tcp = pkt_tcp(pkt);
+	if (tcp->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG | RTE_TCP_URG_FLAG))
+		return;
 
-		pkt->flags &= ~TFO_PKT_FL_LOST;
-	}
+	opt_len = ((tcp->data_off & 0xf0) >> 2) - sizeof(struct rte_tcp_hdr);
+	if (s->mss <= opt_len)
+		return;
+	max_len = s->mss - opt_len;
 
-#ifdef DEBUG_MEMPOOL
-	printf("After:\n");
-	show_mempool("packet_pool_0");
-#endif
-#ifdef DEBUG_ACK_MEMPOOL
-	show_mempool("ack_pool_0");
-#endif
+	if (pkt->seglen > max_len)
+		pkt_split(w, s, pkt, max_len);
+	else
+		pkt_merge_next(w, s, pkt, max_len, win_end, keep_m, tx_bufs);
 }
 
-static inline void
-pkt_free_mbuf(struct tfo_pkt *pkt, struct tfo_side *s, struct tfo_tx_bufs *tx_bufs)
+static inline struct tfo_pkt *
+pkt_free_mbuf(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_side *s, struct tfo_tx_bufs *tx_bufs)
 {
+	struct tfo_pkt *new_pkt;
+
 #if defined DEBUG_MEMPOOL || defined DEBUG_ACK_MEMPOOL
 	printf("pkt_free_mbuf m %p refcnt %u seq 0x%x\n", pkt->m, pkt->m ? rte_mbuf_refcnt_read(pkt->m) : ~0U, pkt->seq);
 	show_mempool("packet_pool_0");
@@ -2988,19 +4324,45 @@ pkt_free_mbuf(struct tfo_pkt *pkt, struct tfo_side *s, struct tfo_tx_bufs *tx_bu
 
 	pkt_not_in_flight(pkt, s, tx_bufs);
 
+	/* Keep the data in the send buffer if possible, so that the packet can
+	 * be resent if the receiver reneges on a SACK */
+	if (sndbuf_pool && pkt->m && !(new_pkt = pkt_move_to_sndbuf(w, s, pkt))->m)
+		return new_pkt;
+
+	/* A packet rebuilt from the send buffer can just drop its mbuf */
+	if (!pkt_in_mbuf_priv(pkt)) {
+		if (pkt->m)
+			pkt_release_mbuf(w, s, pkt);
+		return pkt;
+	}
+
+	new_pkt = pkt_detach_mbuf(w, s, pkt);
+	if (unlikely(new_pkt == pkt))
+		return pkt;
+
 #ifdef DEBUG_PKT_REFCNT
 	uint16_t refcnt;
 	if ((refcnt = rte_mbuf_refcnt_read(pkt->m)) != 1)
-		printf("NOTICE - freeing packet %p seq 0x%x mbuf %p with refcnt %u\n", pkt, pkt->seq, pkt->m, refcnt);
+		printf("NOTICE - freeing packet %p seq 0x%x mbuf %p with refcnt %u\n", new_pkt, new_pkt->seq, pkt->m, refcnt);
 #endif
 
-	NO_INLINE_WARNING(rte_pktmbuf_free(pkt->m));
+	reclaim_mbuf(w, pkt->m);
 
-	pkt->m = NULL;
-	pkt->iph.ip4h = NULL;
-	pkt->tcp = NULL;
-	pkt->ts = NULL;
-	pkt->sack = NULL;
+	return new_pkt;
+}
+
+/* The eflow and tfo of a flow being freed can be reused before the end of
+ * the burst, so drop the flow's deferred ACKs rather than leave entries that
+ * send_pending_acks() cannot tell are stale. */
+static void
+ack_pending_clear(struct tcp_worker *w, const struct tfo *f)
+{
+	uint16_t i;
+
+	for (i = 0; i < w->nb_ack_pending; i++) {
+		if (w->ack_pending[i].fos == &f->priv || w->ack_pending[i].fos == &f->pub)
+			w->ack_pending[i].ef = NULL;
+	}
 }
 
 static void
@@ -3018,21 +4380,42 @@ _flow_free(struct tcp_worker *w, struct tfo *f, struct tfo_tx_bufs *tx_bufs)
 	list_for_each_entry_safe(pkt, pkt_tmp, &f->pub.pktlist, list)
 		pkt_free(w, &f->pub, pkt, tx_bufs);
 
-	list_add(&f->list, &w->f_free);
+	sndbuf_free(&f->priv.sndbuf);
+	sndbuf_free(&f->pub.sndbuf);
+
+	list_del(&f->txq_throttled);
+
+	if ((f->priv.flags | f->pub.flags) & TFO_SIDE_FL_ACK_PENDING)
+		ack_pending_clear(w, f);
+
 	--w->f_use;
 }
 
+
 static struct tfo_eflow *
 _eflow_alloc(struct tcp_worker *w, uint32_t h)
 {
 	struct tfo_eflow *ef;
+	struct hlist_head *free_list;
 
 	/* Called on first SYN of flow (i.e. no ACK) */
 
-	if (unlikely(hlist_empty(&w->ef_free)))
+	/* Use an eflow that can be optimized while there are any */
+	free_list = likely(!hlist_empty(&w->of_free)) ? &w->of_free : &w->ef_free;
+	if (unlikely(hlist_empty(free_list)))
 		return NULL;
 
-	ef = hlist_entry(w->ef_free.first, struct tfo_eflow, hlist);
+	ef = hlist_entry(free_list->first, struct tfo_eflow, hlist);
+
+#ifdef EFLOW_BUCKET_HASH
+	/* If there is no room, start growing the table now rather than refuse
+	 * the flow. The eflow is added to the new table, which is mostly empty. */
+	if (unlikely(!eflow_bucket_add(w, ef, h)) &&
+	    (!eflow_hash_grow(w) || !eflow_bucket_add(w, ef, h)))
+		return NULL;
+#else
+	ef->flow_hash = h;
+#endif
 
 #ifdef DEBUG_MEM
 	if (ef->flags)
@@ -3040,9 +4423,9 @@ _eflow_alloc(struct tcp_worker *w, uint32_t h)
 	ef->flags = TFO_EF_FL_USED;
 	if (ef->state != TFO_STATE_NONE)
 		printf("Allocating eflow %p in state %s\n", ef, get_state_name(ef->state));
-	if (ef->tfo_idx != TFO_IDX_UNUSED) {
-		printf("Allocating eflow %p with tfo %u\n", ef, ef->tfo_idx);
-		ef->tfo_idx = TFO_IDX_UNUSED;
+	if (ef->fo) {
+		printf("Allocating eflow %p with tfo %u\n", ef, ef->fo->idx);
+		ef->fo = NULL;
 	}
 #endif
 
@@ -3051,7 +4434,9 @@ _eflow_alloc(struct tcp_worker *w, uint32_t h)
 	ef->client_mss = TCP_MSS_DEFAULT;
 
 	__hlist_del(&ef->hlist);
-	hlist_add_head(&ef->hlist, &w->hef[h]);
+#ifndef EFLOW_BUCKET_HASH
+	hlist_add_head(&ef->hlist, &w->hef[h & w->hef_mask]);
+#endif
 
 	RB_CLEAR_NODE(&ef->timer.node);
 
@@ -3069,7 +4454,7 @@ static void
 _eflow_free(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_tx_bufs *tx_bufs)
 {
 #ifdef DEBUG_FLOW
-	printf("eflow_free w %p ef %p ef->tfo_idx %u flags 0x%x, state %s\n", w, ef, ef->tfo_idx, ef->flags, get_state_name(ef->state));
+	printf("eflow_free w %p ef %p ef->fo %p flags 0x%x, state %s\n", w, ef, ef->fo, ef->flags, get_state_name(ef->state));
 #endif
 
 	if (ef->state == TCP_STATE_CLEAR_OPTIMIZE)
@@ -3077,9 +4462,9 @@ _eflow_free(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_tx_bufs *tx_b
 	else
 		--w->st.flow_state[TCP_STATE_STAT_OPTIMIZED];
 
-	if (ef->tfo_idx != TFO_IDX_UNUSED) {
-		_flow_free(w, &w->f[ef->tfo_idx], tx_bufs);
-		ef->tfo_idx = TFO_IDX_UNUSED;
+	if (ef->fo) {
+		_flow_free(w, ef->fo, tx_bufs);
+		ef->fo = NULL;
 	}
 
 	if (!RB_EMPTY_NODE(&ef->timer.node)) {
@@ -3111,8 +4496,42 @@ _eflow_free(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_tx_bufs *tx_b
 
 	ef->flags = 0;
 
+#ifdef EFLOW_BUCKET_HASH
+	eflow_bucket_del(w, ef);
+#else
 	__hlist_del(&ef->hlist);
+#endif
+	hlist_add_head(&ef->hlist, tfo_eflow_in_oflows(w, ef) ? &w->of_free : &w->ef_free);
+}
+
+/* A flow can only be optimized if its eflow is in w->oflows. If the eflow
+ * was allocated when none were free, move it there if one has been freed
+ * since, so that the flow can be optimized when its SYN+ACK arrives. */
+static struct tfo_eflow *
+_eflow_move_to_oflows(struct tcp_worker *w, struct tfo_eflow *ef)
+{
+	struct tfo_eflow *new_ef;
+
+	if (hlist_empty(&w->of_free))
+		return ef;
+
+	new_ef = hlist_entry(w->of_free.first, struct tfo_eflow, hlist);
+	__hlist_del(&new_ef->hlist);
+
+	*container_of(new_ef, struct tfo_flow, ef) = *container_of(ef, struct tfo_flow, ef);
+	eflow_hash_move(w, ef, new_ef);
+	if (!RB_EMPTY_NODE(&ef->timer.node))
+		rb_replace_node_cached(&ef->timer.node, &new_ef->timer.node, &timer_tree);
+
+#ifdef DEBUG_FLOW
+	printf("Moved eflow %p to %p\n", ef, new_ef);
+#endif
+
+	ef->state = TFO_STATE_NONE;
+	ef->flags = 0;
 	hlist_add_head(&ef->hlist, &w->ef_free);
+
+	return new_ef;
 }
 
 static inline void
@@ -3127,7 +4546,7 @@ update_eflow_timeout(struct tfo_eflow *ef)
 		port_index = 0;
 
 	if (ef->state == TCP_STATE_ESTABLISHED) {
-		fo = &worker.f[ef->tfo_idx];
+		fo = ef->fo;
 
 		/* If we have received a FIN from either side, use the FIN timer */
 		if ((fo->priv.flags | fo->pub.flags) & TFO_SIDE_FL_FIN_RX)
@@ -3194,12 +4613,9 @@ set_tcp_options(struct tfo_pkt_in *p, struct tfo_eflow *ef)
 				uint16_t nops[1] = { [0] = 0x0101 };
 
 				pkt.m = p->m;
-				pkt.iph = p->iph;
-				pkt.tcp = p->tcp;
-				pkt.ts = NULL;
-				pkt.sack = NULL;
+				pkt_set_hdrs(&pkt, p->iph, p->tcp, NULL, NULL);
 
-				pkt.tcp->cksum = update_checksum(pkt.tcp->cksum, opt, nops, sizeof(nops));
+				pkt_tcp(&pkt)->cksum = update_checksum(pkt_tcp(&pkt)->cksum, opt, nops, sizeof(nops));
 			}
 #endif
 			if ((p->tcp->tcp_flags & (RTE_TCP_ACK_FLAG | RTE_TCP_SYN_FLAG)) == (RTE_TCP_ACK_FLAG | RTE_TCP_SYN_FLAG))
@@ -3227,12 +4643,9 @@ set_tcp_options(struct tfo_pkt_in *p, struct tfo_eflow *ef)
 				uint16_t nops[5] = { [0] = 0x0101, [1] = 0x0101, [2] = 0x0101, [3] = 0x0101, [4] = 0x0101 };
 
 				pkt.m = p->m;
-				pkt.iph = p->iph;
-				pkt.tcp = p->tcp;
-				pkt.ts = NULL;
-				pkt.sack = NULL;
+				pkt_set_hdrs(&pkt, p->iph, p->tcp, NULL, NULL);
 
-				pkt.tcp->cksum = update_checksum(pkt.tcp->cksum, opt, nops, sizeof(nops));
+				pkt_tcp(&pkt)->cksum = update_checksum(pkt_tcp(&pkt)->cksum, opt, nops, sizeof(nops));
 				p->ts_opt = NULL;
 			}
 #endif
@@ -3263,26 +4676,23 @@ set_tcp_options(struct tfo_pkt_in *p, struct tfo_eflow *ef)
 	bool updated = false;
 
 	pkt.m = p->m;
-	pkt.iph = p->iph;
-	pkt.tcp = p->tcp;
-	pkt.ts = p->ts_opt;
-	pkt.sack = p->sack_opt;
+	pkt_set_hdrs(&pkt, p->iph, p->tcp, p->ts_opt, p->sack_opt);
 
 	for (int i = 0; i < opt_len / 2 - 1; i++) {
 		if (*(uint32_t *)(opt_start + 2 * i) == ((TCPOPT_NOP << 24) | (TCPOPT_NOP << 16) | (TCPOPT_NOP << 8) | TCPOPT_NOP)) {
 			update_packet_length(&pkt, opt_start + 2 * i, -4);
 			i--;
 			opt_len -= 4;
-			opt_start = (uint8_t *)pkt.tcp + sizeof(struct rte_tcp_hdr);
+			opt_start = (uint8_t *)pkt_tcp(&pkt) + sizeof(struct rte_tcp_hdr);
 			updated = true;
 		}
 	}
 
 	if (updated) {
-		p->iph = pkt.iph;
-		p->tcp = pkt.tcp;
-		p->ts_opt = pkt.ts;
-		p->sack_opt = pkt.sack;
+		p->iph = pkt_iph(&pkt);
+		p->tcp = pkt_tcp(&pkt);
+		p->ts_opt = pkt_ts(&pkt);
+		p->sack_opt = pkt_sack(&pkt);
 	}
 #endif
 
@@ -3386,6 +4796,20 @@ icwnd_from_mss(uint16_t mss)
 	return 4 * mss;
 }
 
+/* rte_mempool_avail_count() walks the cache of every lcore, and the pool can
+ * be shared with other workers, so the count is taken at most once a burst */
+static inline unsigned
+pool_avail_count(struct tcp_worker *w, const struct rte_mempool *pool)
+{
+	if (w->pool_avail_ns != now || w->pool_avail_pool != pool) {
+		w->pool_avail = rte_mempool_avail_count(pool);
+		w->pool_avail_pool = pool;
+		w->pool_avail_ns = now;
+	}
+
+	return w->pool_avail;
+}
+
 /*
  * called at SYN+ACK. decide if we'll optimize this tcp connection
  */
@@ -3396,19 +4820,17 @@ check_do_optimize(struct tcp_worker *w, const struct tfo_pkt_in *p, struct tfo_e
 	struct tfo_side *client_fo, *server_fo;
 	uint32_t rtt_us;
 
-	/* should not happen */
-	if (unlikely(list_empty(&w->f_free)) ||
-	    w->p_use >= config->p_n * 3 / 4) {
+	/* No tfo is available for the eflow, or mbufs are running out */
+	if (unlikely(!tfo_eflow_in_oflows(w, ef)) ||
+	    pool_avail_count(w, p->m->pool) < p->m->pool->size / 4) {
 		_eflow_free(w, ef, NULL);
 		return false;
 	}
 
 	/* alloc flow */
-	ef->tfo_idx = _flow_alloc(w, ef);
+	fo = ef->fo = _flow_alloc(w, ef);
 	++w->st.flow_state[TCP_STATE_STAT_OPTIMIZED];
 
-	fo = &w->f[ef->tfo_idx];
-
 	if (unlikely(p->from_priv)) {
 		/* original SYN from public */
 		client_fo = &fo->pub;
@@ -3547,6 +4969,9 @@ check_do_optimize(struct tcp_worker *w, const struct tfo_pkt_in *p, struct tfo_e
 	printf("WE WILL optimize pub s:n 0x%x:0x%x priv 0x%x:0x%x\n", fo->pub.snd_una, fo->pub.rcv_nxt, fo->priv.snd_una, fo->priv.rcv_nxt);
 #endif
 
+	build_ack_tmpl(w, ef, &fo->priv);
+	build_ack_tmpl(w, ef, &fo->pub);
+
 	return true;
 }
 
@@ -3586,7 +5011,8 @@ tfo_reset_xmit_timer(struct tfo_side *fos, bool is_tlp)
 	printf("tfo_reset_xmit_timer snd_una 0x%x%s cur_timer %u", fos->snd_una, is_tlp ? " for TLP" : "", fos->cur_timer);
 #endif
 
-	if (!(fos->pkts_in_flight || fos->pkts_queued_send)) {
+	if (!(fos->pkts_in_flight || fos->pkts_queued_send ||
+	      (fos->flags & TFO_SIDE_FL_SACK_RENEGING))) {
 		tfo_cancel_xmit_timer(fos);
 #ifdef DEBUG_RACK
 		printf("\n");
@@ -3607,6 +5033,11 @@ tfo_reset_xmit_timer(struct tfo_side *fos, bool is_tlp)
 	} else {
 		fos->cur_timer = TFO_TIMER_RTO;
 		fos->timeout = now + fos->rto_us * NSEC_PER_USEC;
+
+		/* As Linux does, give the receiver max(RTT/2, 10ms) to send
+		 * further ACKs restoring its SACK state before the RTO */
+		if (unlikely(fos->flags & TFO_SIDE_FL_SACK_RENEGING))
+			fos->timeout = min(fos->timeout, now + max(fos->srtt_us / 2, 10U * USEC_PER_MSEC) * NSEC_PER_USEC);
 	}
 
 	update_timer(fos->ef, fos->timeout);
@@ -3621,10 +5052,12 @@ send_tcp_pkt(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_b
 {
 	uint32_t new_val32[2];
 	uint16_t new_val16[1];
+	struct rte_tcp_hdr *tcp;
+	struct tcp_timestamp_option *ts;
 
 // NOTE: If we return false, an ACK might need to be sent
 	/* This should really check pkt->rack_segs_sacked, but we might be sending a TLP of a sacked packet */
-	if (!pkt->m) {
+	if (!pkt->m && !pkt_sndbuf_rebuild(w, fos, pkt)) {
 		printf("Request to send sack'd packet %p, seq 0x%x\n", pkt, pkt->seq);
 		return false;
 	}
@@ -3646,9 +5079,10 @@ send_tcp_pkt(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_b
 	}
 
 	/* Update the ack */
+	tcp = pkt_tcp(pkt);
 	new_val32[0] = rte_cpu_to_be_32(fos->rcv_nxt);
-	if (likely(pkt->tcp->recv_ack != new_val32[0])) {
-		pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, &pkt->tcp->recv_ack, new_val32, sizeof(pkt->tcp->recv_ack));
+	if (likely(tcp->recv_ack != new_val32[0])) {
+		tcp->cksum = update_checksum(tcp->cksum, &tcp->recv_ack, new_val32, sizeof(tcp->recv_ack));
 
 		/* For ts_recent updates */
 		fos->last_ack_sent = fos->rcv_nxt;
@@ -3659,7 +5093,7 @@ send_tcp_pkt(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_b
 	}
 
 	/* Update the timestamp option if in use */
-	if (pkt->ts) {
+	if ((ts = pkt_ts(pkt))) {
 		/* The following is to ensure the order of assignment to new_val32[2] is correct.
 		 * If the order is wrong it will produce a compilation error. */
 		char dummy[(int)offsetof(struct tcp_timestamp_option, ts_ecr) - (int)offsetof(struct tcp_timestamp_option, ts_val)] __attribute__((unused));
@@ -3671,7 +5105,7 @@ send_tcp_pkt(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_b
 #endif
 		new_val32[1] = fos->ts_recent;
 
-		pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, &pkt->ts->ts_val, new_val32, 2 * sizeof(pkt->ts->ts_val));
+		tcp->cksum = update_checksum(tcp->cksum, &ts->ts_val, new_val32, 2 * sizeof(ts->ts_val));
 
 #ifdef DEBUG_CHECKSUM
 		check_checksum(pkt, "After ts update");
@@ -3683,16 +5117,24 @@ send_tcp_pkt(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_b
 	check_checksum(pkt, "After sack update");
 #endif
 
-	/* Update the offered send window */
-	set_rcv_win(fos, foos);
+	/* Update the offered send window. Updating the SACK option may have
+	 * moved the TCP header. */
+	tcp = pkt_tcp(pkt);
+	set_rcv_win(w, fos, foos);
 	new_val16[0] = rte_cpu_to_be_16(fos->rcv_win);
-	if (likely(pkt->tcp->rx_win != new_val16[0])) {
-		pkt->tcp->cksum = update_checksum(pkt->tcp->cksum, &pkt->tcp->rx_win, new_val16, sizeof(pkt->tcp->rx_win));
+	if (likely(tcp->rx_win != new_val16[0])) {
+		tcp->cksum = update_checksum(tcp->cksum, &tcp->rx_win, new_val16, sizeof(tcp->rx_win));
 #ifdef DEBUG_CHECKSUM
 		check_checksum(pkt, "After rxwin update");
 #endif
 	}
 
+	/* The incremental updates above keep the checksums right if the NIC
+	 * does not calculate them. Otherwise the checksum is now set for the
+	 * NIC, since updating the SACK option may have changed the length. */
+	if ((option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD) && !pkt_has_ipv6_ext_hdrs(fos, pkt))
+		set_tx_cksum_offload(pkt->m, pkt_iph(pkt), tcp, fos->ef->flags & TFO_EF_FL_IPV6);
+
 	if (!(pkt->flags & TFO_PKT_FL_QUEUED_SEND)) {
 #ifdef DEBUG_PKT_PTRS
 		struct tfo_mbuf_priv *m_priv = get_priv_addr(pkt->m);
@@ -3704,11 +5146,10 @@ send_tcp_pkt(struct tcp_worker *w, struct tfo_pkt *pkt, struct tfo_tx_bufs *tx_b
 #endif
 
 		rte_pktmbuf_refcnt_update(pkt->m, 1);	/* so we keep it after it is sent */
-		add_tx_buf(w, pkt->m, tx_bufs, pkt->flags & TFO_PKT_FL_FROM_PRIV, pkt->iph, false);
+		add_tx_buf(w, pkt->m, tx_bufs, pkt->flags & TFO_PKT_FL_FROM_PRIV, pkt_iph(pkt), false);
 		pkt->flags |= TFO_PKT_FL_QUEUED_SEND;
 		fos->pkts_queued_send++;
-		if (list_is_queued(&pkt->send_failed_list))
-			list_del_init(&pkt->send_failed_list);
+		txq_remove_pkt(w, pkt);
 #ifdef DEBUG_SEND_PKT
 		printf("Sending packet 0x%x\n", pkt->seq);
 #endif
@@ -3902,6 +5343,10 @@ set_vlan(struct rte_mbuf* m, struct tfo_pkt_in *p)
 		buf = (uint8_t *)rte_pktmbuf_prepend(m, sizeof(struct rte_vlan_hdr));
 
 		if (unlikely(buf == NULL)) {
+			/* Appending would extend the last segment */
+			if (m->nb_segs > 1)
+				return false;
+
 			buf = (uint8_t *)rte_pktmbuf_append(m, sizeof(struct rte_vlan_hdr));
 			if (unlikely(!buf))
 				return false;
@@ -4038,6 +5483,9 @@ queue_pkt(struct tcp_worker *w, struct tfo_side *foos, struct tfo_pkt_in *p, uin
 	struct tfo_pkt *next_pkt;	/* First packet that starts after end of pkt */
 	struct tfo_pkt *pkt, *pkt_tmp;
 	struct tfo_pkt *queue_after;
+#ifdef RELEASE_SACKED_PACKETS
+	struct tfo_pkt *sacked_pkt;
+#endif
 	uint32_t seg_end;
 	uint32_t first_seq, last_seq;
 	bool pkt_needed;
@@ -4071,14 +5519,12 @@ queue_pkt(struct tcp_worker *w, struct tfo_side *foos, struct tfo_pkt_in *p, uin
 			 !after(segend(pkt), seq))
 			prev_pkt = pkt;
 		else {
-			list_for_each_entry_reverse(pkt, &foos->pktlist, list) {
-				if (before(pkt->seq, seg_end)) {
-					next_pkt = list_is_last(&pkt->list, &foos->pktlist) ? NULL : list_next_entry(pkt, list);
-					break;
-				}
-			}
+			/* There must be a packet that starts before seg_end, since
+			 * the first packet does. */
+			pkt = pkt_find_before(foos, seg_end);
+			next_pkt = list_is_last(&pkt->list, &foos->pktlist) ? NULL : list_next_entry(pkt, list);
 
-			if (!list_is_head(&pkt->list, &foos->pktlist) && after(segend(pkt), seq)) {
+			if (after(segend(pkt), seq)) {
 				last_pkt = pkt;
 				if (before(segend(last_pkt), seg_end))
 					pkt_needed = true;
@@ -4198,35 +5644,29 @@ queue_pkt(struct tcp_worker *w, struct tfo_side *foos, struct tfo_pkt_in *p, uin
 	printf("In queue_pkt, refcount %u\n", rte_mbuf_refcnt_read(p->m));
 #endif
 
-	/* bufferize this packet */
-// Re need to stop optimizing and ensure this packet is sent due to !handled
-	if (list_empty(&w->p_free))
-		return NULL;
+	/* bufferize this packet. The tfo_pkt is held in the mbuf private area,
+	 * so we can find the tfo_side and tfo_pkt from the mbuf */
+	priv = get_priv_addr(p->m);
+	pkt = &priv->pkt_store;
+	priv->fos = foos;
+	priv->pkt = pkt;
 
-	pkt = list_first_entry(&w->p_free, struct tfo_pkt, list);
-	list_del_init(&pkt->list);
 	if (++w->p_use > w->p_max_use)
 		w->p_max_use = w->p_use;
 
 	pkt->m = p->m;
 
-	/* Update the mbuf private area so we can find the tfo_side and tfo_pkt from the mbuf */
-	priv = get_priv_addr(p->m);
-	priv->fos = foos;
-	priv->pkt = pkt;
-
 	if (option_flags & TFO_CONFIG_FL_NO_VLAN_CHG)
 		p->m->ol_flags ^= config->dynflag_priv_mask;
 
 	pkt->seq = seq;
 	pkt->seglen = p->seglen;
-	pkt->iph = p->iph;
-	pkt->tcp = p->tcp;
+	buf_acct(w, foos, pkt->seglen, p->m->nb_segs);
+	pkt_set_hdrs(pkt, p->iph, p->tcp, p->ts_opt, p->sack_opt);
 	pkt->flags = p->from_priv ? TFO_PKT_FL_FROM_PRIV : 0;
 	pkt->ns = 0;
-	pkt->ts = p->ts_opt;
-	pkt->sack = p->sack_opt;
 	pkt->rack_segs_sacked = 0;
+	pkt->in_txq = false;
 	INIT_LIST_HEAD(&pkt->xmit_ts_list);
 
 	if (!queue_after) {
@@ -4240,6 +5680,7 @@ queue_pkt(struct tcp_worker *w, struct tfo_side *foos, struct tfo_pkt_in *p, uin
 		printf("Adding packet not at head");
 #endif
 
+#ifdef RELEASE_SACKED_PACKETS
 		/* We have to keep the last mbuf even if it has been sacked,
 		 * in order to be able to send a tail loss probe. If we are
 		 * now adding a packet to the end of the queue and the previous
@@ -4255,20 +5696,25 @@ queue_pkt(struct tcp_worker *w, struct tfo_side *foos, struct tfo_pkt_in *p, uin
 				if (!after(segend(pkt), foos->snd_una + (foos->snd_win << foos->snd_win_shift))) {
 					/* We will send the new packet - remove the old last pkt */
 					remove_pkt_from_tx_bufs(queue_after, tx_bufs, foos);
-					pkt_free_mbuf(queue_after, foos, tx_bufs);
+					queue_after = pkt_free_mbuf(w, queue_after, foos, tx_bufs);
 				} else {
 					/* We will have to send the original TLP, but
 					 * we don't want to keep it queued. Decrement its
 					 * refcnt, and remove the pointer to it. */
-					rte_pktmbuf_refcnt_update(queue_after->m, -1);
-					queue_after->m = NULL;
+					sacked_pkt = pkt_detach_mbuf(w, foos, queue_after);
+					if (sacked_pkt != queue_after) {
+						rte_pktmbuf_refcnt_update(queue_after->m, -1);
+						queue_after = sacked_pkt;
+					}
 				}
 			} else
-				pkt_free_mbuf(queue_after, foos, tx_bufs);
+				queue_after = pkt_free_mbuf(w, queue_after, foos, tx_bufs);
 		}
+#endif
 
 		list_add(&pkt->list, &queue_after->list);
 	}
+	pkt_tree_insert(foos, pkt);
 
 	foos->pktcount++;
 
@@ -4311,9 +5757,9 @@ do_clear_optimize(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_tx_bufs
 	ef->state = TCP_STATE_CLEAR_OPTIMIZE;
 	--w->st.flow_state[TCP_STATE_STAT_OPTIMIZED];
 
-	fo = &w->f[ef->tfo_idx];
+	fo = ef->fo;
 
-	if (ef->tfo_idx != TFO_IDX_UNUSED) {
+	if (ef->fo) {
 		/* Remove any buffered packets that we haven't ack'd */
 		s = &fo->priv;
 		rcv_nxt = fo->pub.rcv_nxt;
@@ -4336,7 +5782,7 @@ do_clear_optimize(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_tx_bufs
 		}
 	}
 
-	if (ef->tfo_idx == TFO_IDX_UNUSED ||
+	if (!ef->fo ||
 	    (list_empty(&fo->priv.pktlist) &&
 	     list_empty(&fo->pub.pktlist))) {
 		_eflow_free(w, ef, tx_bufs);
@@ -4380,7 +5826,7 @@ print_tx_bufs(struct tfo_tx_bufs *tx_bufs)
 									       "\n",
 			   tx_bufs->m[buf],
 			   rte_mbuf_refcnt_read(tx_bufs->m[buf]),
-			   ack_bit_is_set(tx_bufs, buf),
+			   discard_after_send(tx_bufs, buf),
 			   tx_bufs->m[buf]->pool->name
 #ifdef DEBUG_MBUF_COOKIES
 			   , rte_mempool_get_header(tx_bufs->m[buf])->cookie
@@ -4393,7 +5839,7 @@ print_tx_bufs(struct tfo_tx_bufs *tx_bufs)
 static void
 update_sack_for_seq(struct tfo_side *fos, struct tfo_pkt *pkt, struct tfo_side *foos)
 {
-	struct tfo_pkt *begin, *end, *next;
+	struct tfo_pkt *begin, *end;
 	uint32_t left, right;
 	uint8_t entry, last_entry, next_entry;
 
@@ -4408,24 +5854,18 @@ update_sack_for_seq(struct tfo_side *fos, struct tfo_pkt *pkt, struct tfo_side *
 	dump_sack_entries(foos);
 #endif
 
-	/* Find the contiguous block start and end, but only if this
-	 * packet is after rcv_nxt. */
+	/* Find the contiguous block start and end from the holes recorded
+	 * on the pkt_tree, but only if this packet is after rcv_nxt. */
 	if (after(pkt->seq, foos->rcv_nxt)) {
-		next = pkt;
-		begin = pkt;
-		list_for_each_entry_continue_reverse(next, &fos->pktlist, list) {
-			if (before(segend(next), begin->seq))
-				break;
-			begin = next;
-		}
+		begin = pkt_find_gap_before(fos->pkt_tree.rb_node, pkt->seq);
+		if (begin)
+			begin = list_next_entry(begin, list);
+		else
+			begin = list_first_entry(&fos->pktlist, struct tfo_pkt, list);
 
-		next = pkt;
-		end = pkt;
-		list_for_each_entry_continue(next, &fos->pktlist, list) {
-			if (before(segend(end), next->seq))
-				break;
-			end = next;
-		}
+		end = pkt_find_gap_from(fos->pkt_tree.rb_node, pkt->seq);
+		if (!end)
+			end = list_last_entry(&fos->pktlist, struct tfo_pkt, list);
 
 		left = begin->seq;
 		right = segend(end);
@@ -4681,23 +6121,52 @@ update_rto_ts(struct tfo_side *fos, time_ns_t pkt_ns, uint32_t pkts_ackd)
 	fos->flags |= TFO_SIDE_FL_NEW_RTT;
 }
 
+/* *new_pkt, which has no mbuf, takes over the mbuf of *old_pkt. Since a
+ * tfo_pkt with an mbuf is held in the mbuf's private area, the packets'
+ * details are swapped instead, and so are the pointers. The two packets must
+ * be adjacent on the pktlist, and *old_pkt is then expected to be freed.
+ * gap_after and sub_gap belong to the position on the pkt_tree, and so are
+ * not swapped; pkt_free() of *old_pkt updates them. */
 static inline void
-move_mbuf(struct tfo_pkt *new_pkt, struct tfo_pkt *old_pkt)
+move_mbuf(struct tfo_pkt **new_pkt, struct tfo_pkt **old_pkt)
 {
-	new_pkt->m = old_pkt->m;
-	new_pkt->iph = old_pkt->iph;
-	new_pkt->tcp = old_pkt->tcp;
-	new_pkt->ts = old_pkt->ts;
-	new_pkt->sack = old_pkt->sack;
-	old_pkt->m = NULL;
-	((struct tfo_mbuf_priv *)rte_mbuf_to_priv(new_pkt->m))->pkt = new_pkt;
+	struct tfo_pkt *no_mbuf_pkt = *new_pkt;
+	struct tfo_pkt *mbuf_pkt = *old_pkt;
+	struct tfo_pkt tmp = *no_mbuf_pkt;
 
+	no_mbuf_pkt->seq = mbuf_pkt->seq;
+	no_mbuf_pkt->seglen = mbuf_pkt->seglen;
+	no_mbuf_pkt->ns = mbuf_pkt->ns;
+	no_mbuf_pkt->flags = mbuf_pkt->flags;
+	no_mbuf_pkt->rack_segs_sacked = mbuf_pkt->rack_segs_sacked;
+
+	mbuf_pkt->seq = tmp.seq;
+	mbuf_pkt->seglen = tmp.seglen;
+	mbuf_pkt->ns = tmp.ns;
+	mbuf_pkt->flags = tmp.flags;
+	mbuf_pkt->rack_segs_sacked = tmp.rack_segs_sacked;
+
+	*new_pkt = mbuf_pkt;
+	*old_pkt = no_mbuf_pkt;
+}
+
+#ifdef RELEASE_SACKED_PACKETS
+/* Whether a SACK'd packet can be resent if the receiver reneges on the SACK.
+ * Such packets are not merged into blocks of SACK'd packets. */
+static inline bool
+sacked_pkt_resendable(const struct tfo_side *fos, const struct tfo_pkt *pkt)
+{
+	return pkt->rack_segs_sacked <= 1 &&
+	       (pkt->m || sndbuf_holds(&fos->sndbuf, pkt->seq, pkt->seglen));
 }
+#endif
 
 static inline void
 rack_remove_acked_sacked_packet(struct tcp_worker *w, struct tfo_side *fos, struct tfo_pkt *pkt, uint32_t ack, struct tfo_tx_bufs *tx_bufs)
 {
+#ifdef RELEASE_SACKED_PACKETS
 	struct tfo_pkt *sack_pkt, *next_pkt;
+#endif
 
 	/* Remove packets marked after the new ack */
 	if (!after(segend(pkt), ack)) {
@@ -4709,6 +6178,15 @@ rack_remove_acked_sacked_packet(struct tcp_worker *w, struct tfo_side *fos, stru
 		return;
 	}
 
+#ifndef RELEASE_SACKED_PACKETS
+	/* The packet is kept in case the receiver reneges on the SACK */
+	pkt_not_in_flight(pkt, fos, tx_bufs);
+	pkt->rack_segs_sacked = 1;
+	pkt->flags &= ~(TFO_PKT_FL_SACKED | TFO_PKT_FL_LOST);
+#ifdef DEBUG_SACK_RX
+	printf("sack pkt now 0x%x, len %u\n", pkt->seq, pkt->seglen);
+#endif
+#else
 	if (!list_is_first(&pkt->list, &fos->pktlist) &&
 	    list_prev_entry(pkt, list)->rack_segs_sacked) {
 		sack_pkt = list_prev_entry(pkt, list);
@@ -4721,10 +6199,14 @@ rack_remove_acked_sacked_packet(struct tcp_worker *w, struct tfo_side *fos, stru
 	/* We have to keep the last packet in case needed for
 	 * a TLP. */
 	if (!list_is_last(&pkt->list, &fos->pktlist))
-		pkt_free_mbuf(pkt, fos, tx_bufs);
+		pkt = pkt_free_mbuf(w, pkt, fos, tx_bufs);
 	else
 		pkt_not_in_flight(pkt, fos, tx_bufs);
 
+	if (sack_pkt &&
+	    (sacked_pkt_resendable(fos, sack_pkt) || sacked_pkt_resendable(fos, pkt)))
+		sack_pkt = NULL;
+
 	/* This is being sack'd for the first time, and it can't be lost any more */
 	pkt->rack_segs_sacked = 1;
 	pkt->flags &= ~(TFO_PKT_FL_SACKED | TFO_PKT_FL_LOST);
@@ -4736,9 +6218,10 @@ rack_remove_acked_sacked_packet(struct tcp_worker *w, struct tfo_side *fos, stru
 		sack_pkt = pkt;
 	} else {
 		sack_pkt->rack_segs_sacked += pkt->rack_segs_sacked;
+		buf_acct(w, fos, segend(pkt) - segend(sack_pkt), 0);
 		sack_pkt->seglen = segend(pkt) - sack_pkt->seq;
-		if (pkt->m)
-			move_mbuf(sack_pkt, pkt);
+		if (pkt->m && !sack_pkt->m)
+			move_mbuf(&sack_pkt, &pkt);
 
 		/* We want the earliest anything in the block was sent */
 		if (sack_pkt->ns > pkt->ns)
@@ -4761,11 +6244,14 @@ rack_remove_acked_sacked_packet(struct tcp_worker *w, struct tfo_side *fos, stru
 	if (!list_is_last(&sack_pkt->list, &fos->pktlist)) {
 		next_pkt = list_next_entry(sack_pkt, list);
 		if (next_pkt->rack_segs_sacked &&
-		    !before(segend(sack_pkt), next_pkt->seq)) {
+		    !before(segend(sack_pkt), next_pkt->seq) &&
+		    !sacked_pkt_resendable(fos, sack_pkt) &&
+		    !sacked_pkt_resendable(fos, next_pkt)) {
+			buf_acct(w, fos, segend(next_pkt) - segend(sack_pkt), 0);
 			sack_pkt->seglen = segend(next_pkt) - sack_pkt->seq;
 			sack_pkt->rack_segs_sacked += next_pkt->rack_segs_sacked;
-			if (next_pkt->m)
-				move_mbuf(sack_pkt, next_pkt);
+			if (next_pkt->m && !sack_pkt->m)
+				move_mbuf(&sack_pkt, &next_pkt);
 			next_pkt->rack_segs_sacked = 0;
 
 			/* We want the earliest anything in the block was sent */
@@ -4775,6 +6261,7 @@ rack_remove_acked_sacked_packet(struct tcp_worker *w, struct tfo_side *fos, stru
 			pkt_free(w, fos, next_pkt, tx_bufs);
 		}
 	}
+#endif
 }
 
 static void
@@ -4809,9 +6296,10 @@ update_most_recent_pkt(struct tfo_pkt *pkt, struct tfo_side *fos, struct tfo_pkt
 		return;
 
 	if (pkt->flags & TFO_PKT_FL_RESENT) {
-		if (using_ts) {
+		/* A packet in the send buffer has no timestamp */
+		if (using_ts && pkt_ts(pkt)) {
 			/* RFC8985 Step 2 point 1 */
-			if (after(rte_be_to_cpu_32(pkt->ts->ts_val), ack_ts_ecr))
+			if (after(rte_be_to_cpu_32(pkt_ts(pkt)->ts_val), ack_ts_ecr))
 				return;
 		}
 
@@ -4823,6 +6311,19 @@ update_most_recent_pkt(struct tfo_pkt *pkt, struct tfo_side *fos, struct tfo_pkt
 	*most_recent_pkt = pkt;
 }
 
+/* RFC8985 Step 3. This is called by rack_update() for each packet as it is
+ * marked ACK'd or SACK'd, which is in seq order. */
+static inline void
+rack_detect_reordering(struct tfo_side *fos, const struct tfo_pkt *pkt)
+{
+	if (after(segend(pkt), fos->rack_fack))
+		fos->rack_fack = segend(pkt);
+	else if (before(segend(pkt), fos->rack_fack) &&
+		 !(pkt->flags & TFO_PKT_FL_RESENT))
+		fos->flags |= TFO_SIDE_FL_RACK_REORDERING_SEEN;
+}
+
+/* Returns the number of packets newly SACK'd */
 static inline uint32_t
 rack_update(struct tfo_pkt_in *p, struct tfo_side *fos)
 {
@@ -4830,13 +6331,11 @@ rack_update(struct tfo_pkt_in *p, struct tfo_side *fos)
 	struct tfo_pkt *most_recent_pkt = NULL;
 	uint32_t ack_ts_ecr;
 	struct tfo_pkt *pkt;
-	struct tfo_pkt *first_not_acked_pkt;
 	uint32_t pkts_ackd = 0;
+	uint32_t pkts_sacked = 0;
 	bool using_ts;
-	uint32_t max_segend;
 
 	ack = rte_be_to_cpu_32(p->tcp->recv_ack);
-	max_segend = ack;
 
 	if (p->ts_opt) {
 		ack_ts_ecr = rte_be_to_cpu_32(p->ts_opt->ts_ecr);
@@ -4852,6 +6351,7 @@ rack_update(struct tfo_pkt_in *p, struct tfo_side *fos)
 			break;
 
 		pkt->flags |= TFO_PKT_FL_ACKED;
+		rack_detect_reordering(fos, pkt);
 
 		if (pkt->rack_segs_sacked)
 			continue;
@@ -4866,12 +6366,13 @@ rack_update(struct tfo_pkt_in *p, struct tfo_side *fos)
 			fos->flags &= ~TFO_SIDE_FL_RTT_CALC_IN_PROGRESS;
 		}
 	}
-	first_not_acked_pkt = pkt;
 
 //	if (after(ack, fos->snd_una))
 //		fos->snd_una = ack;
 
-	/* Mark all sack'd packets as sacked */
+	/* Mark all sack'd packets as sacked. The pkt_tree is used to find the
+	 * first packet of each SACK block, so only the packets within the
+	 * blocks are looked at. */
 	if (p->sack_opt) {
 		uint32_t sack_blocks[MAX_SACK_ENTRIES][2];
 		uint8_t sack_idx[MAX_SACK_ENTRIES];
@@ -4937,72 +6438,67 @@ rack_update(struct tfo_pkt_in *p, struct tfo_side *fos)
 			printf("\n");
 #endif
 
-			left_edge = sack_blocks[sack_idx[0]][0];
-			right_edge = sack_blocks[sack_idx[0]][1];
-			i = 0;
-#ifdef DEBUG_SACK_RX
-			printf("  %u: 0x%x -> 0x%x\n", sack_idx[i], left_edge, right_edge);
-#endif
-			pkt = first_not_acked_pkt;
-			list_for_each_entry_from(pkt, &fos->pktlist, list) {
-				/* Check if we need to move on to the next sack block */
-				while (after(segend(pkt), right_edge)) {
+			for (i = 0; i < num_sack_blocks; i++) {
+				left_edge = sack_blocks[sack_idx[i]][0];
+				right_edge = sack_blocks[sack_idx[i]][1];
 #ifdef DEBUG_SACK_RX
-					printf("     0x%x + %u (0x%x) after window\n",
-						pkt->seq, pkt->seglen, segend(pkt));
+				printf("  %u: 0x%x -> 0x%x\n", sack_idx[i], left_edge, right_edge);
 #endif
-					if (++i == num_sack_blocks)
-						break;
 
-					left_edge = sack_blocks[sack_idx[i]][0];
-					right_edge = sack_blocks[sack_idx[i]][1];
+				pkt = pkt_find_before(fos, left_edge);
+				if (pkt)
+					pkt = list_next_entry(pkt, list);
+				else
+					pkt = list_first_entry(&fos->pktlist, struct tfo_pkt, list);
+
+				list_for_each_entry_from(pkt, &fos->pktlist, list) {
+					if (after(segend(pkt), right_edge)) {
 #ifdef DEBUG_SACK_RX
-					printf("  %u: 0x%x -> 0x%x\n", sack_idx[i], left_edge, right_edge);
+						printf("     0x%x + %u (0x%x) after window\n",
+							pkt->seq, pkt->seglen, segend(pkt));
 #endif
-				}
-
-				if (i == num_sack_blocks)
-					break;
+						break;
+					}
 
-				if (pkt->rack_segs_sacked) {
+					if (pkt->rack_segs_sacked) {
 #ifdef DEBUG_SACK_RX
-					if (!before(pkt->seq, left_edge))
 						printf("     0x%x + %u (0x%x) already SACK'd in window\n",
 							pkt->seq, pkt->seglen, segend(pkt));
 #endif
-					continue;
-				}
+						continue;
+					}
 
-				/* It shouldn't be possible to have the SACKED flag set here */
-				if (before(pkt->seq, left_edge) ||
-				    (pkt->flags & (TFO_PKT_FL_ACKED | TFO_PKT_FL_SACKED)))
-					continue;
+					/* It shouldn't be possible to have the SACKED flag set here,
+					 * unless SACK blocks overlap */
+					if (pkt->flags & (TFO_PKT_FL_ACKED | TFO_PKT_FL_SACKED))
+						continue;
 
 #ifdef DEBUG_SACK_RX
-				printf("     0x%x + %u (0x%x) in window\n",
-					pkt->seq, pkt->seglen, segend(pkt));
+					printf("     0x%x + %u (0x%x) in window\n",
+						pkt->seq, pkt->seglen, segend(pkt));
 #endif
 
-				fos->rack_segs_sacked++;
+					fos->rack_segs_sacked++;
 #ifdef DEBUG_RACK_SACKED
-				printf("  fos->rack_segs_sacked for 0x%x incremented to %u\n", pkt->seq, fos->rack_segs_sacked);
+					printf("  fos->rack_segs_sacked for 0x%x incremented to %u\n", pkt->seq, fos->rack_segs_sacked);
 #endif
 
-				/* This is being "ack'd" for the first time */
-				pkt->flags |= TFO_PKT_FL_SACKED;
+					/* This is being "ack'd" for the first time */
+					pkt->flags |= TFO_PKT_FL_SACKED;
 
-				update_most_recent_pkt(pkt, fos, &most_recent_pkt, using_ts, ack_ts_ecr);
+					update_most_recent_pkt(pkt, fos, &most_recent_pkt, using_ts, ack_ts_ecr);
 
-				if (pkt->flags & TFO_PKT_FL_RTT_CALC) {
-					update_rto(fos, pkt->ns);
-					pkt->flags &= ~TFO_PKT_FL_RTT_CALC;
-					fos->flags &= ~TFO_SIDE_FL_RTT_CALC_IN_PROGRESS;
-				}
+					if (pkt->flags & TFO_PKT_FL_RTT_CALC) {
+						update_rto(fos, pkt->ns);
+						pkt->flags &= ~TFO_PKT_FL_RTT_CALC;
+						fos->flags &= ~TFO_SIDE_FL_RTT_CALC_IN_PROGRESS;
+					}
 
-				if (after(segend(pkt), max_segend))
-					max_segend = segend(pkt);
+					rack_detect_reordering(fos, pkt);
 
-				pkts_ackd++;
+					pkts_ackd++;
+					pkts_sacked++;
+				}
 			}
 		}
 	}
@@ -5035,28 +6531,7 @@ rack_update(struct tfo_pkt_in *p, struct tfo_side *fos)
 		}
 	}
 
-	return max_segend;
-}
-
-/* RFC8985 Step 3 */
-static inline void
-rack_detect_reordering(struct tfo_side *fos, uint32_t max_segend)
-{
-	struct tfo_pkt *pkt;
-
-	list_for_each_entry(pkt, &fos->pktlist, list) {
-		if (after(segend(pkt), max_segend))
-			break;
-
-		if (!(pkt->flags & (TFO_PKT_FL_ACKED | TFO_PKT_FL_SACKED)))
-			continue;
-
-		if (after(segend(pkt), fos->rack_fack))
-			fos->rack_fack = segend(pkt);
-		else if (before(segend(pkt), fos->rack_fack) &&
-			 !(pkt->flags & TFO_PKT_FL_RESENT))
-			fos->flags |= TFO_SIDE_FL_RACK_REORDERING_SEEN;
-	}
+	return pkts_sacked;
 }
 
 /* RFC8985 Step 4 */
@@ -5108,7 +6583,7 @@ mark_packet_lost(struct tfo_pkt *pkt, struct tfo_side *fos)
 
 /* RFC8985 Step 5 */
 static time_ns_t
-rack_detect_loss(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, struct tfo_tx_bufs *tx_bufs)
+rack_detect_loss(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, uint32_t sacked_pkts, struct tfo_tx_bufs *tx_bufs)
 {
 #ifndef DETECT_LOSS_MIN
 	time_ns_t timeout = 0;
@@ -5159,6 +6634,9 @@ rack_detect_loss(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, struc
 			pkt_after_next = list_is_head(&pkt_tmp->xmit_ts_list, &fos->xmit_ts_list)
 					   ? pkt_tmp : list_next_entry(pkt_tmp, xmit_ts_list);
 
+			if (pkt->flags & TFO_PKT_FL_SACKED)
+				sacked_pkts--;
+
 			rack_remove_acked_sacked_packet(w, fos, pkt, ack, tx_bufs);
 
 			/* If the prev of pkt_after_next is no longer pkt_tmp, then
@@ -5171,6 +6649,14 @@ rack_detect_loss(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, struc
 			continue;
 		}
 
+		/* The packets up to last_sent are in order of the time they were
+		 * sent, and only lost packets follow. Once a packet is sent after
+		 * RACK.xmit_ts, or is lost, no further packets can be newly lost,
+		 * so unless there are SACK'd packets still to be removed, stop. */
+		if (!sacked_pkts &&
+		    ((pkt->flags & TFO_PKT_FL_LOST) || pkt->ns > fos->rack_xmit_ts))
+			break;
+
 #ifdef DEBUG_RACK_LOSS
 		printf("  rack_xmit_ts " NSEC_TIME_PRINT_FORMAT " pkt->ns " NSEC_TIME_PRINT_FORMAT " seq 0x%x rack_end_seq 0x%x segend 0x%x\n",
 		       NSEC_TIME_PRINT_PARAMS(fos->rack_xmit_ts), NSEC_TIME_PRINT_PARAMS(pkt->ns),
@@ -5250,11 +6736,11 @@ rack_detect_loss(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, struc
 }
 
 static bool
-rack_detect_loss_and_arm_timer(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, struct tfo_tx_bufs *tx_bufs)
+rack_detect_loss_and_arm_timer(struct tcp_worker *w, struct tfo_side *fos, uint32_t ack, uint32_t sacked_pkts, struct tfo_tx_bufs *tx_bufs)
 {
 	time_ns_t timeout;
 
-	timeout = rack_detect_loss(w, fos, ack, tx_bufs);
+	timeout = rack_detect_loss(w, fos, ack, sacked_pkts, tx_bufs);
 
 	if (timeout) {
 		tfo_reset_timer_ns(fos, TFO_TIMER_REO, timeout);
@@ -5264,13 +6750,40 @@ rack_detect_loss_and_arm_timer(struct tcp_worker *w, struct tfo_side *fos, uint3
 	return false;
 }
 
+/* If, once the ACK'd packets have been removed, the first remaining packet has
+ * been SACK'd and the ACK points at it, the receiver has discarded data that it
+ * SACK'd (RFC2018 section 8, RFC8985 section 6.2 note). The RTO timer is then
+ * set short, and if the receiver does not SACK the data again, RTO recovery
+ * resends it (see rack_sack_reneged()). */
+static inline void
+rack_check_sack_reneging(struct tfo_side *fos, uint32_t ack)
+{
+	struct tfo_pkt *pkt;
+
+	if (!after(ack, fos->snd_una))
+		return;
+
+	fos->flags &= ~TFO_SIDE_FL_SACK_RENEGING;
+
+	if (list_empty(&fos->pktlist))
+		return;
+
+	pkt = list_first_entry(&fos->pktlist, struct tfo_pkt, list);
+	if (pkt->rack_segs_sacked && !after(pkt->seq, ack)) {
+		fos->flags |= TFO_SIDE_FL_SACK_RENEGING;
+#ifdef DEBUG_SACK_RX
+		printf("SACK reneging detected, ack 0x%x sacked pkt 0x%x\n", ack, pkt->seq);
+#endif
+	}
+}
+
 static void
 do_rack(struct tfo_pkt_in *p, uint32_t ack, struct tcp_worker *w, struct tfo_side *fos, struct tfo_side *foos, struct tfo_tx_bufs *tx_bufs)
 {
 	uint32_t pre_in_flight;
-	uint32_t max_segend;
+	uint32_t sacked_pkts;
 
-	max_segend = rack_update(p, fos);
+	sacked_pkts = rack_update(p, fos);
 
 	if (fos->flags & TFO_SIDE_FL_IN_RECOVERY &&
 	    !before(ack, fos->recovery_end_seq)) {	// Alternative is fos->rack_segs_sacked == 0
@@ -5280,10 +6793,9 @@ do_rack(struct tfo_pkt_in *p, uint32_t ack, struct tcp_worker *w, struct tfo_sid
 		fos->flags |= TFO_SIDE_FL_ENDING_RECOVERY;
 	}
 
-	rack_detect_reordering(fos, max_segend);
-
 	pre_in_flight = fos->pkts_in_flight;
-	rack_detect_loss_and_arm_timer(w, fos, ack, tx_bufs);
+	rack_detect_loss_and_arm_timer(w, fos, ack, sacked_pkts, tx_bufs);
+	rack_check_sack_reneging(fos, ack);
 
 #ifdef DEBUG_IN_FLIGHT
 	printf("do_rack() pre_in_flight %u fos->pkts_in_flight %u\n", pre_in_flight, fos->pkts_in_flight);
@@ -5349,19 +6861,66 @@ rack_mark_losses_on_rto(struct tfo_side *fos)
 		fos->flags &= ~(TFO_SIDE_FL_TLP_IN_PROGRESS | TFO_SIDE_FL_TLP_IS_RETRANS);
 		fos->recovery_end_seq = fos->snd_nxt;
 
-#ifdef DEBUG_RECOVERY
-		printf("Entering RTO recovery, end 0x%x\n", fos->recovery_end_seq);
-#endif
+#ifdef DEBUG_RECOVERY
+		printf("Entering RTO recovery, end 0x%x\n", fos->recovery_end_seq);
+#endif
+	}
+
+	/* RFC 6298 5.5 */
+	fos->rto_us *= 2;
+	if (fos->rto_us > TFO_TCP_RTO_MAX_MS * USEC_PER_MSEC) {
+#ifdef DEBUG_RTO
+		printf("rto fos resend after RTO double %u - reducing to %u\n", fos->rto_us, TFO_TCP_RTO_MAX_MS * USEC_PER_MSEC);
+#endif
+		fos->rto_us = TFO_TCP_RTO_MAX_MS * USEC_PER_MSEC;
+	}
+}
+
+/* The receiver has reneged on SACKs (see rack_check_sack_reneging()). Clear
+ * the SACK state, and mark all the SACK'd packets lost so that they are
+ * resent. A released SACK'd packet is resent from the send buffer, and the
+ * last packet still has its mbuf. If the data of any SACK'd packet is no
+ * longer held, resending is not possible, and false is returned. */
+static bool
+rack_sack_reneged(struct tfo_side *fos)
+{
+	struct tfo_pkt *pkt;
+
+	fos->flags &= ~TFO_SIDE_FL_SACK_RENEGING;
+
+#ifdef RELEASE_SACKED_PACKETS
+	list_for_each_entry(pkt, &fos->pktlist, list) {
+		if (pkt->rack_segs_sacked && !sacked_pkt_resendable(fos, pkt)) {
+			++worker.st.sack_reneging_rst;
+			return false;
+		}
+	}
+#endif
+
+	++worker.st.sack_reneging_resend;
+
+	list_for_each_entry(pkt, &fos->pktlist, list) {
+		if (!pkt->rack_segs_sacked)
+			continue;
+
+		fos->rack_segs_sacked -= pkt->rack_segs_sacked;
+		pkt->rack_segs_sacked = 0;
+
+		if (list_is_queued(&pkt->xmit_ts_list)) {
+			if (!(pkt->flags & TFO_PKT_FL_LOST))
+				mark_packet_lost(pkt, fos);
+		} else {
+			pkt->flags |= TFO_PKT_FL_LOST;
+			pkt->ns = TFO_TS_NONE;
+			list_add_tail(&pkt->xmit_ts_list, &fos->xmit_ts_list);
+		}
 	}
 
-	/* RFC 6298 5.5 */
-	fos->rto_us *= 2;
-	if (fos->rto_us > TFO_TCP_RTO_MAX_MS * USEC_PER_MSEC) {
-#ifdef DEBUG_RTO
-		printf("rto fos resend after RTO double %u - reducing to %u\n", fos->rto_us, TFO_TCP_RTO_MAX_MS * USEC_PER_MSEC);
+#ifdef DEBUG_RACK_SACKED
+	printf("rack_sack_reneged fos->rack_segs_sacked now %u\n", fos->rack_segs_sacked);
 #endif
-		fos->rto_us = TFO_TCP_RTO_MAX_MS * USEC_PER_MSEC;
-	}
+
+	return true;
 }
 
 static void
@@ -5440,7 +6999,7 @@ handle_rack_tlp_timeout(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_s
 
 	switch(fos->cur_timer) {
 	case TFO_TIMER_REO:
-		set_timer = rack_detect_loss_and_arm_timer(w, fos, fos->snd_una, tx_bufs);
+		set_timer = rack_detect_loss_and_arm_timer(w, fos, fos->snd_una, 0, tx_bufs);
 		break;
 	case TFO_TIMER_PTO:
 // Must use RTO now. tlp_send_probe() can set timer - do we handle that properly?
@@ -5449,7 +7008,17 @@ handle_rack_tlp_timeout(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_s
 	case TFO_TIMER_RTO:
 		if (unlikely(!using_rack(ef)))
 			handle_rto(w, fos, foos, tx_bufs);
-		else
+		else if (unlikely(fos->flags & TFO_SIDE_FL_SACK_RENEGING) &&
+			 !rack_sack_reneged(fos)) {
+			/* The SACK'd data has been released, so the connection can't continue */
+			generate_rst(w, ef, fos, foos, tx_bufs);
+			generate_rst(w, ef, foos, fos, tx_bufs);
+
+			/* We need to allow this timer run to complete before freeing the eflow */
+			tfo_reset_timer(fos, TFO_TIMER_SHUTDOWN, 0);
+
+			return false;
+		} else
 			rack_mark_losses_on_rto(fos);
 		break;
 	case TFO_TIMER_ZERO_WINDOW:
@@ -5477,6 +7046,52 @@ handle_rack_tlp_timeout(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_s
 	return false;
 }
 
+/* Send the packets of foos that have not been sent and are within the send
+ * window. keep_m, if set, is the mbuf of the packet being processed, which
+ * must not be merged into another packet. */
+static void
+send_unsent_pkts(struct tcp_worker *w, struct tfo_side *foos, struct tfo_side *fos, uint32_t win_end,
+		 const struct rte_mbuf *keep_m, struct tfo_tx_bufs *tx_bufs)
+{
+	struct tfo_pkt *pkt;
+	uint32_t snd_nxt;
+
+// Optimise this - ? point to last_sent ??
+	list_for_each_entry(pkt, &foos->pktlist, list) {
+#ifdef DEBUG_TCP_WINDOW
+		if (pkt->m)
+			printf("  pkt->seq 0x%x, flags 0x%x pkt->seglen %u tcp flags 0x%x foos->snd_nxt 0x%x\n",
+				pkt->seq, pkt->flags, pkt->seglen, (unsigned)((pkt_tcp(pkt)->data_off << 8) | pkt_tcp(pkt)->tcp_flags) & 0xfff, foos->snd_nxt);
+#endif
+
+		if ((option_flags & TFO_CONFIG_FL_RESEGMENT))
+			pkt_resegment(w, foos, pkt, win_end, keep_m, tx_bufs);
+
+		if (after(segend(pkt), win_end))
+			break;
+		if (!(pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_QUEUED_SEND))) {
+			snd_nxt = segend(pkt);
+			if (after(snd_nxt, foos->snd_nxt)) {
+#ifdef DEBUG_TCP_WINDOW
+				printf("Sending queued packet %p, updating foos->snd_nxt from 0x%x to 0x%x\n",
+					pkt->m, foos->snd_nxt, snd_nxt);
+#endif
+				foos->snd_nxt = snd_nxt;
+			}
+#ifdef DEBUG_TCP_WINDOW
+			else
+				printf("Sending queued packet %p, not updating foos->snd_nxt from 0x%x to 0x%x\n",
+					pkt->m, foos->snd_nxt, snd_nxt);
+#endif
+
+#ifdef DEBUG_SEND_PKT_LOCATION
+			printf("send_tcp_pkt K\n");
+#endif
+			send_tcp_pkt(w, pkt, tx_bufs, foos, fos, false);
+		}
+	}
+}
+
 // *** Note: We may need to do more checking about whether the packet is just an ACK or has payload.
 // *** Also check PSH isn't set if have no payload. Also URG.
 // *** There is not below about an ACK (no payload) with the SEQ indicating missing packets.
@@ -5494,9 +7109,7 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 	uint32_t seq;
 	uint32_t ack;
 	enum seq_status seq_ok;
-	uint32_t snd_nxt;
 	uint32_t win_end;
-	uint32_t nxt_exp;
 	struct rte_tcp_hdr* tcp = p->tcp;
 	bool rcv_nxt_updated = false;
 	bool free_mbuf = false;
@@ -5517,12 +7130,12 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 	uint32_t ts_diff;
 
 
-	if (ef->tfo_idx == TFO_IDX_UNUSED) {
+	if (!ef->fo) {
 		printf("tfo_handle_pkt called without flow\n");
 		return TFO_PKT_FORWARD;
 	}
 
-	fo = &w->f[ef->tfo_idx];
+	fo = ef->fo;
 
 	if (p->from_priv) {
 		fos = &fo->priv;
@@ -5807,13 +7420,13 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 					break;
 
 				/* The packet hasn't been ack'd before */
-				if (pkt->ts) {
-					if (pkt->ts->ts_val == p->ts_opt->ts_ecr &&
+				if (pkt_ts(pkt)) {
+					if (pkt_ts(pkt)->ts_val == p->ts_opt->ts_ecr &&
 					    pkt->ns > newest_send_time)
 						newest_send_time = pkt->ns;
 #ifdef DEBUG_RTO
-					else if (pkt->ts->ts_val != p->ts_opt->ts_ecr)
-						printf("tsecr 0x%x != tsval 0x%x\n", rte_be_to_cpu_32(p->ts_opt->ts_ecr), rte_be_to_cpu_32(pkt->ts->ts_val));
+					else if (pkt_ts(pkt)->ts_val != p->ts_opt->ts_ecr)
+						printf("tsecr 0x%x != tsval 0x%x\n", rte_be_to_cpu_32(p->ts_opt->ts_ecr), rte_be_to_cpu_32(pkt_ts(pkt)->ts_val));
 #endif
 					pkts_ackd++;
 				} else {
@@ -5967,7 +7580,7 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 	new_snd_win = get_snd_win_end(fos);
 	if (after(new_snd_win, old_snd_win)) {
 		/* Can we open up the send window for the other side? */
-		if (set_rcv_win(foos, fos))
+		if (set_rcv_win(w, foos, fos))
 			foos_send_ack = true;
 
 		/* Can we send more packets? */
@@ -5980,6 +7593,9 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 			}
 
 			list_for_each_entry_continue(pkt, &fos->pktlist, list) {
+				if ((option_flags & TFO_CONFIG_FL_RESEGMENT))
+					pkt_resegment(w, fos, pkt, new_snd_win, p->m, tx_bufs);
+
 				if (after(segend(pkt), new_snd_win))
 					break;	/* beyond window */
 
@@ -6205,22 +7821,15 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 #endif
 
 			if (rcv_nxt_updated) {
-				nxt_exp = segend(queued_pkt);
-				fos->rcv_nxt = nxt_exp;
-
-				pkt = queued_pkt;
-				list_for_each_entry_continue(pkt, &foos->pktlist, list) {
+				/* rcv_nxt moves up to the next hole after the packet */
+				pkt = pkt_find_gap_from(foos->pkt_tree.rb_node, queued_pkt->seq);
+				if (!pkt)
+					pkt = list_last_entry(&foos->pktlist, struct tfo_pkt, list);
+				fos->rcv_nxt = segend(pkt);
 #ifdef DEBUG_SND_NXT
-					printf("Checking pkt m %p, seq 0x%x, seglen %u, fos->rcv_nxt 0x%x\n",
-						pkt->m, pkt->seq, pkt->seglen, fos->rcv_nxt);
+				printf("rcv_nxt updated to 0x%x from pkt m %p, seq 0x%x, seglen %u\n",
+					fos->rcv_nxt, pkt->m, pkt->seq, pkt->seglen);
 #endif
-
-					if (after(pkt->seq, nxt_exp))
-						break;
-
-					nxt_exp = segend(pkt);
-					fos->rcv_nxt = nxt_exp;
-				}
 			} else {
 				/* If !rcv_nxt_updated, we must have a missing packet, so resend ack */
 				fos_must_ack = true;
@@ -6281,6 +7890,9 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 
 			if (!after(segend(pkt), win_end)) {
 				if (!(pkt->flags & TFO_PKT_FL_SENT)) {
+					if ((option_flags & TFO_CONFIG_FL_RESEGMENT))
+						pkt_resegment(w, foos, pkt, win_end, p->m, tx_bufs);
+
 #ifdef DEBUG_RTO
 					printf("snd_next 0x%x, foos->snd_nxt 0x%x\n", segend(pkt), foos->snd_nxt);
 #endif
@@ -6319,37 +7931,7 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 	printf("win_end 0x%x rcv_nxt 0x%x, rcv_win 0x%x win_shift %u\n", win_end, foos->rcv_nxt, foos->rcv_win, foos->rcv_win_shift);
 #endif
 
-// Optimise this - ? point to last_sent ??
-	list_for_each_entry(pkt, &foos->pktlist, list) {
-#ifdef DEBUG_TCP_WINDOW
-		if (pkt->tcp)
-			printf("  pkt->seq 0x%x, flags 0x%x pkt->seglen %u tcp flags 0x%x foos->snd_nxt 0x%x\n",
-				pkt->seq, pkt->flags, pkt->seglen, (unsigned)((pkt->tcp->data_off << 8) | pkt->tcp->tcp_flags) & 0xfff, foos->snd_nxt);
-#endif
-
-		if (after(segend(pkt), win_end))
-			break;
-		if (!(pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_QUEUED_SEND))) {
-			snd_nxt = segend(pkt);
-			if (after(snd_nxt, foos->snd_nxt)) {
-#ifdef DEBUG_TCP_WINDOW
-				printf("Sending queued packet %p, updating foos->snd_nxt from 0x%x to 0x%x\n",
-					pkt->m, foos->snd_nxt, snd_nxt);
-#endif
-				foos->snd_nxt = snd_nxt;
-			}
-#ifdef DEBUG_TCP_WINDOW
-			else
-				printf("Sending queued packet %p, not updating foos->snd_nxt from 0x%x to 0x%x\n",
-					pkt->m, foos->snd_nxt, snd_nxt);
-#endif
-
-#ifdef DEBUG_SEND_PKT_LOCATION
-			printf("send_tcp_pkt K\n");
-#endif
-			send_tcp_pkt(w, pkt, tx_bufs, foos, fos, false);
-		}
-	}
+	send_unsent_pkts(w, foos, fos, win_end, p->m, tx_bufs);
 
 #ifdef DEBUG_ACK
 	printf("ACK status: fos_send_ack %d fos_must_ack %d fos_ack_from_queue %d foos_send_ack %d\n", fos_send_ack, fos_must_ack, fos_ack_from_queue, foos_send_ack);
@@ -6361,9 +7943,8 @@ tfo_handle_pkt(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_eflow *ef,
 			struct tfo_pkt *pkt_in = queued_pkt;
 			if (!queued_pkt || queued_pkt == PKT_IN_LIST || queued_pkt == PKT_VLAN_ERR) {
 				pkt_in = &unq_pkt;
-				unq_pkt.iph = p->iph;
-				unq_pkt.tcp = p->tcp;
 				unq_pkt.m = p->m;
+				pkt_set_hdrs(&unq_pkt, p->iph, p->tcp, NULL, NULL);
 				unq_pkt.flags = p->from_priv ? TFO_PKT_FL_FROM_PRIV : 0;
 			}
 
@@ -6535,7 +8116,7 @@ process_pkt:
 #endif
 
 	if (unlikely(ef->state == TCP_STATE_CLEAR_OPTIMIZE)) {
-		fo = &w->f[ef->tfo_idx];
+		fo = ef->fo;
 		if (list_empty(&fo->priv.pktlist) &&
 		    list_empty(&fo->pub.pktlist)) {
 			/* The pkt queues are now empty. */
@@ -6576,7 +8157,7 @@ syn_ack_syn_no_ack:	// Unused
 est_syn_ack:
 	/* Is the SYN+ACK being resent because the server hasn't received
 	 * the ACK for the SYN+ACK? */
-	fo = &w->f[ef->tfo_idx];
+	fo = ef->fo;
 	fos = p->from_priv ? &fo->priv : &fo->pub;
 	seq = rte_be_to_cpu_32(p->tcp->sent_seq);
 	if (!(ef->flags & TFO_EF_FL_SYN_FROM_PRIV) != !p->from_priv &&
@@ -6646,7 +8227,7 @@ ef->client_snd_win = rte_be_to_cpu_16(p->tcp->rx_win);
 		if (check_do_optimize(w, p, ef)) {
 // Do initial RTT if none for user, otherwise ignore due to additional time for connection establishment
 // RTT is per user on private side, per flow on public side
-			fo = &w->f[ef->tfo_idx];
+			fo = ef->fo;
 			if (p->from_priv) {
 				server_fo = &fo->priv;
 				client_fo = &fo->pub;
@@ -6717,7 +8298,7 @@ syn_ack_ack:
 // We should do the following in handle_pkt - PKT_HANDLED is insufficient
 			_eflow_set_state(w, ef, TCP_STATE_ESTABLISHED);
 
-			fo = &w->f[ef->tfo_idx];
+			fo = ef->fo;
 			(p->from_priv ? &fo->priv : &fo->pub)->flags |= TFO_SIDE_FL_RTT_FROM_SYN;
 
 			update_timer_ef(ef);
@@ -6783,9 +8364,8 @@ tfo_mbuf_in_v4(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 		pub_port = rte_be_to_cpu_16(p->tcp->src_port);
 	}
 
-// PQA - add p->from_priv check here
-// ? two stage hash. priv_addr/port
-	h = tfo_eflow_v4_hash(config, priv_addr, priv_port, pub_addr, pub_port);
+	/* The hash was calculated when the burst was parsed */
+	h = p->flow_hash;
 	ef = tfo_eflow_v4_lookup(w, priv_addr, priv_port, pub_addr, pub_port, h);
 #ifdef DEBUG_FLOW
 	printf("h = %u, ef = %p\n", h, ef);
@@ -6808,8 +8388,8 @@ tfo_mbuf_in_v4(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 			return TFO_PKT_NO_RESOURCE;
 		ef->priv_port = priv_port;
 		ef->pub_port = pub_port;
-		ef->pub_addr.v4.s_addr = pub_addr;
-		ef->priv_addr.v4.s_addr = priv_addr;
+		ef->pub_addr.s_addr = pub_addr;
+		ef->priv_addr.s_addr = priv_addr;
 
 		if (!set_tcp_options(p, ef)) {
 			_eflow_free(w, ef, tx_bufs);
@@ -6839,8 +8419,12 @@ tfo_mbuf_in_v4(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 		++w->st.syn_pkt;
 
 		ret = TFO_PKT_FORWARD;
-	} else
+	} else {
+		if (unlikely(!tfo_eflow_in_oflows(w, ef)) && (p->tcp->tcp_flags & RTE_TCP_SYN_FLAG))
+			ef = _eflow_move_to_oflows(w, ef);
+
 		ret = tfo_tcp_sm(w, p, ef, tx_bufs);
+	}
 
 #ifdef DEBUG_STRUCTURES
 	do_post_pkt_dump(w, ef);
@@ -6890,9 +8474,8 @@ tfo_mbuf_in_v6(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 		pub_port = rte_be_to_cpu_16(p->tcp->src_port);
 	}
 
-// PQA - add p->from_priv check here
-// ? two stage hash. priv_addr/port
-	h = tfo_eflow_v6_hash(config, priv_addr, priv_port, pub_addr, pub_port);
+	/* The hash was calculated when the burst was parsed */
+	h = p->flow_hash;
 	ef = tfo_eflow_v6_lookup(w, priv_addr, priv_port, pub_addr, pub_port, h);
 #ifdef DEBUG_FLOW
 	printf("h = %u, ef = %p\n", h, ef);
@@ -6915,8 +8498,10 @@ tfo_mbuf_in_v6(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 			return TFO_PKT_NO_RESOURCE;
 		ef->priv_port = priv_port;
 		ef->pub_port = pub_port;
-		ef->pub_addr.v6 = *pub_addr;
-		ef->priv_addr.v6 = *priv_addr;
+		container_of(ef, struct tfo_flow, ef)->ef6.pub_addr = *pub_addr;
+		container_of(ef, struct tfo_flow, ef)->ef6.priv_addr = *priv_addr;
+		ef->pub_addr.s_addr = 0;
+		ef->priv_addr.s_addr = 0;
 		ef->flags |= TFO_EF_FL_IPV6;
 
 		if (!set_tcp_options(p, ef)) {
@@ -6948,8 +8533,12 @@ tfo_mbuf_in_v6(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 		++w->st.syn_pkt;
 
 		ret = TFO_PKT_FORWARD;
-	} else
+	} else {
+		if (unlikely(!tfo_eflow_in_oflows(w, ef)) && (p->tcp->tcp_flags & RTE_TCP_SYN_FLAG))
+			ef = _eflow_move_to_oflows(w, ef);
+
 		ret = tfo_tcp_sm(w, p, ef, tx_bufs);
+	}
 
 #ifdef DEBUG_STRUCTURES
 	do_post_pkt_dump(w, ef);
@@ -6958,12 +8547,86 @@ tfo_mbuf_in_v6(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *t
 	return ret;
 }
 
+/* A Toeplitz key made of a repeated 16 bit pattern gives the same hash for
+ * both directions of a flow, since the hash then only depends on the XOR of
+ * the 16 bit words of the addresses and ports. 52 bytes is enough for any
+ * NIC we know of. */
+static const uint8_t symmetric_rss_key[52] = {
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a,
+};
+
+/* The same hash the NIC calculates, for when the PMD doesn't supply it */
+static uint32_t
+tfo_pkt_soft_rss(const struct tfo_pkt_in *p)
+{
+	union rte_thash_tuple tuple;
+
+	if (RTE_ETH_IS_IPV4_HDR(p->m->packet_type)) {
+		tuple.v4.src_addr = rte_be_to_cpu_32(p->iph.ip4h->src_addr);
+		tuple.v4.dst_addr = rte_be_to_cpu_32(p->iph.ip4h->dst_addr);
+		tuple.v4.sport = rte_be_to_cpu_16(p->tcp->src_port);
+		tuple.v4.dport = rte_be_to_cpu_16(p->tcp->dst_port);
+
+		return rte_softrss((uint32_t *)&tuple, RTE_THASH_V4_L4_LEN, symmetric_rss_key);
+	}
+
+	rte_thash_load_v6_addrs(p->iph.ip6h, &tuple);
+	tuple.v6.sport = rte_be_to_cpu_16(p->tcp->src_port);
+	tuple.v6.dport = rte_be_to_cpu_16(p->tcp->dst_port);
+
+	return rte_softrss((uint32_t *)&tuple, RTE_THASH_V6_L4_LEN, symmetric_rss_key);
+}
+
+static inline uint32_t
+tfo_pkt_flow_hash(const struct tfo_pkt_in *p)
+{
+	if (option_flags & TFO_CONFIG_FL_NIC_RSS_HASH) {
+		if (likely(p->m->ol_flags & RTE_MBUF_F_RX_RSS_HASH))
+			return p->m->hash.rss;
+
+		return tfo_pkt_soft_rss(p);
+	}
+
+	if (RTE_ETH_IS_IPV4_HDR(p->m->packet_type)) {
+		if (likely(p->from_priv))
+			return tfo_eflow_v4_hash(rte_be_to_cpu_32(p->iph.ip4h->src_addr), rte_be_to_cpu_16(p->tcp->src_port),
+						 rte_be_to_cpu_32(p->iph.ip4h->dst_addr), rte_be_to_cpu_16(p->tcp->dst_port));
+
+		return tfo_eflow_v4_hash(rte_be_to_cpu_32(p->iph.ip4h->dst_addr), rte_be_to_cpu_16(p->tcp->dst_port),
+					 rte_be_to_cpu_32(p->iph.ip4h->src_addr), rte_be_to_cpu_16(p->tcp->src_port));
+	}
+
+	if (likely(p->from_priv))
+		return tfo_eflow_v6_hash((struct in6_addr *)p->iph.ip6h->src_addr, rte_be_to_cpu_16(p->tcp->src_port),
+					 (struct in6_addr *)p->iph.ip6h->dst_addr, rte_be_to_cpu_16(p->tcp->dst_port));
+
+	return tfo_eflow_v6_hash((struct in6_addr *)p->iph.ip6h->dst_addr, rte_be_to_cpu_16(p->tcp->dst_port),
+				 (struct in6_addr *)p->iph.ip6h->src_addr, rte_be_to_cpu_16(p->tcp->src_port));
+}
+
+static inline enum tfo_pkt_state
+tfo_mbuf_in(struct tcp_worker *w, struct tfo_pkt_in *p, struct tfo_tx_bufs *tx_bufs)
+{
+	if (RTE_ETH_IS_IPV4_HDR(p->m->packet_type))
+		return tfo_mbuf_in_v4(w, p, tx_bufs);
+
+	return tfo_mbuf_in_v6(w, p, tx_bufs);
+}
+
 // Do IPv4 defragmentation - see https://packetpushers.net/ip-fragmentation-in-detail/
 
+/* Parse the L2/L3 headers of a packet and locate the TCP header. If the packet
+ * is to be processed, TFO_PKT_HANDLED is returned, the flow hash is calculated
+ * and the hash bucket is prefetched. */
 static int
-tcp_worker_mbuf_pkt(struct tcp_worker *w, struct rte_mbuf *m, int from_priv, struct tfo_tx_bufs *tx_bufs)
+tcp_worker_mbuf_parse(struct rte_mbuf *m, bool from_priv, struct tfo_pkt_in *pkt)
 {
-	struct tfo_pkt_in pkt;
 	int16_t proto;
 	uint32_t hdr_len;
 	uint32_t off;
@@ -6972,23 +8635,19 @@ tcp_worker_mbuf_pkt(struct tcp_worker *w, struct rte_mbuf *m, int from_priv, str
 	struct rte_vlan_hdr *vl;
 
 
-	pkt.m = m;
-
-#ifdef DEBUG_DUPLICATE_MBUFS
-	if (check_mbuf_in_use(m, w, tx_bufs))
-		printf("Received mbuf %p already in use\n", m);
-#endif
+	pkt->m = m;
 
 	/* Ensure the private area is initialised */
 	get_priv_addr(m)->pkt = NULL;
 
 // Should we set these?
-	pkt.tv.tv_sec = 0;
-	pkt.tv.tv_usec = 0;
-	pkt.from_priv = from_priv;
-	pkt.sack_opt = NULL;
-	pkt.ts_opt = NULL;
-	pkt.mss_opt = 0;
+	pkt->tv.tv_sec = 0;
+	pkt->tv.tv_usec = 0;
+	pkt->from_priv = from_priv;
+	pkt->sack_opt = NULL;
+	pkt->ts_opt = NULL;
+	pkt->mss_opt = 0;
+	pkt->flow_hash = 0;
 
 #ifdef DEBUG_PKT_TYPES
 	char ptype[128];
@@ -7029,53 +8688,59 @@ tcp_worker_mbuf_pkt(struct tcp_worker *w, struct rte_mbuf *m, int from_priv, str
 #endif
 
 	/* The following works for IPv6 too */
-	pkt.iph.ip4h = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, hdr_len);
-	pkt.pktlen = m->pkt_len - hdr_len;
+	pkt->iph.ip4h = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, hdr_len);
+	pkt->pktlen = m->pkt_len - hdr_len;
 
 	switch (m->packet_type & RTE_PTYPE_L3_MASK) {
 	case RTE_PTYPE_L3_IPV4:
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + sizeof(struct rte_ipv4_hdr));
+		pkt->tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + sizeof(struct rte_ipv4_hdr));
 
 		/* A minimum ethernet + IPv4 + TCP packet with no options or data
 		 * is 54 bytes; we will be given a pkt_len of 60 */
-		if (m->pkt_len > rte_be_to_cpu_16(pkt.iph.ip4h->total_length) + hdr_len)
-			rte_pktmbuf_trim(m, m->pkt_len - (rte_be_to_cpu_16(pkt.iph.ip4h->total_length) + hdr_len));
-
-		return tfo_mbuf_in_v4(w, &pkt, tx_bufs);
+		if (m->pkt_len > rte_be_to_cpu_16(pkt->iph.ip4h->total_length) + hdr_len)
+			rte_pktmbuf_trim(m, m->pkt_len - (rte_be_to_cpu_16(pkt->iph.ip4h->total_length) + hdr_len));
+		break;
 
 	case RTE_PTYPE_L3_IPV4_EXT:
 	case RTE_PTYPE_L3_IPV4_EXT_UNKNOWN:
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + rte_ipv4_hdr_len(pkt.iph.ip4h));
+		pkt->tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + rte_ipv4_hdr_len(pkt->iph.ip4h));
 
 		/* A minimum ethernet + IPv4 + TCP packet with no options or data
 		 * is 54 bytes; we will be given a pkt_len of 60 */
-		if (m->pkt_len > rte_be_to_cpu_16(pkt.iph.ip4h->total_length) + hdr_len)
-			rte_pktmbuf_trim(m, m->pkt_len - (rte_be_to_cpu_16(pkt.iph.ip4h->total_length) + hdr_len));
-
-		return tfo_mbuf_in_v4(w, &pkt, tx_bufs);
+		if (m->pkt_len > rte_be_to_cpu_16(pkt->iph.ip4h->total_length) + hdr_len)
+			rte_pktmbuf_trim(m, m->pkt_len - (rte_be_to_cpu_16(pkt->iph.ip4h->total_length) + hdr_len));
+		break;
 
 	case RTE_PTYPE_L3_IPV6:
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + sizeof(struct rte_ipv6_hdr));
-
-		return tfo_mbuf_in_v6(w, &pkt, tx_bufs);
+		pkt->tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + sizeof(struct rte_ipv6_hdr));
+		break;
 
 	case RTE_PTYPE_L3_IPV6_EXT:
 	case RTE_PTYPE_L3_IPV6_EXT_UNKNOWN:
 		off = hdr_len;
-		proto = rte_net_skip_ip6_ext(pkt.iph.ip6h->proto, m, &off, &frag);
+		proto = rte_net_skip_ip6_ext(pkt->iph.ip6h->proto, m, &off, &frag);
 		if (unlikely(proto < 0))
 			return TFO_PKT_INVALID;
 		if (proto != IPPROTO_TCP)
 			return TFO_PKT_NOT_TCP;
 
-		pkt.tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + off);
-		return tfo_mbuf_in_v6(w, &pkt, tx_bufs);
+		pkt->tcp = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, hdr_len + off);
+		break;
 
 	default:
 		/* It is not IPv4/6 */
 // ARP?
 		return TFO_PKT_INVALID;
 	}
+
+	/* An incomplete header is rejected when the packet is processed, and
+	 * the hash must not be calculated from beyond the end of the data. */
+	if (tcp_header_complete(m, pkt->tcp)) {
+		pkt->flow_hash = tfo_pkt_flow_hash(pkt);
+		tfo_eflow_prefetch_bucket(&worker, pkt->flow_hash);
+	}
+
+	return TFO_PKT_HANDLED;
 }
 
 __visible void
@@ -7098,7 +8763,7 @@ postprocess_sent_packets(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx)
 
 	for (buf = 0; buf < nb_tx; buf++) {
 		/* We don't do anything with ACKs */
-		if (ack_bit_is_set(tx_bufs, buf))
+		if (discard_after_send(tx_bufs, buf))
 			continue;
 
 		priv = get_priv_addr(tx_bufs->m[buf]);
@@ -7164,7 +8829,7 @@ postprocess_sent_packets(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx)
 
 			/* If not using timestamps and no RTT calculation in progress,
 			 * start one, but we don't calculate RTT from a resent packet */
-			if (!pkt->ts && !(fos->flags & TFO_SIDE_FL_RTT_CALC_IN_PROGRESS)) {
+			if (!pkt_ts(pkt) && !(fos->flags & TFO_SIDE_FL_RTT_CALC_IN_PROGRESS)) {
 				fos->flags |= TFO_SIDE_FL_RTT_CALC_IN_PROGRESS;
 				pkt->flags |= TFO_PKT_FL_RTT_CALC;
 			}
@@ -7191,34 +8856,234 @@ postprocess_sent_packets(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx)
 		}
 #endif
 
-		last_sent_pkt = fos->last_sent;
+		last_sent_pkt = fos->last_sent;
+
+		/* RFC 8985 6.1 for LOST */
+		pkt->flags &= ~(TFO_PKT_FL_LOST | TFO_PKT_FL_QUEUED_SEND);
+
+		/* RFC8985 to make step 2 faster */
+
+		/* Add the packet after the last sent packet not lost */
+		if (list_is_queued(&pkt->xmit_ts_list)) {
+			if (last_sent_pkt != &pkt->xmit_ts_list)
+				list_move(&pkt->xmit_ts_list, last_sent_pkt);
+		} else
+			list_add(&pkt->xmit_ts_list, last_sent_pkt);
+
+		fos->last_sent = &pkt->xmit_ts_list;
+
+		if (after(segend(pkt), fos->snd_nxt))
+			fos->snd_nxt = segend(pkt);
+
+#ifdef DEBUG_POSTPROCESS
+// This ack might duplicate a previous ACK, and fos->snd_una has moved forward. Once have fos->first_seq, use that
+// This also doesn't cope with seq wrapping
+// Once saw: received packet len 293, seq say 0x1000 for which we had received an ack, then received same packet but with
+// FIN set. It failed what was the first check - before(pkt->seq, fos->snd_una);
+		if (!after(pkt->seq + pkt->seglen, fos->snd_una) || after(pkt->seq + pkt->seglen, fos->snd_nxt))
+			printf("ERROR postprocess mbuf %p pkt %p seq 0x%x len %u not between fos->snd_una 0x%x and fos->snd_next 0x%x, fos %p, xmit_ts_list %p:%p\n",
+				tx_bufs->m[buf], pkt, pkt->seq, pkt->seglen, fos->snd_una, fos->snd_nxt, fos, pkt->xmit_ts_list.prev, pkt->xmit_ts_list.next);
+#endif
+	}
+}
+
+/* Packets that have been sent have their data moved to the send buffer, or
+ * if small are moved out of their receive mbufs. This is done once the sent
+ * and unsent packets have been processed, since a packet can be in tx_bufs
+ * more than once. */
+static void
+release_sent_mbufs(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx)
+{
+	struct tfo_mbuf_priv *priv;
+	struct tfo_side *fos;
+	struct tfo_pkt *pkt;
+	uint16_t buf;
+
+	for (buf = 0; buf < nb_tx; buf++) {
+		if (discard_after_send(tx_bufs, buf))
+			continue;
+
+		priv = get_priv_addr(tx_bufs->m[buf]);
+		pkt = priv->pkt;
+		fos = priv->fos;
+
+		/* Only buffered packets that are not queued to be sent again */
+		if (!pkt || pkt->m != tx_bufs->m[buf] ||
+		    (pkt->flags & TFO_PKT_FL_QUEUED_SEND))
+			continue;
+
+		if (sndbuf_pool && !(pkt = pkt_move_to_sndbuf(&worker, fos, pkt))->m) {
+			/* Packets sent earlier that were after a gap in the send
+			 * buffer can follow this packet into it */
+			while (!list_is_last(&pkt->list, &fos->pktlist)) {
+				pkt = list_next_entry(pkt, list);
+				if ((pkt->flags & (TFO_PKT_FL_SENT | TFO_PKT_FL_QUEUED_SEND)) != TFO_PKT_FL_SENT ||
+				    !pkt->m ||
+				    pkt_move_to_sndbuf(&worker, fos, pkt)->m)
+					break;
+			}
+
+			continue;
+		}
+
+		if (small_pool && pkt_in_mbuf_priv(pkt))
+			pkt_move_to_small_mbuf(&worker, fos, pkt);
+	}
+
+	reclaim_flush(&worker);
+}
+
+static inline unsigned
+txq_use(const struct tfo_txq *q)
+{
+	return q->nb_acks + q->nb_pkts[TFO_TXQ_RESEND] + q->nb_pkts[TFO_TXQ_NEW];
+}
+
+static inline bool
+txq_drain_due(const struct tcp_worker *w)
+{
+	return txq_use(&w->txq) && now >= w->txq.drain_ns;
+}
+
+static void
+txq_drop_pkt(struct tcp_worker *w, unsigned list)
+{
+	struct tfo_pkt *pkt = *txq_pkt_slot(&w->txq, list, w->txq.nb_pkts[list] - 1);
+
+	/* The packet stays on its pktlist, and is sent again when the send
+	 * window allows, or by loss recovery */
+	w->txq.nb_pkts[list]--;
+	pkt->in_txq = false;
+
+	if (list == TFO_TXQ_RESEND)
+		++w->st.txq_drop_resend;
+	else
+		++w->st.txq_drop_new;
+}
+
+/* If the TX queue is full, drop the latest packet of lower priority than
+ * prio, where ACKs are -1. Returns false if there is no such packet. */
+static bool
+txq_make_room(struct tcp_worker *w, int prio)
+{
+	int list;
+
+	if (likely(txq_use(&w->txq) < w->txq.depth))
+		return true;
+
+	for (list = TFO_TXQ_PKT_LISTS - 1; list > prio; list--) {
+		if (w->txq.nb_pkts[list]) {
+			txq_drop_pkt(w, list);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline void
+txq_queued(struct tcp_worker *w)
+{
+	uint16_t use = txq_use(&w->txq);
+
+	++w->st.txq_queued;
+	if (use > w->txq.max_use)
+		w->txq.max_use = use;
+}
+
+static void
+txq_queue_ack(struct tcp_worker *w, struct rte_mbuf *m)
+{
+	struct tfo_txq *q = &w->txq;
+
+	if (!txq_make_room(w, -1)) {
+		++w->st.txq_drop_ack;
+		rte_pktmbuf_free(m);
+		return;
+	}
+
+	q->acks[(q->ack_head + q->nb_acks++) % q->depth] = m;
+	txq_queued(w);
+}
+
+static void
+txq_queue_pkt(struct tcp_worker *w, struct tfo_pkt *pkt)
+{
+	unsigned list = txq_pkt_list(pkt);
+
+	if (!txq_make_room(w, list)) {
+		if (list == TFO_TXQ_RESEND)
+			++w->st.txq_drop_resend;
+		else
+			++w->st.txq_drop_new;
+		return;
+	}
+
+	*txq_pkt_slot(&w->txq, list, w->txq.nb_pkts[list]++) = pkt;
+	pkt->in_txq = true;
+	txq_queued(w);
+}
+
+/* Add the packets on the TX queue to tx_bufs, ACKs first, then retransmissions
+ * and then new data, followed by the unsent data of the sides that were
+ * throttled while the queue held packets. Any that are not sent are queued
+ * again by tfo_packets_not_sent(), possibly while the queue is being drained
+ * if tx_bufs is sent early, so only the packets queued when the drain of a
+ * ring starts are taken from it. */
+static void
+txq_drain(struct tcp_worker *w, struct tfo_tx_bufs *tx_bufs)
+{
+	struct tfo_txq *q = &w->txq;
+	const union tfo_ip_p no_iph = { .ip4h = NULL };
+	struct tfo_mbuf_priv *priv;
+	struct tfo_pkt *pkt;
+	struct rte_mbuf *m;
+	struct tfo *fo;
+	uint16_t nb_acks, nb_pkts;
+	uint8_t sides;
+	unsigned list;
+
+	for (nb_acks = q->nb_acks; nb_acks; nb_acks--) {
+		m = q->acks[q->ack_head];
+		q->ack_head = (q->ack_head + 1) % q->depth;
+		q->nb_acks--;
 
-		/* RFC 8985 6.1 for LOST */
-		pkt->flags &= ~(TFO_PKT_FL_LOST | TFO_PKT_FL_QUEUED_SEND);
+		add_tx_buf(w, m, tx_bufs, false, no_iph, true);
+		++w->st.txq_drained;
+	}
 
-		/* RFC8985 to make step 2 faster */
+	for (list = 0; list < TFO_TXQ_PKT_LISTS; list++) {
+		for (nb_pkts = q->nb_pkts[list]; nb_pkts && q->nb_pkts[list]; nb_pkts--) {
+			pkt = q->pkts[list][q->pkt_head[list]];
+			q->pkt_head[list] = (q->pkt_head[list] + 1) % q->depth;
+			q->nb_pkts[list]--;
+			pkt->in_txq = false;
 
-		/* Add the packet after the last sent packet not lost */
-		if (list_is_queued(&pkt->xmit_ts_list)) {
-			if (last_sent_pkt != &pkt->xmit_ts_list)
-				list_move(&pkt->xmit_ts_list, last_sent_pkt);
-		} else
-			list_add(&pkt->xmit_ts_list, last_sent_pkt);
+			/* The mbuf of a SACK'd packet may have been released */
+			if (!pkt->m)
+				continue;
 
-		fos->last_sent = &pkt->xmit_ts_list;
+			priv = get_priv_addr(pkt->m);
+			fo = priv->fos->ef->fo;
+			if (send_tcp_pkt(w, pkt, tx_bufs, priv->fos,
+					 &fo->priv == priv->fos ? &fo->pub : &fo->priv, false))
+				++w->st.txq_drained;
+		}
+	}
 
-		if (after(segend(pkt), fos->snd_nxt))
-			fos->snd_nxt = segend(pkt);
+	/* Now send the new data held back while the queue held packets. If
+	 * tx_bufs is sent early and packets are queued again, the remaining
+	 * flows are left until the next drain. */
+	while (!list_empty(&q->throttled) && !q->nb_pkts[TFO_TXQ_RESEND] && !q->nb_pkts[TFO_TXQ_NEW]) {
+		fo = list_first_entry(&q->throttled, struct tfo, txq_throttled);
+		list_del_init(&fo->txq_throttled);
+		sides = fo->throttled_sides;
+		fo->throttled_sides = 0;
 
-#ifdef DEBUG_POSTPROCESS
-// This ack might duplicate a previous ACK, and fos->snd_una has moved forward. Once have fos->first_seq, use that
-// This also doesn't cope with seq wrapping
-// Once saw: received packet len 293, seq say 0x1000 for which we had received an ack, then received same packet but with
-// FIN set. It failed what was the first check - before(pkt->seq, fos->snd_una);
-		if (!after(pkt->seq + pkt->seglen, fos->snd_una) || after(pkt->seq + pkt->seglen, fos->snd_nxt))
-			printf("ERROR postprocess mbuf %p pkt %p seq 0x%x len %u not between fos->snd_una 0x%x and fos->snd_next 0x%x, fos %p, xmit_ts_list %p:%p\n",
-				tx_bufs->m[buf], pkt, pkt->seq, pkt->seglen, fos->snd_una, fos->snd_nxt, fos, pkt->xmit_ts_list.prev, pkt->xmit_ts_list.next);
-#endif
+		if (sides & TFO_THROTTLED_PRIV)
+			send_unsent_pkts(w, &fo->priv, &fo->pub, get_snd_win_end(&fo->priv), NULL, tx_bufs);
+		if (sides & TFO_THROTTLED_PUB)
+			send_unsent_pkts(w, &fo->pub, &fo->priv, get_snd_win_end(&fo->pub), NULL, tx_bufs);
 	}
 }
 
@@ -7231,8 +9096,8 @@ tfo_packets_not_sent(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx) {
 #ifdef DEBUG_TIMERS
 		printf("\tm %p not sent\n", tx_bufs->m[buf]);
 #endif
-		if (ack_bit_is_set(tx_bufs, buf))
-			rte_pktmbuf_free(tx_bufs->m[buf]);
+		if (discard_after_send(tx_bufs, buf))
+			txq_queue_ack(&worker, tx_bufs->m[buf]);
 		else {
 			rte_pktmbuf_refcnt_update(tx_bufs->m[buf], -1);
 			priv = get_priv_addr(tx_bufs->m[buf]);
@@ -7245,9 +9110,13 @@ tfo_packets_not_sent(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx) {
 #endif
 			pkt->flags &= ~TFO_PKT_FL_QUEUED_SEND;
 			priv->fos->pkts_queued_send--;
-			list_add_tail(&pkt->send_failed_list, &send_failed_list);
+			txq_queue_pkt(&worker, pkt);
 		}
 	}
+
+	/* Rather than retrying straight away, the queue is drained when the
+	 * next burst is processed, or by the timers after the drain timeout */
+	worker.txq.drain_ns = now + (time_ns_t)config->tx_queue_drain_us * NSEC_PER_USEC;
 }
 
 /* Called by the app if it sends the packets itself */
@@ -7267,7 +9136,10 @@ tfo_post_send(struct tfo_tx_bufs *tx_bufs, uint16_t nb_tx)
 	do_post_tx_dump(&worker, tx_bufs);
 #endif
 
-	return !list_empty(&send_failed_list);
+	if (small_pool || sndbuf_pool)
+		release_sent_mbufs(tx_bufs, nb_tx);
+
+	return txq_drain_due(&worker);
 }
 
 #ifdef DEBUG_PACKET_POOL
@@ -7298,8 +9170,92 @@ find_tcp(struct rte_mbuf *m)
 }
 #endif
 
-static inline void
-tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
+/* Calculate the checksums of a packet that the driver cannot offload. The
+ * packet may be a chain of mbufs if it was coalesced. */
+static void
+tx_cksum_software(struct rte_mbuf *m)
+{
+	union tfo_ip_p iph = { .ip4h = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, m->l2_len) };
+	struct rte_tcp_hdr *tcp = (struct rte_tcp_hdr *)((uint8_t *)iph.ip4h + m->l3_len);
+
+	if ((m->ol_flags & RTE_MBUF_F_TX_L4_MASK) != RTE_MBUF_F_TX_TCP_CKSUM)
+		return;
+
+	tcp->cksum = 0;
+	if (m->ol_flags & RTE_MBUF_F_TX_IPV6)
+		tcp->cksum = rte_ipv6_udptcp_cksum_mbuf(m, iph.ip6h, m->l2_len + m->l3_len);
+	else {
+		iph.ip4h->hdr_checksum = 0;
+		iph.ip4h->hdr_checksum = rte_ipv4_cksum(iph.ip4h);
+		tcp->cksum = rte_ipv4_udptcp_cksum_mbuf(m, iph.ip4h, m->l2_len + m->l3_len);
+	}
+
+	m->ol_flags &= ~(RTE_MBUF_F_TX_IPV4 | RTE_MBUF_F_TX_IPV6 | RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_L4_MASK);
+}
+
+/* Remove a packet the driver will not accept from the burst. If it is held
+ * by a tfo_pkt, it is left to be sent again, as if it had been removed by
+ * remove_pkt_from_tx_bufs(), otherwise it is dropped. */
+static void
+tx_prepare_drop(struct tfo_tx_bufs *tx_bufs, uint16_t buf)
+{
+	struct rte_mbuf *m = tx_bufs->m[buf];
+	struct tfo_mbuf_priv *priv;
+
+	if (discard_after_send(tx_bufs, buf)) {
+		NO_INLINE_WARNING(rte_pktmbuf_free(m));
+	} else {
+		rte_pktmbuf_refcnt_update(m, -1);
+		priv = get_priv_addr(m);
+		priv->pkt->flags &= ~TFO_PKT_FL_QUEUED_SEND;
+		priv->fos->pkts_queued_send--;
+	}
+
+	/* The order of the packets must be kept */
+	--tx_bufs->nb_tx;
+	memmove(&tx_bufs->m[buf], &tx_bufs->m[buf + 1], (tx_bufs->nb_tx - buf) * sizeof(*tx_bufs->m));
+	memmove(&tx_bufs->discard[buf], &tx_bufs->discard[buf + 1], (tx_bufs->nb_tx - buf) * sizeof(*tx_bufs->discard));
+}
+
+/* With TX checksum offload, rte_eth_tx_prepare() must be called before the
+ * packets are sent. It stops at the first packet that the driver cannot
+ * handle. If the checksum offload is the problem, i.e. it is not supported
+ * (ENOTSUP) or, since checksums are the only offloads requested, a single
+ * segment packet is invalid (EINVAL), the checksums are calculated in
+ * software. Otherwise, for example if a coalesced packet has too many
+ * segments, the packet is not sent. Called by the app if it sends the packets
+ * itself. */
+__visible void
+tfo_tx_prepare(struct tfo_tx_bufs *tx_bufs)
+{
+	uint16_t nb_prep = 0;
+	struct rte_mbuf *m;
+
+	if (!(option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD))
+		return;
+
+	while ((nb_prep += rte_eth_tx_prepare(port_id, queue_idx, tx_bufs->m + nb_prep, tx_bufs->nb_tx - nb_prep)) < tx_bufs->nb_tx) {
+		m = tx_bufs->m[nb_prep];
+		if (rte_errno == ENOTSUP ||
+		    (rte_errno == EINVAL && m->nb_segs == 1)) {
+			++worker.st.tx_cksum_sw;
+			tx_cksum_software(m);
+			nb_prep++;
+		} else {
+#ifdef DEBUG_SEND_BURST_ERRORS
+			printf("tx_prepare rejected m %p nb_segs %u, rte_errno %d\n", m, m->nb_segs, rte_errno);
+#endif
+			++worker.st.tx_prepare_drop;
+			tx_prepare_drop(tx_bufs, nb_prep);
+		}
+	}
+}
+
+/* If release_mbufs is false, the mbufs of the sent packets are kept even if
+ * they could be copied or moved to a send buffer, since the packets are sent
+ * while a burst is being processed, and the caller may still refer to them. */
+static void
+do_send_burst(struct tfo_tx_bufs *tx_bufs, bool release_mbufs)
 {
 	uint16_t nb_tx;
 
@@ -7307,7 +9263,7 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 	for (unsigned i = 0; i < tx_bufs->nb_tx; i++) {
 		struct tfo_mbuf_priv *priv;
 
-		if (!ack_bit_is_set(tx_bufs, i)) {
+		if (!discard_after_send(tx_bufs, i)) {
 			priv = get_priv_addr(tx_bufs->m[i]);
 			if (!priv->fos || !priv->pkt)
 				printf("*** send_burst non-ack m %p %u priv->fos %p ->pkt %p\n", tx_bufs->m[i], i, priv->fos, priv->pkt);
@@ -7327,7 +9283,7 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 #endif
 
 		for (int i = 0; i < tx_bufs->nb_tx; i++) {
-			bool ack_error = !ack_bit_is_set(tx_bufs, i) == !strncmp("ack_pool_", tx_bufs->m[i]->pool->name, 9);
+			bool ack_error = !discard_after_send(tx_bufs, i) == !strncmp("ack_pool_", tx_bufs->m[i]->pool->name, 9);
 #ifdef DEBUG_PACKET_POOL
 #ifdef DEBUG_SEND_BURST_ERRORS
 			if (ack_error)
@@ -7336,13 +9292,13 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 				struct rte_tcp_hdr *tcp = find_tcp(tx_bufs->m[i]);
 
 				if (!tcp || !(tcp->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_RST_FLAG)))
-					printf("\t%3.3d: %p - tcp_flags 0x%x ack 0x%x pool %s", i, tx_bufs->m[i], tcp->tcp_flags, tx_bufs->acks[i / CHAR_BIT] & (1U << (i % CHAR_BIT)), tx_bufs->m[i]->pool->name);
+					printf("\t%3.3d: %p - tcp_flags 0x%x ack 0x%x pool %s", i, tx_bufs->m[i], tcp->tcp_flags, discard_after_send(tx_bufs, i), tx_bufs->m[i]->pool->name);
 				if (ack_error)
 					printf(" *** ACK FLAG mismatch pool ERROR");
 			}
 #endif
 #ifdef DEBUG_SEND_BURST_ERRORS
-			if (!ack_bit_is_set(tx_bufs, i)) {
+			if (!discard_after_send(tx_bufs, i)) {
 				struct tfo_mbuf_priv *priv;
 				priv = get_priv_addr(tx_bufs->m[i]);
 				if (!priv->fos || !priv->pkt)
@@ -7351,7 +9307,7 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 				printf("\n");
 #endif
 #ifdef DEBUG_PACKET_POOL
-			printf("\t%3.3d: m %p pool %s ack %s refcnt %u\n", i, tx_bufs->m[i], tx_bufs->m[i]->pool->name, tx_bufs->acks[i / CHAR_BIT] & (1U << (i % CHAR_BIT)) ? "ack" : "data", tx_bufs->m[i]->refcnt);
+			printf("\t%3.3d: m %p pool %s ack %s refcnt %u\n", i, tx_bufs->m[i], tx_bufs->m[i]->pool->name, discard_after_send(tx_bufs, i) ? "ack" : "data", tx_bufs->m[i]->refcnt);
 #endif
 		}
 #endif
@@ -7363,6 +9319,7 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 #ifdef DEBUG_TX_BUFS
 		print_tx_bufs(tx_bufs);
 #endif
+		tfo_tx_prepare(tx_bufs);
 		nb_tx = config->tx_burst(port_id, queue_idx, tx_bufs->m, tx_bufs->nb_tx);
 #ifdef DEBUG_CHECK_PKTS
 		check_packets("After config->tx_burst");
@@ -7379,14 +9336,14 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 #endif
 		for (int i = 0; i < tx_bufs->nb_tx; i++) {
 #ifdef DEBUG_SEND_BURST
-			printf("\t%3.3d: %p - ack 0x%x", i, tx_bufs->m[i], tx_bufs->acks[i / CHAR_BIT] & (1U << (i % CHAR_BIT)));
+			printf("\t%3.3d: %p - ack 0x%x", i, tx_bufs->m[i], discard_after_send(tx_bufs, i));
 #endif
-			if (!ack_bit_is_set(tx_bufs, i)) {
+			if (!discard_after_send(tx_bufs, i)) {
 				struct tfo_mbuf_priv *priv;
 				priv = get_priv_addr(tx_bufs->m[i]);
 				if (!priv->fos || !priv->pkt) {
 #ifndef DEBUG_SEND_BURST
-					printf("\t%3.3d: %p - ack 0x%x", i, tx_bufs->m[i], tx_bufs->acks[i / CHAR_BIT] & (1U << (i % CHAR_BIT)));
+					printf("\t%3.3d: %p - ack 0x%x", i, tx_bufs->m[i], discard_after_send(tx_bufs, i));
 #endif
 					printf(" priv->fos %p ->pkt %p ***\n", priv->fos, priv->pkt);
 				}
@@ -7406,9 +9363,7 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 
 		/* Mark any unsent packets as not having been sent. */
 		if (unlikely(nb_tx < tx_bufs->nb_tx)) {
-#ifdef DEBUG_TIMERS
-			printf("tx_burst %u packets sent %u packets ***\n", tx_bufs->nb_tx, nb_tx);
-#else
+#if defined DEBUG_TIMERS || defined DEBUG_SEND_BURST_NOT_SENT
 			printf("tx_burst %u packets sent %u packets ***\n", tx_bufs->nb_tx, nb_tx);
 #endif
 
@@ -7419,20 +9374,264 @@ tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
 		printf("After packets sent:\n");
 		do_post_tx_dump(&worker, tx_bufs);
 #endif
+
+		if (release_mbufs && (small_pool || sndbuf_pool))
+			release_sent_mbufs(tx_bufs, nb_tx);
+	}
+}
+
+static inline void
+tfo_send_burst(struct tfo_tx_bufs *tx_bufs)
+{
+	do_send_burst(tx_bufs, true);
+}
+
+/* The tx_bufs are full while a burst or the timers are being processed */
+static void
+tfo_send_burst_early(struct tfo_tx_bufs *tx_bufs)
+{
+	++worker.st.tx_bufs_early_send;
+
+	do_send_burst(tx_bufs, false);
+	tx_bufs->nb_tx = 0;
+}
+
+/* A segment that has been coalesced into an earlier segment of its flow in
+ * the same burst. Its mbuf is now part of the earlier segment's mbuf chain. */
+#define TFO_PKT_COALESCED	(-1)
+
+/* A segment the NIC has found to have a bad IP or TCP checksum. It is dropped
+ * before it can be coalesced or buffered. */
+#define TFO_PKT_BAD_CKSUM	(-2)
+
+static inline bool
+rx_cksum_bad(const struct rte_mbuf *m)
+{
+	return (m->ol_flags & RTE_MBUF_F_RX_L4_CKSUM_MASK) == RTE_MBUF_F_RX_L4_CKSUM_BAD ||
+	       (m->ol_flags & RTE_MBUF_F_RX_IP_CKSUM_MASK) == RTE_MBUF_F_RX_IP_CKSUM_BAD;
+}
+
+/* The maximum number of mbufs that are chained by coalescing segments */
+#define COALESCE_MAX_SEGS	8
+
+static inline uint32_t
+tcp_payload_len(const struct tfo_pkt_in *p)
+{
+	return p->m->pkt_len - ((uint8_t *)p->tcp - rte_pktmbuf_mtod(p->m, uint8_t *))
+				- ((p->tcp->data_off & 0xf0) >> 2);
+}
+
+/* Only segments that carry data with just the ACK (and PSH) flags set, and
+ * have either no TCP options or only a timestamp option in the usual layout,
+ * are coalesced. Anything else, in particular SACK blocks, is left alone. */
+static inline bool
+tcp_seg_can_coalesce(const struct tfo_pkt_in *p)
+{
+	uint8_t tcp_hdr_len;
+
+	if ((p->m->packet_type & RTE_PTYPE_L3_MASK) != RTE_PTYPE_L3_IPV4 &&
+	    (p->m->packet_type & RTE_PTYPE_L3_MASK) != RTE_PTYPE_L3_IPV6)
+		return false;
+
+	if ((p->tcp->tcp_flags & ~RTE_TCP_PSH_FLAG) != RTE_TCP_ACK_FLAG ||
+	    !tcp_header_complete(p->m, p->tcp) ||
+	    !tcp_payload_len(p))
+		return false;
+
+	tcp_hdr_len = (p->tcp->data_off & 0xf0) >> 2;
+	if (tcp_hdr_len == sizeof(struct rte_tcp_hdr))
+		return true;
+
+	return tcp_hdr_len == sizeof(struct rte_tcp_hdr) + 2 + sizeof(struct tcp_timestamp_option) &&
+	       *(uint32_t *)(p->tcp + 1) == rte_cpu_to_be_32(TCPOPT_TSTAMP_HDR);
+}
+
+/* Are two segments from the same flow and direction, and with the same IP
+ * header fields that coalescing would otherwise lose? */
+static inline bool
+tcp_seg_same_flow(const struct tfo_pkt_in *pa, const struct tfo_pkt_in *pb)
+{
+	if (pa->m->packet_type != pb->m->packet_type ||
+	    pa->m->vlan_tci != pb->m->vlan_tci ||
+	    pa->tcp->src_port != pb->tcp->src_port ||
+	    pa->tcp->dst_port != pb->tcp->dst_port)
+		return false;
+
+	if (RTE_ETH_IS_IPV4_HDR(pa->m->packet_type))
+		return pa->iph.ip4h->src_addr == pb->iph.ip4h->src_addr &&
+		       pa->iph.ip4h->dst_addr == pb->iph.ip4h->dst_addr &&
+		       pa->iph.ip4h->type_of_service == pb->iph.ip4h->type_of_service &&
+		       pa->iph.ip4h->time_to_live == pb->iph.ip4h->time_to_live;
+
+	return !memcmp(pa->iph.ip6h->src_addr, pb->iph.ip6h->src_addr, sizeof(pa->iph.ip6h->src_addr)) &&
+	       !memcmp(pa->iph.ip6h->dst_addr, pb->iph.ip6h->dst_addr, sizeof(pa->iph.ip6h->dst_addr)) &&
+	       pa->iph.ip6h->vtc_flow == pb->iph.ip6h->vtc_flow &&
+	       pa->iph.ip6h->hop_limits == pb->iph.ip6h->hop_limits;
+}
+
+/* The MSS of the side an optimized, established flow's segment will be sent
+ * to, or 0 if its segments are not to be coalesced. */
+static uint16_t
+tcp_coalesce_mss(const struct tcp_worker *w, const struct tfo_pkt_in *p)
+{
+	struct tfo_eflow *ef;
+
+	if (RTE_ETH_IS_IPV4_HDR(p->m->packet_type)) {
+		if (p->from_priv)
+			ef = tfo_eflow_v4_lookup(w, rte_be_to_cpu_32(p->iph.ip4h->src_addr), rte_be_to_cpu_16(p->tcp->src_port),
+						 rte_be_to_cpu_32(p->iph.ip4h->dst_addr), rte_be_to_cpu_16(p->tcp->dst_port), p->flow_hash);
+		else
+			ef = tfo_eflow_v4_lookup(w, rte_be_to_cpu_32(p->iph.ip4h->dst_addr), rte_be_to_cpu_16(p->tcp->dst_port),
+						 rte_be_to_cpu_32(p->iph.ip4h->src_addr), rte_be_to_cpu_16(p->tcp->src_port), p->flow_hash);
+	} else {
+		if (p->from_priv)
+			ef = tfo_eflow_v6_lookup(w, (struct in6_addr *)p->iph.ip6h->src_addr, rte_be_to_cpu_16(p->tcp->src_port),
+						 (struct in6_addr *)p->iph.ip6h->dst_addr, rte_be_to_cpu_16(p->tcp->dst_port), p->flow_hash);
+		else
+			ef = tfo_eflow_v6_lookup(w, (struct in6_addr *)p->iph.ip6h->dst_addr, rte_be_to_cpu_16(p->tcp->dst_port),
+						 (struct in6_addr *)p->iph.ip6h->src_addr, rte_be_to_cpu_16(p->tcp->src_port), p->flow_hash);
+	}
+
+	if (!ef || !ef->fo || ef->state != TCP_STATE_ESTABLISHED)
+		return 0;
+
+	return (p->from_priv ? &ef->fo->pub : &ef->fo->priv)->mss;
+}
+
+static inline uint16_t
+cksum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/* The one's complement sum of a segment's payload, worked out from the TCP
+ * checksum without reading the payload. If the checksum is wrong, so is the
+ * sum, and the error is carried into the checksum of the coalesced segment. */
+static inline uint16_t
+tcp_payload_cksum(const struct tfo_pkt_in *p, uint8_t tcp_hdr_len)
+{
+	uint32_t sum;
+
+	if (RTE_ETH_IS_IPV4_HDR(p->m->packet_type))
+		sum = rte_ipv4_phdr_cksum(p->iph.ip4h, 0);
+	else
+		sum = rte_ipv6_phdr_cksum(p->iph.ip6h, 0);
+	sum += rte_raw_cksum(p->tcp, tcp_hdr_len);
+
+	return ~cksum_fold(sum);
+}
+
+/* Coalesce segment pb onto the end of the earlier segment pa of the same flow.
+ * pa takes the ACK, window, flags and timestamp of pb, since they are the
+ * most recent, and pb's payload is chained onto pa's mbuf. */
+static bool
+tcp_coalesce_seg(const struct tcp_worker *w, struct tfo_pkt_in *pa, struct tfo_pkt_in *pb)
+{
+	uint8_t tcp_hdr_len = (pa->tcp->data_off & 0xf0) >> 2;
+	uint32_t a_len, b_len;
+	uint32_t sum;
+	uint16_t a_sum, b_sum;
+	uint16_t new_len;
+
+	/* pa must not have PSH set, since that ends what can be coalesced */
+	if (pa->tcp->tcp_flags != RTE_TCP_ACK_FLAG ||
+	    ((pb->tcp->data_off & 0xf0) >> 2) != tcp_hdr_len ||
+	    pa->m->nb_segs >= COALESCE_MAX_SEGS ||
+	    pb->m->nb_segs != 1)
+		return false;
+
+	a_len = tcp_payload_len(pa);
+	b_len = tcp_payload_len(pb);
+	if (rte_be_to_cpu_32(pb->tcp->sent_seq) != rte_be_to_cpu_32(pa->tcp->sent_seq) + a_len ||
+	    before(rte_be_to_cpu_32(pb->tcp->recv_ack), rte_be_to_cpu_32(pa->tcp->recv_ack)))
+		return false;
+
+	/* There is no TSO, so the coalesced segment must be sendable as is */
+	if (a_len + b_len + tcp_hdr_len - sizeof(struct rte_tcp_hdr) > tcp_coalesce_mss(w, pa))
+		return false;
+
+	a_sum = tcp_payload_cksum(pa, tcp_hdr_len);
+	b_sum = tcp_payload_cksum(pb, tcp_hdr_len);
+
+	/* pb's payload starts at an odd offset if pa's length is odd */
+	if (a_len & 1)
+		b_sum = (b_sum << 8) | (b_sum >> 8);
+
+	pa->tcp->recv_ack = pb->tcp->recv_ack;
+	pa->tcp->rx_win = pb->tcp->rx_win;
+	pa->tcp->tcp_flags = pb->tcp->tcp_flags;
+	if (tcp_hdr_len > sizeof(struct rte_tcp_hdr))
+		memcpy(pa->tcp + 1, pb->tcp + 1, tcp_hdr_len - sizeof(struct rte_tcp_hdr));
+
+	rte_pktmbuf_adj(pb->m, (uint8_t *)pb->tcp + tcp_hdr_len - rte_pktmbuf_mtod(pb->m, uint8_t *));
+	rte_pktmbuf_chain(pa->m, pb->m);
+	pa->pktlen += b_len;
+
+	if (RTE_ETH_IS_IPV4_HDR(pa->m->packet_type)) {
+		new_len = rte_cpu_to_be_16(rte_be_to_cpu_16(pa->iph.ip4h->total_length) + b_len);
+		pa->iph.ip4h->hdr_checksum = update_checksum(pa->iph.ip4h->hdr_checksum, &pa->iph.ip4h->total_length, &new_len, sizeof(new_len));
+		sum = rte_ipv4_phdr_cksum(pa->iph.ip4h, 0);
+	} else {
+		pa->iph.ip6h->payload_len = rte_cpu_to_be_16(rte_be_to_cpu_16(pa->iph.ip6h->payload_len) + b_len);
+		sum = rte_ipv6_phdr_cksum(pa->iph.ip6h, 0);
 	}
 
-	if (tx_bufs->m) {
-		rte_free(tx_bufs->m);
-		rte_free(tx_bufs->acks);
+	pa->tcp->cksum = 0;
+	sum += rte_raw_cksum(pa->tcp, tcp_hdr_len) + a_sum + b_sum;
+	pa->tcp->cksum = ~cksum_fold(sum);
+
+	return true;
+}
+
+/* Coalesce the in order data segments of each flow in a group of packets,
+ * so that they are queued, acked and sent as one packet. A segment is only
+ * coalesced into the preceding packet of its flow in the group, so the order
+ * of the packets of the flow in both directions is unchanged. */
+static void
+tcp_coalesce_group(struct tcp_worker *w, struct tfo_pkt_in *pkts, int *pkt_ret, uint16_t n)
+{
+	uint16_t i, j;
+
+	for (i = 1; i < n; i++) {
+		if (pkt_ret[i] != TFO_PKT_HANDLED ||
+		    !tcp_seg_can_coalesce(&pkts[i]))
+			continue;
+
+		for (j = i; j-- > 0; ) {
+			if (pkt_ret[j] != TFO_PKT_HANDLED ||
+			    pkts[j].flow_hash != pkts[i].flow_hash ||
+			    !tcp_header_complete(pkts[j].m, pkts[j].tcp))
+				continue;
+
+			/* Both directions of a flow have the same hash */
+			if (pkts[j].from_priv != pkts[i].from_priv)
+				break;
+
+			if (!tcp_seg_same_flow(&pkts[j], &pkts[i]))
+				continue;
+
+			if (tcp_seg_can_coalesce(&pkts[j]) &&
+			    tcp_coalesce_seg(w, &pkts[j], &pkts[i])) {
+				pkt_ret[i] = TFO_PKT_COALESCED;
+				++w->st.coalesced_pkt;
+			}
+			break;
+		}
 	}
 }
 
 __visible struct tfo_tx_bufs *
 tcp_worker_mbuf_burst(struct rte_mbuf **rx_buf, uint16_t nb_rx, struct timespec *ts, struct tfo_tx_bufs *tx_bufs)
 {
-	uint16_t i;
+	uint16_t base, n, i;
 	struct tcp_worker *w = &worker;
 	int ret = -1;
+	struct tfo_pkt_in pkts[BURST_PREFETCH_SIZE];
+	int pkt_ret[BURST_PREFETCH_SIZE];
+	struct tfo_eflow *ef_cand[BURST_PREFETCH_SIZE];
 	struct timespec ts_local;
 	struct rte_mbuf *m;
 	bool from_priv;
@@ -7458,6 +9657,18 @@ tcp_worker_mbuf_burst(struct rte_mbuf **rx_buf, uint16_t nb_rx, struct timespec
 
 	now = timespec_to_ns(&w->ts);
 
+	/* Packets on the TX queue are sent before those of this burst */
+	if (unlikely(txq_use(&w->txq) || !list_empty(&w->txq.throttled))) {
+#ifdef DEBUG_RESEND_FAILED_PACKETS
+		printf("Resending %u queued packets\n", txq_use(&w->txq));
+#endif
+		txq_drain(w, tx_bufs);
+	}
+
+	eflow_hash_maintain(w);
+
+	w->defer_acks = true;
+
 #ifdef DEBUG_BURST
 	format_debug_time();
 	printf("\n%s Burst received %u pkts time %s\n", debug_time_abs, nb_rx, debug_time_rel);
@@ -7468,7 +9679,18 @@ tcp_worker_mbuf_burst(struct rte_mbuf **rx_buf, uint16_t nb_rx, struct timespec
 		write_pcap(rx_buf, nb_rx, RTE_PCAPNG_DIRECTION_IN);
 #endif
 
-	for (i = 0; i < nb_rx; i++) {
+	/* The burst is processed in groups of up to BURST_PREFETCH_SIZE packets.
+	 * All the packets of a group are parsed and their hash buckets
+	 * prefetched, then the candidate eflows and their tfos are prefetched,
+	 * optionally in order data segments of a flow are coalesced, and
+	 * finally the packets are processed in order. The lookup is still
+	 * done when each packet is processed, since an earlier packet may have
+	 * created or freed an eflow. */
+	for (base = 0; base < nb_rx; base += n) {
+		n = nb_rx - base < BURST_PREFETCH_SIZE ? nb_rx - base : BURST_PREFETCH_SIZE;
+
+		rte_prefetch0(rte_pktmbuf_mtod(rx_buf[base], void *));
+
 // Note: driver may not support packet_type, in which case we want to set these
 // ourselves. Use rte_the_dev_get_supported_ptypes() to find what is supported,
 // see examples/l3fwd/l3fwd_em.c.
@@ -7477,76 +9699,121 @@ tcp_worker_mbuf_burst(struct rte_mbuf **rx_buf, uint16_t nb_rx, struct timespec
 // If (!all_classified) classify_pkt(w->classified, m);
 // rte_net_get_ptype() in lib/net/rte_net.c looks good but inefficient
 // SYN can get ICMP responses - see with wireshark and Linux to Linux connection to closed port
+		/* Stage 1 - parse the headers, hash and prefetch the hash bucket */
+		for (i = 0; i < n; i++) {
+			m = rx_buf[base + i];
+
+			if (i + 1 < n)
+				rte_prefetch0(rte_pktmbuf_mtod(rx_buf[base + i + 1], void *));
+
+			if (!m->data_len ||
+			    (m->packet_type & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_TCP) {
+				pkt_ret[i] = TFO_PKT_NOT_TCP;
+				continue;
+			}
+
+			if (unlikely(rx_cksum_bad(m))) {
+				++w->st.rx_bad_cksum;
+				NO_INLINE_WARNING(rte_pktmbuf_free(m));
+				pkt_ret[i] = TFO_PKT_BAD_CKSUM;
+				continue;
+			}
+
+#ifdef DEBUG_DUPLICATE_MBUFS
+			if (check_mbuf_in_use(m, w, tx_bufs))
+				printf("Received mbuf %p already in use\n", m);
+#endif
+
+			pkt_ret[i] = tcp_worker_mbuf_parse(m, !!(m->ol_flags & config->dynflag_priv_mask), &pkts[i]);
+		}
+
+		/* Stage 2 - prefetch the eflows, then their tfos */
+		for (i = 0; i < n; i++) {
+			ef_cand[i] = NULL;
+			if (pkt_ret[i] == TFO_PKT_HANDLED &&
+			    (ef_cand[i] = tfo_eflow_candidate(w, pkts[i].flow_hash)))
+				rte_prefetch0(ef_cand[i]);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ef_cand[i] && ef_cand[i]->fo) {
+				rte_prefetch0(&ef_cand[i]->fo->priv);
+				rte_prefetch0(&ef_cand[i]->fo->pub);
+			}
+		}
+
+		/* Stage 3 - coalesce in order segments */
+		if (option_flags & TFO_CONFIG_FL_COALESCE)
+			tcp_coalesce_group(w, pkts, pkt_ret, n);
+
+		/* Stage 4 - process the packets */
+		for (i = 0; i < n; i++) {
+			if (pkt_ret[i] == TFO_PKT_COALESCED ||
+			    pkt_ret[i] == TFO_PKT_BAD_CKSUM)
+				continue;
+
 #ifdef DEBUG_PKT_NUM
-		printf("Processing packet %u\n", ++pkt_num);
+			printf("Processing packet %u\n", ++pkt_num);
 #endif
-		m = rx_buf[i];
+			m = rx_buf[base + i];
 
-		if (!m->data_len) {
+			if (!m->data_len) {
 #ifdef DEBUG_EMPTY_PACKETS
-			char ptype[128];
-			rte_get_ptype_name(m->packet_type, ptype, sizeof(ptype));
-			printf("ERROR *** Received packet mbuf %p data_len %u pkt_len %u packet_type %s (0x%x) pool %s\n", m, m->data_len, m->pkt_len, ptype, m->packet_type, m->pool->name);
+				char ptype[128];
+				rte_get_ptype_name(m->packet_type, ptype, sizeof(ptype));
+				printf("ERROR *** Received packet mbuf %p data_len %u pkt_len %u packet_type %s (0x%x) pool %s\n", m, m->data_len, m->pkt_len, ptype, m->packet_type, m->pool->name);
 #endif
-			rte_pktmbuf_free(m);
-			continue;
-		}
+				rte_pktmbuf_free(m);
+				continue;
+			}
 
 #ifdef DEBUG_CHECKSUM
-		if ((m->packet_type & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_TCP)
-			check_checksum_in(m, "Received packet");
+			if ((m->packet_type & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_TCP)
+				check_checksum_in(m, "Received packet");
 #endif
 
-		from_priv = !!(m->ol_flags & config->dynflag_priv_mask);
+			from_priv = !!(m->ol_flags & config->dynflag_priv_mask);
 
-		if ((m->packet_type & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_TCP ||
-		    ((ret = tcp_worker_mbuf_pkt(w, m, from_priv, tx_bufs)) != TFO_PKT_HANDLED &&
-		     ret != TFO_PKT_INVALID)) {
-			if (option_flags & TFO_CONFIG_FL_NO_VLAN_CHG)
-				m->ol_flags ^= config->dynflag_priv_mask;
-			else
-				m->vlan_tci = from_priv ? pub_vlan_tci : priv_vlan_tci;
+			if ((ret = pkt_ret[i]) == TFO_PKT_HANDLED)
+				ret = tfo_mbuf_in(w, &pkts[i], tx_bufs);
+
+			if (ret != TFO_PKT_HANDLED && ret != TFO_PKT_INVALID) {
+				if (option_flags & TFO_CONFIG_FL_NO_VLAN_CHG)
+					m->ol_flags ^= config->dynflag_priv_mask;
+				else
+					m->vlan_tci = from_priv ? pub_vlan_tci : priv_vlan_tci;
 
-			if (update_pkt(m, NULL)) {
+				if (update_pkt(m, NULL)) {
 #ifdef DEBUG_QUEUE_PKTS
-				printf("adding tx_buf %p, vlan %u, ret %d\n", m, m->vlan_tci, ret);
+					printf("adding tx_buf %p, vlan %u, ret %d\n", m, m->vlan_tci, ret);
 #endif
-				add_tx_buf(w, m, tx_bufs, from_priv, (union tfo_ip_p)(struct rte_ipv4_hdr *)NULL, true);
-			} else
-				printf("dropping tx_buf %p, vlan %u, ret %d, no room for vlan header\n", m, m->vlan_tci, ret);
+					add_tx_buf(w, m, tx_bufs, from_priv, (union tfo_ip_p)(struct rte_ipv4_hdr *)NULL, true);
+				} else
+					printf("dropping tx_buf %p, vlan %u, ret %d, no room for vlan header\n", m, m->vlan_tci, ret);
+			}
 		}
 	}
 
-	if (!tx_bufs->nb_tx && tx_bufs->m) {
-		rte_free(tx_bufs->m);
-		rte_free(tx_bufs->acks);
-		tx_bufs->m = NULL;
-	}
+	send_pending_acks(w, tx_bufs);
+
+	reclaim_flush(w);
 
 	return tx_bufs;
 }
 
+/* Called by the app if it sends the packets itself, when tfo_post_send()
+ * returns true, to send the packets on the TX queue */
 __visible void
 tfo_setup_failed_resend(struct tfo_tx_bufs *tx_bufs)
 {
-	struct tfo_pkt *pkt, *tmp_pkt;
-	struct tfo_mbuf_priv *priv;
-	struct tfo *fo;
-
 	tx_bufs->nb_tx = 0;
-	list_for_each_entry_safe(pkt, tmp_pkt, &send_failed_list, send_failed_list) {
-		priv = get_priv_addr(pkt->m);
-		fo = &worker.f[priv->fos->ef->tfo_idx];
-		send_tcp_pkt(&worker, pkt, tx_bufs, priv->fos,
-			     &fo->priv == priv->fos ? &fo->pub : &fo->priv, false);
-		list_del_init(&pkt->send_failed_list);
-	}
+	txq_drain(&worker, tx_bufs);
 }
 
 __visible void
 tcp_worker_mbuf_burst_send(struct rte_mbuf **rx_buf, uint16_t nb_rx, struct timespec *ts)
 {
-	struct tfo_tx_bufs tx_bufs = { .nb_inc = nb_rx };
+	struct tfo_tx_bufs tx_bufs = { .m = NULL };
 
 #ifdef DEBUG_MEMPOOL
 	show_mempool("packet_pool_0");
@@ -7563,20 +9830,6 @@ tcp_worker_mbuf_burst_send(struct rte_mbuf **rx_buf, uint16_t nb_rx, struct time
 #endif
 	if (tx_bufs.nb_tx)
 		tfo_send_burst(&tx_bufs);
-
-	/* Are there any packets that tried to be sent but failed */
-	if (!list_empty(&send_failed_list)) {
-		tx_bufs.m = NULL;
-		tx_bufs.acks = NULL;
-
-		tfo_setup_failed_resend(&tx_bufs);
-
-#ifdef DEBUG_RESEND_FAILED_PACKETS
-		printf("Resending %u failed packets\n", tx_bufs.nb_tx);
-#endif
-
-		tfo_send_burst(&tx_bufs);
-	}
 }
 
 __visible struct tfo_tx_bufs *
@@ -7604,7 +9857,7 @@ process_eflow_timeout(struct tcp_worker *w, struct tfo_eflow *ef, struct tfo_tx_
 	struct tfo *fo;
 	bool shutdown;
 
-	fo = &w->f[ef->tfo_idx];
+	fo = ef->fo;
 	fos = &fo->priv;
 	foos = &fo->pub;
 
@@ -7650,12 +9903,8 @@ tfo_process_timers(const struct timespec *ts, struct tfo_tx_bufs *tx_bufs)
 	struct tcp_worker *w = &worker;
 	struct timer_rb_node *timer;
 
-
-	if (RB_EMPTY_ROOT(&timer_tree.rb_root)) {
-		/* We shouldn't get here. If there are no eflows,
-		 * then no timer should be running */
-		return;
-	}
+	/* Allow the hash table to shrink while there are no packets */
+	eflow_hash_maintain(w);
 
 	if (ts)
 		w->ts = *ts;
@@ -7663,6 +9912,15 @@ tfo_process_timers(const struct timespec *ts, struct tfo_tx_bufs *tx_bufs)
 		clock_gettime(CLOCK_MONOTONIC_RAW, &w->ts);
 	now = timespec_to_ns(&w->ts);
 
+	if (unlikely(txq_drain_due(w)))
+		txq_drain(w, tx_bufs);
+
+	if (RB_EMPTY_ROOT(&timer_tree.rb_root)) {
+		/* We shouldn't get here. If there are no eflows,
+		 * then no timer should be running */
+		return;
+	}
+
 	timer = rb_entry(rb_first_cached(&timer_tree), struct timer_rb_node, node);
 
 #ifdef DEBUG_TIMERS
@@ -7683,12 +9941,14 @@ tfo_process_timers(const struct timespec *ts, struct tfo_tx_bufs *tx_bufs)
 
 		timer = rb_entry(rb_first_cached(&timer_tree), struct timer_rb_node, node);
 	}
+
+	reclaim_flush(w);
 }
 
 __visible void
 tfo_process_timers_send(const struct timespec *ts)
 {
-	struct tfo_tx_bufs tx_bufs = { .nb_inc = 1024 };
+	struct tfo_tx_bufs tx_bufs = { .m = NULL };
 
 	tfo_process_timers(ts, &tx_bufs);
 
@@ -7708,6 +9968,10 @@ dump_config(const struct tcp_config *c)
 	printf("hef_mask = %u\n", c->hef_mask);
 	printf("f_n = %u\n", c->f_n);
 	printf("p_n = %u\n", c->p_n);
+	printf("flow buffer quota = %u bytes, %u mbufs\n", c->flow_buf_bytes, c->flow_buf_mbufs);
+	printf("worker buffer quota = %" PRIu64 " bytes, %u mbufs\n", c->worker_buf_bytes, c->worker_buf_mbufs);
+	printf("tx queue depth = %u, drain timeout = %u us\n", c->tx_queue_depth, c->tx_queue_drain_us);
+	printf("checksum offload = %s\n", c->option_flags & TFO_CONFIG_FL_CKSUM_OFFLOAD ? "yes" : "no");
 	printf("tcp_min_rtt_wlen = %u\n", c->tcp_min_rtt_wlen);
 	printf("keepalive timer = %u\n", c->tcp_keepalive_time);
 	printf("keepalive probes = %u\n", c->tcp_keepalive_probes);
@@ -7743,6 +10007,8 @@ em_check_ptype(int portid)
 }
 #endif
 
+/* Returns the private dynamic flag mask, or 0 if the worker's memory cannot
+ * be allocated */
 __visible uint64_t
 tcp_worker_init(struct tfo_worker_params *params)
 {
@@ -7750,7 +10016,6 @@ tcp_worker_init(struct tfo_worker_params *params)
 	struct tcp_worker *w;
 	struct tcp_config *c;
 	struct tfo_pkt *p;
-	struct tfo *f;
 	struct tfo_eflow *ef;
 	unsigned k;
 	int j;
@@ -7791,50 +10056,93 @@ tcp_worker_init(struct tfo_worker_params *params)
 	w = &worker;
 
 	w->param = params->params;
-	INIT_LIST_HEAD(&send_failed_list);
 	pub_vlan_tci = params->public_vlan_tci;
 	priv_vlan_tci = params->private_vlan_tci;
 	ack_pool = params->ack_pool;
 	port_id = params->port_id;
 	queue_idx = params->queue_idx;
 	option_flags = node_config_copy[socket_id]->option_flags;
+	buf_quotas = c->flow_buf_bytes || c->flow_buf_mbufs || c->worker_buf_bytes || c->worker_buf_mbufs;
 
 	if (ack_pool)
 		ack_pool_priv_size = rte_pktmbuf_priv_size(ack_pool);
 
+	small_pool = params->small_pool;
+	if (small_pool)
+		small_pool_max_len = rte_pktmbuf_data_room_size(small_pool) - RTE_PKTMBUF_HEADROOM;
+
+	/* The send buffer header templates are held in ack mbufs */
+	if (ack_pool)
+		sndbuf_pool = params->sndbuf_pool;
+
 #ifdef DEBUG_CONFIG
 	printf("tfo_worker_init port %u queue_idx %u, vlan_tci: pub %u priv %u\n", port_id, queue_idx, pub_vlan_tci, priv_vlan_tci);
 #endif
 
-	struct tfo_eflow *ef_mem = rte_malloc("worker ef", c->ef_n * sizeof (struct tfo_eflow), 0);
+	w->of_n = min(c->f_n, c->ef_n);
+	w->oflows = rte_malloc("worker oflows", w->of_n * sizeof (struct tfo_oflow), RTE_CACHE_LINE_SIZE);
+	w->flows = NULL;
+	if (c->ef_n > w->of_n)
+		w->flows = rte_malloc("worker flows", (c->ef_n - w->of_n) * sizeof (struct tfo_flow), RTE_CACHE_LINE_SIZE);
+#ifdef EFLOW_BUCKET_HASH
+	w->hef = rte_calloc("worker hef", c->hef_n, sizeof (struct tfo_eflow_bucket), RTE_CACHE_LINE_SIZE);
+	w->hef_spare = rte_calloc("worker hef spare", c->hef_n, sizeof (struct tfo_eflow_bucket), RTE_CACHE_LINE_SIZE);
+#else
 	w->hef = rte_calloc("worker hef", c->hef_n, sizeof (struct hlist_head), 0);
-	struct tfo *f_mem = rte_malloc("worker f", c->f_n * sizeof (struct tfo), 0);
+	w->hef_spare = rte_calloc("worker hef spare", c->hef_n, sizeof (struct hlist_head), 0);
+#endif
+	w->hef_max = c->hef_n;
+	w->hef_mask = min(c->hef_n, EF_HASH_MIN_BUCKETS) - 1;
+	w->hef_old = NULL;
 	struct tfo_pkt *p_mem = rte_malloc("worker p", c->p_n * sizeof (struct tfo_pkt), 0);
 
 #ifdef DEBUG_PKTS
 	w->p = p_mem;
 #endif
-w->ef = ef_mem;
-w->f = f_mem;
-
+	w->ack_tmpl = rte_calloc("worker ack templates", w->of_n * 2, sizeof(struct tfo_ack_tmpl), RTE_CACHE_LINE_SIZE);
+
+	w->max_tx = TFO_TX_BUFS_SIZE;
+	w->tx_m = rte_malloc("worker tx_m", w->max_tx * sizeof(struct rte_mbuf *), RTE_CACHE_LINE_SIZE);
+	w->tx_discard = rte_malloc("worker tx_discard", w->max_tx * sizeof(uint8_t), RTE_CACHE_LINE_SIZE);
+
+	w->txq.depth = c->tx_queue_depth;
+	w->txq.acks = rte_malloc("worker txq", w->txq.depth * sizeof(struct rte_mbuf *), RTE_CACHE_LINE_SIZE);
+	w->txq.pkts[TFO_TXQ_RESEND] = rte_malloc("worker txq resend", w->txq.depth * sizeof(struct tfo_pkt *), RTE_CACHE_LINE_SIZE);
+	w->txq.pkts[TFO_TXQ_NEW] = rte_malloc("worker txq new", w->txq.depth * sizeof(struct tfo_pkt *), RTE_CACHE_LINE_SIZE);
+	INIT_LIST_HEAD(&w->txq.throttled);
+
+	if (!w->oflows || (!w->flows && c->ef_n > w->of_n) || !w->hef || !w->hef_spare || !p_mem || !w->ack_tmpl || !w->tx_m || !w->tx_discard ||
+	    !w->txq.acks || !w->txq.pkts[TFO_TXQ_RESEND] || !w->txq.pkts[TFO_TXQ_NEW]) {
+		printf("Unable to allocate memory for worker port %u queue_idx %u\n", port_id, queue_idx);
+		rte_free(w->oflows);
+		rte_free(w->flows);
+		rte_free(w->hef);
+		rte_free(w->hef_spare);
+		rte_free(p_mem);
+		rte_free(w->ack_tmpl);
+		rte_free(w->tx_m);
+		rte_free(w->tx_discard);
+		rte_free(w->txq.acks);
+		rte_free(w->txq.pkts[TFO_TXQ_RESEND]);
+		rte_free(w->txq.pkts[TFO_TXQ_NEW]);
+
+		return 0;
+	}
+
+	INIT_HLIST_HEAD(&w->of_free);
 	INIT_HLIST_HEAD(&w->ef_free);
 	for (j = c->ef_n - 1; j >= 0; j--) {
-		ef = ef_mem + j;
-		ef = &w->ef[j];
+		ef = tfo_eflow_from_idx(w, j);
 		ef->flags = 0;
-		ef->tfo_idx = TFO_IDX_UNUSED;
+		ef->fo = NULL;
 		ef->state = TFO_STATE_NONE;
 /* I think we can use ef->hlist instead of ef->flist. We can
  * then remove ef->flist, and user->flow_list */
-		hlist_add_head(&ef->hlist, &w->ef_free);
-	}
-
-	INIT_LIST_HEAD(&w->f_free);
-	for (k = 0; k < c->f_n; k++) {
-		f = f_mem + k;
-// Why don't we just use a pointer ?
-		f->idx = k;
-		list_add_tail(&f->list, &w->f_free);
+		if ((uint32_t)j < w->of_n) {
+			w->oflows[j].fo.idx = j;
+			hlist_add_head(&ef->hlist, &w->of_free);
+		} else
+			hlist_add_head(&ef->hlist, &w->ef_free);
 	}
 
 	INIT_LIST_HEAD(&w->p_free);
@@ -7842,7 +10150,7 @@ w->f = f_mem;
 		p = p_mem + k;
 		list_add_tail(&p->list, &w->p_free);
 		INIT_LIST_HEAD(&p->xmit_ts_list);
-		INIT_LIST_HEAD(&p->send_failed_list);
+		p->in_txq = false;
 	}
 
 	/* Initialise the timer RB tree */
@@ -7856,7 +10164,8 @@ w->f = f_mem;
 	return config->dynflag_priv_mask;
 }
 
-__visible void
+/* Returns 0, or -1 if the dynamic mbuf flag cannot be registered */
+__visible int
 tcp_init(const struct tcp_config *c)
 {
 	global_config_data = *c;
@@ -7866,6 +10175,14 @@ tcp_init(const struct tcp_config *c)
 		.flags = 0,
 	};
 
+#ifdef EFLOW_BUCKET_HASH
+	/* hef_n is the maximum number of buckets. Allow for a load factor of no
+	 * more than 80% with all the eflows in use. */
+	global_config_data.hef_n = max(global_config_data.hef_n, global_config_data.ef_n) * 5 / 4;
+	global_config_data.hef_n = (global_config_data.hef_n + EF_BUCKET_ENTRIES - 1) / EF_BUCKET_ENTRIES;
+	if (global_config_data.hef_n < 2)
+		global_config_data.hef_n = 2;
+#endif
 	global_config_data.hef_n = next_power_of_2(global_config_data.hef_n);
 	global_config_data.hef_mask = global_config_data.hef_n - 1;
 	global_config_data.option_flags = c->option_flags;
@@ -7873,6 +10190,8 @@ tcp_init(const struct tcp_config *c)
 	global_config_data.tcp_keepalive_time = c->tcp_keepalive_time ?: 7200;
 	global_config_data.tcp_keepalive_probes = c->tcp_keepalive_probes ?: 9;
 	global_config_data.tcp_keepalive_intvl = c->tcp_keepalive_intvl ?: 75;
+	global_config_data.tx_queue_depth = c->tx_queue_depth ?: 512;
+	global_config_data.tx_queue_drain_us = c->tx_queue_drain_us ?: 100;
 	global_config_data.mbuf_priv_offset = c->mbuf_priv_offset;
 #ifdef PER_THREAD_LOGS
 	global_config_data.log_file_name_template = c->log_file_name_template;
@@ -7886,9 +10205,11 @@ tcp_init(const struct tcp_config *c)
 		global_config_data.tx_burst = rte_eth_tx_burst;
 
 	flag = rte_mbuf_dynflag_register(&dynflag);
-	if (flag == -1)
-		fprintf(stderr, "failed to register in-priv dynamic flag, flag=%d: %s",
-			flag, strerror(errno));
+	if (flag == -1) {
+		fprintf(stderr, "failed to register in-priv dynamic flag: %s\n",
+			rte_strerror(rte_errno));
+		return -1;
+	}
 
 	/* set a dynamic flag mask */
 	global_config_data.dynflag_priv_mask = (1ULL << flag);
@@ -7911,6 +10232,8 @@ tcp_init(const struct tcp_config *c)
 	ts = ctime(&start_time[0].tv_sec);
 	printf("\nStarted at %.10s%.5s %.8s.%9.9ld\n\n", ts, ts + 19, ts + 11, start_time[0].tv_nsec);
 #endif
+
+	return 0;
 }
 
 __visible uint16_t __attribute__((const))
@@ -7927,3 +10250,17 @@ tfo_get_mbuf_priv_size(void)
 {
 	return sizeof(struct tfo_mbuf_priv);
 }
+
+__visible uint32_t __attribute__((const))
+tfo_get_sndbuf_chunk_size(void)
+{
+	return sizeof(struct tfo_sndbuf_chunk);
+}
+
+__visible const uint8_t *
+tfo_get_rss_key(uint8_t *key_len)
+{
+	*key_len = sizeof(symmetric_rss_key);
+
+	return symmetric_rss_key;
+}
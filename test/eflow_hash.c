@@ -0,0 +1,203 @@
+/* Check the bucketed cuckoo eflow hash table while eflows are added, deleted
+ * and moved to w->oflows, and the table grows, shrinks and is migrated. The
+ * bucketed table is tested whether or not the library is configured to use it. */
+#include "tfo_config.h"
+
+#ifndef EFLOW_BUCKET_HASH
+#define EFLOW_BUCKET_HASH 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "tfo_eflow_hash.h"
+
+#define NUM_EFLOWS	2048
+#define NUM_OFLOWS	512	/* of the eflows, the number in w->oflows */
+#define NUM_OPS		50000
+#define PHASE_OPS	5000	/* alternate between filling and emptying */
+#define MAX_BUCKETS	512
+
+static struct tcp_worker worker;
+
+static bool in_use[NUM_EFLOWS];
+static unsigned errors;
+
+static void
+error(unsigned n, const char *what, unsigned idx)
+{
+	printf("op %u: %s, eflow %u, hef_n %u, hef_old %s, migrated %u\n",
+		n, what, idx, worker.hef_mask + 1, worker.hef_old ? "yes" : "no", worker.hef_migrate);
+	errors++;
+}
+
+/* Check every slot of a table refers to an eflow in use, in one of its
+ * two buckets, and count the references to each eflow */
+static void
+check_table(unsigned n, bool old, unsigned *refs)
+{
+	const struct tcp_worker *w = &worker;
+	const struct tfo_eflow_bucket *hef = old ? w->hef_old : w->hef;
+	uint32_t hef_mask = old ? w->hef_old_mask : w->hef_mask;
+	const struct tfo_eflow *ef;
+	uint32_t bkt, i, idx;
+	uint16_t sig;
+
+	for (bkt = 0; bkt <= hef_mask; bkt++) {
+		for (i = 0; i < EF_BUCKET_ENTRIES; i++) {
+			if (hef[bkt].sig[i] == EF_SIG_EMPTY)
+				continue;
+
+			idx = hef[bkt].ef_idx[i];
+			if (idx >= NUM_EFLOWS) {
+				error(n, "bad eflow index", idx);
+				continue;
+			}
+			if (old && bkt < w->hef_migrate)
+				error(n, "eflow in migrated bucket", idx);
+
+			ef = tfo_eflow_from_idx(w, idx);
+			sig = tfo_eflow_bucket_sig(ef->flow_hash);
+			if (hef[bkt].sig[i] != sig)
+				error(n, "signature wrong", idx);
+			if (bkt != (ef->flow_hash & hef_mask) &&
+			    bkt != tfo_eflow_alt_bucket(hef_mask, ef->flow_hash & hef_mask, sig))
+				error(n, "eflow in wrong bucket", idx);
+			if (!in_use[idx])
+				error(n, "deleted eflow in table", idx);
+			refs[idx]++;
+		}
+	}
+}
+
+static void
+check(unsigned n)
+{
+	const struct tcp_worker *w = &worker;
+	static unsigned refs[NUM_EFLOWS];
+	const struct tfo_eflow *ef;
+	unsigned i;
+
+	memset(refs, 0, sizeof(refs));
+	check_table(n, false, refs);
+	if (w->hef_old)
+		check_table(n, true, refs);
+
+	/* The spare table is used by the next resize without being cleared */
+	if (w->hef_spare) {
+		for (i = 0; i < w->hef_max * EF_BUCKET_ENTRIES; i++) {
+			if (w->hef_spare[i / EF_BUCKET_ENTRIES].sig[i % EF_BUCKET_ENTRIES] != EF_SIG_EMPTY)
+				error(n, "spare table not empty", i / EF_BUCKET_ENTRIES);
+		}
+	}
+
+	for (i = 0; i < NUM_EFLOWS; i++) {
+		ef = tfo_eflow_from_idx(w, i);
+		if (refs[i] != in_use[i])
+			error(n, in_use[i] ? "eflow not in table once" : "eflow in table", i);
+		if (tfo_eflow_v4_lookup(w, ef->priv_addr.s_addr, ef->priv_port, ef->pub_addr.s_addr,
+					ef->pub_port, ef->flow_hash) != (in_use[i] ? ef : NULL))
+			error(n, "lookup wrong", i);
+	}
+}
+
+/* As _eflow_move_to_oflows() does, but the eflow left behind keeps the key
+ * of the eflow it is moved to, so that the keys stay unique */
+static void
+move(unsigned n, unsigned idx)
+{
+	struct tcp_worker *w = &worker;
+	struct tfo_flow *flow = container_of(tfo_eflow_from_idx(w, idx), struct tfo_flow, ef);
+	struct tfo_flow tmp;
+	unsigned new_idx;
+
+	for (new_idx = random() % NUM_OFLOWS; in_use[new_idx]; new_idx = (new_idx + 1) % NUM_OFLOWS)
+		;
+
+	tmp = w->oflows[new_idx].flow;
+	w->oflows[new_idx].flow = *flow;
+	eflow_hash_move(w, &flow->ef, &w->oflows[new_idx].flow.ef);
+	*flow = tmp;
+
+	in_use[idx] = false;
+	in_use[new_idx] = true;
+
+	if (tfo_eflow_idx(w, &w->oflows[new_idx].flow.ef) != new_idx)
+		error(n, "moved eflow index wrong", new_idx);
+}
+
+int main(int argc, char **argv)
+{
+	struct tcp_worker *w = &worker;
+	struct tfo_eflow *ef;
+	unsigned n, idx;
+	unsigned of_use = 0, moves = 0;
+	bool fill;
+
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+
+	/* As tcp_worker_init() does */
+	w->of_n = NUM_OFLOWS;
+	w->oflows = calloc(NUM_OFLOWS, sizeof(struct tfo_oflow));
+	w->flows = calloc(NUM_EFLOWS - NUM_OFLOWS, sizeof(struct tfo_flow));
+	w->hef = calloc(MAX_BUCKETS, sizeof(struct tfo_eflow_bucket));
+	w->hef_spare = calloc(MAX_BUCKETS, sizeof(struct tfo_eflow_bucket));
+	w->hef_max = MAX_BUCKETS;
+	w->hef_mask = EF_HASH_MIN_BUCKETS - 1;
+
+	/* The keys are unique, the hashes random so that buckets overflow */
+	for (idx = 0; idx < NUM_EFLOWS; idx++) {
+		ef = tfo_eflow_from_idx(w, idx);
+		if (tfo_eflow_idx(w, ef) != idx || tfo_eflow_in_oflows(w, ef) != (idx < NUM_OFLOWS))
+			error(0, "eflow index wrong", idx);
+		ef->priv_addr.s_addr = 0x0a000000 | idx;
+		ef->pub_addr.s_addr = 0xc0a80001;
+		ef->priv_port = 1024 + idx;
+		ef->pub_port = 443;
+	}
+
+	for (n = 0; n < NUM_OPS && errors < 20; n++) {
+		fill = (n / PHASE_OPS) % 2 == 0;
+		idx = random() % NUM_EFLOWS;
+		ef = tfo_eflow_from_idx(w, idx);
+
+		if (!in_use[idx] && (fill || random() % 8 == 0)) {
+			/* As _eflow_alloc() does */
+			if (!eflow_bucket_add(w, ef, random()) &&
+			    (!eflow_hash_grow(w) || !eflow_bucket_add(w, ef, ef->flow_hash))) {
+				error(n, "add failed", idx);
+				continue;
+			}
+			in_use[idx] = true;
+			w->ef_use++;
+			of_use += idx < NUM_OFLOWS;
+		} else if (in_use[idx] && idx >= NUM_OFLOWS && of_use < NUM_OFLOWS && random() % 4 == 0) {
+			move(n, idx);
+			of_use++;
+			moves++;
+		} else if (in_use[idx] && (!fill || random() % 8 == 0)) {
+			if (!eflow_bucket_del_table(w, ef, false) &&
+			    !(w->hef_old && eflow_bucket_del_table(w, ef, true)))
+				error(n, "delete failed", idx);
+			in_use[idx] = false;
+			w->ef_use--;
+			of_use -= idx < NUM_OFLOWS;
+		}
+
+		eflow_hash_maintain(w);
+
+		check(n);
+	}
+
+	printf("%u operations, %u errors, %u eflows, hef_n %u, grow %" PRIu64 " shrink %" PRIu64 " cuckoo moves %" PRIu64 " add fail %" PRIu64 " moved to oflows %u\n",
+		n, errors, w->ef_use, w->hef_mask + 1, w->st.hash_grow, w->st.hash_shrink,
+		w->st.hash_cuckoo_moves, w->st.hash_add_fail, moves);
+	if (!w->st.hash_grow || !w->st.hash_shrink)
+		error(n, "table not resized", 0);
+	if (!moves)
+		error(n, "no eflows moved", 0);
+
+	return !!errors;
+}
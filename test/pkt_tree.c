@@ -0,0 +1,180 @@
+/* Check the pkt_tree gap_after/sub_gap invariants, and the pkt_tree lookups
+ * against a walk of the pktlist, while packets are inserted, erased and have
+ * their seglen changed. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tfo_pkt_tree.h"
+
+/* Packet i can only start at slot i, so packets never overlap, and there
+ * is a hole after a packet if it is shorter than the slot or the next slot
+ * is not in use. The sequence space wraps part way through. */
+#define NUM_PKTS	64
+#define SLOT_LEN	100
+#define BASE_SEQ	(UINT32_MAX - NUM_PKTS / 2 * SLOT_LEN)
+#define NUM_OPS		20000
+
+static struct tfo_pkt pkts[NUM_PKTS];
+static bool in_use[NUM_PKTS];
+static struct tfo_side side;
+static unsigned errors;
+
+static void
+error(const char *op, unsigned n, const char *what, uint32_t seq)
+{
+	printf("op %u (%s): %s, seq 0x%x\n", n, op, what, seq);
+	errors++;
+}
+
+/* Returns the number of packets in the subtree, checking each node and that
+ * an in order walk matches the pktlist */
+static unsigned
+check_subtree(struct rb_node *node, struct list_head **next, const char *op, unsigned n)
+{
+	struct tfo_pkt *pkt;
+	bool sub_gap;
+	bool gap_after;
+	unsigned count;
+
+	if (!node)
+		return 0;
+
+	pkt = rb_entry(node, struct tfo_pkt, seq_node);
+	count = check_subtree(node->rb_left, next, op, n);
+
+	if (*next != &pkt->list)
+		error(op, n, "tree order does not match pktlist", pkt->seq);
+	*next = pkt->list.next;
+
+	gap_after = !list_is_last(&pkt->list, &side.pktlist) &&
+		    before(segend(pkt), list_next_entry(pkt, list)->seq);
+	if (pkt->gap_after != gap_after)
+		error(op, n, "gap_after wrong", pkt->seq);
+
+	count += 1 + check_subtree(node->rb_right, next, op, n);
+
+	sub_gap = pkt->gap_after;
+	if (node->rb_left)
+		sub_gap |= rb_entry(node->rb_left, struct tfo_pkt, seq_node)->sub_gap;
+	if (node->rb_right)
+		sub_gap |= rb_entry(node->rb_right, struct tfo_pkt, seq_node)->sub_gap;
+	if (pkt->sub_gap != sub_gap)
+		error(op, n, "sub_gap wrong", pkt->seq);
+
+	return count;
+}
+
+static void
+check_find(uint32_t seq, const char *op, unsigned n)
+{
+	struct tfo_pkt *pkt;
+	struct tfo_pkt *exp_before = NULL, *exp_gap_before = NULL, *exp_gap_from = NULL;
+
+	list_for_each_entry(pkt, &side.pktlist, list) {
+		if (before(pkt->seq, seq)) {
+			exp_before = pkt;
+			if (pkt->gap_after)
+				exp_gap_before = pkt;
+		} else if (pkt->gap_after && !exp_gap_from)
+			exp_gap_from = pkt;
+	}
+
+	if (pkt_find_before(&side, seq) != exp_before)
+		error(op, n, "pkt_find_before wrong", seq);
+	if (pkt_find_gap_before(side.pkt_tree.rb_node, seq) != exp_gap_before)
+		error(op, n, "pkt_find_gap_before wrong", seq);
+	if (pkt_find_gap_from(side.pkt_tree.rb_node, seq) != exp_gap_from)
+		error(op, n, "pkt_find_gap_from wrong", seq);
+}
+
+static void
+check(const char *op, unsigned n, unsigned nb_in_use)
+{
+	struct list_head *next = side.pktlist.next;
+	unsigned i;
+
+	if (check_subtree(side.pkt_tree.rb_node, &next, op, n) != nb_in_use)
+		error(op, n, "tree size wrong", 0);
+
+	for (i = 0; i < NUM_PKTS; i++) {
+		check_find(BASE_SEQ + i * SLOT_LEN, op, n);
+		check_find(BASE_SEQ + i * SLOT_LEN + 1 + random() % (SLOT_LEN - 1), op, n);
+	}
+	check_find(BASE_SEQ + NUM_PKTS * SLOT_LEN, op, n);
+}
+
+static void
+insert(struct tfo_pkt *pkt)
+{
+	struct tfo_pkt *prev;
+
+	pkt->seglen = 1 + random() % SLOT_LEN;
+	in_use[pkt - pkts] = true;
+
+	/* As queue_pkt() does, add to the pktlist and then the tree */
+	prev = pkt_find_before(&side, pkt->seq);
+	if (prev)
+		list_add(&pkt->list, &prev->list);
+	else
+		list_add(&pkt->list, &side.pktlist);
+	pkt_tree_insert(&side, pkt);
+}
+
+static void
+erase(struct tfo_pkt *pkt)
+{
+	struct tfo_pkt *prev = NULL;
+
+	if (!list_is_first(&pkt->list, &side.pktlist))
+		prev = list_prev_entry(pkt, list);
+
+	pkt_tree_erase(&side, pkt);
+	list_del(&pkt->list);
+	in_use[pkt - pkts] = false;
+
+	if (prev)
+		pkt_update_gap_after(&side, prev);
+}
+
+int main(int argc, char **argv)
+{
+	struct tfo_pkt *pkt;
+	unsigned nb_in_use = 0;
+	unsigned n;
+	const char *op;
+
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+
+	INIT_LIST_HEAD(&side.pktlist);
+	side.pkt_tree = RB_ROOT;
+	for (n = 0; n < NUM_PKTS; n++)
+		pkts[n].seq = BASE_SEQ + n * SLOT_LEN;
+
+	for (n = 0; n < NUM_OPS; n++) {
+		pkt = &pkts[random() % NUM_PKTS];
+
+		if (!in_use[pkt - pkts]) {
+			op = "insert";
+			insert(pkt);
+			nb_in_use++;
+		} else if (random() % 2) {
+			op = "erase";
+			erase(pkt);
+			nb_in_use--;
+		} else {
+			op = "seglen";
+			pkt->seglen = 1 + random() % SLOT_LEN;
+			pkt_update_gap_after(&side, pkt);
+		}
+
+		check(op, n, nb_in_use);
+		if (errors > 20)
+			break;
+	}
+
+	printf("%u operations, %u errors\n", n, errors);
+
+	return !!errors;
+}